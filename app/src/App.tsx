@@ -13,7 +13,11 @@ import {
 } from 'react-native';
 import AsyncStorage from '@react-native-async-storage/async-storage';
 import { useBLE } from './useBLE';
-import { useEffect } from 'react';
+import { TELEMETRY_MODE_COMPRESSED } from './telemetry';
+
+// Re-sync this often while streaming, so the devices can track their drift
+const TIME_SYNC_INTERVAL_MS = 60 * 1000;
+import { useEffect, useState } from 'react';
 
 export default function App() {
   const {
@@ -26,8 +30,22 @@ export default function App() {
     disconnectDevice,
     startStreamingData,
     send,
+    downloadLog,
+    setStreamMode,
+    syncTime,
     state,
+    sample,
   } = useBLE();
+  const [loggedSamples, setLoggedSamples] = useState(0);
+  const [streaming, setStreaming] = useState(false);
+
+  useEffect(() => {
+    if (!connectedDevice || !streaming) return;
+
+    syncTime();
+    const interval = setInterval(syncTime, TIME_SYNC_INTERVAL_MS);
+    return () => clearInterval(interval);
+  }, [connectedDevice, streaming]);
 
   // connect if device id is stored in async storage
   useEffect(() => {
@@ -86,6 +104,7 @@ export default function App() {
                   </Text>
                   <Text style={{ fontSize: 10, color: '#666' }}>
                     {device.id}
+                    {device.rssi !== null && `  ${device.rssi} dBm`}
                   </Text>
                 </TouchableOpacity>
               ))
@@ -105,13 +124,21 @@ export default function App() {
                 {connectedDevice.id}
               </Text>
             </View>
-            <Button title="Start streaming" onPress={startStreamingData} />
+            <Button
+              title="Start streaming"
+              onPress={async () => {
+                await startStreamingData();
+                await setStreamMode(TELEMETRY_MODE_COMPRESSED);
+                setStreaming(true);
+              }}
+            />
 
             <Button
               title="Disconnect"
               onPress={async () => {
                 try {
                   await disconnectDevice();
+                  setStreaming(false);
                   // remove id from async storage
                   await AsyncStorage.removeItem('device_id');
                   Alert.alert('Disconnected');
@@ -148,6 +175,16 @@ export default function App() {
             </View>
 
             <Text>{JSON.stringify(state)}</Text>
+            <Text>{JSON.stringify(sample)}</Text>
+
+            <Button
+              title="Download log"
+              onPress={async () => {
+                const samples = await downloadLog();
+                setLoggedSamples((count) => count + samples.length);
+              }}
+            />
+            <Text>Logged samples: {loggedSamples}</Text>
           </>
         )}
       </ScrollView>
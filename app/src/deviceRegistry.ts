@@ -0,0 +1,100 @@
+// Units seen while scanning, keyed by device id. Advertisements can arrive
+// hundreds of times per second with many units in range, so recording one
+// is a map update in place; the UI gets a sorted copy now and then, and
+// only if something it shows has changed.
+
+import { Device } from 'react-native-ble-plx';
+
+// RSSI jitters by a few dB between advertisements, smaller changes aren't
+// worth a re-render
+const RSSI_PUBLISH_DELTA = 4;
+
+export type DiscoveredDevice = {
+  id: string;
+  name: string | null;
+  rssi: number | null;
+  lastSeenMs: number;
+};
+
+export type DeviceRegistry = {
+  devices: Map<string, DiscoveredDevice>;
+  // RSSI as last published, per device
+  publishedRssi: Map<string, number | null>;
+  changed: boolean;
+};
+
+export const createDeviceRegistry = (): DeviceRegistry => ({
+  devices: new Map(),
+  publishedRssi: new Map(),
+  changed: false,
+});
+
+// Records an advertisement
+export const registryUpdate = (
+  registry: DeviceRegistry,
+  device: Device,
+  nowMs: number
+) => {
+  const entry = registry.devices.get(device.id);
+  const name = device.name ?? device.localName;
+
+  if (!entry) {
+    registry.devices.set(device.id, {
+      id: device.id,
+      name,
+      rssi: device.rssi,
+      lastSeenMs: nowMs,
+    });
+    registry.changed = true;
+    return;
+  }
+
+  entry.lastSeenMs = nowMs;
+  entry.rssi = device.rssi;
+  if (name && name !== entry.name) {
+    entry.name = name;
+    registry.changed = true;
+  }
+
+  const published = registry.publishedRssi.get(device.id);
+  if (
+    published === undefined ||
+    published === null ||
+    entry.rssi === null ||
+    Math.abs(entry.rssi - published) >= RSSI_PUBLISH_DELTA
+  ) {
+    registry.changed = true;
+  }
+};
+
+// Forgets units that haven't advertised for maxAgeMs
+export const registryPrune = (
+  registry: DeviceRegistry,
+  nowMs: number,
+  maxAgeMs: number
+) => {
+  registry.devices.forEach((entry, id) => {
+    if (nowMs - entry.lastSeenMs > maxAgeMs) {
+      registry.devices.delete(id);
+      registry.publishedRssi.delete(id);
+      registry.changed = true;
+    }
+  });
+};
+
+// Returns a copy of the devices, strongest signal first, or null if nothing
+// changed since the last call
+export const registryPublish = (
+  registry: DeviceRegistry
+): DiscoveredDevice[] | null => {
+  if (!registry.changed) return null;
+  registry.changed = false;
+
+  const devices: DiscoveredDevice[] = [];
+  registry.devices.forEach((entry) => {
+    registry.publishedRssi.set(entry.id, entry.rssi);
+    devices.push({ ...entry });
+  });
+  devices.sort((a, b) => (b.rssi ?? -128) - (a.rssi ?? -128));
+  return devices;
+};
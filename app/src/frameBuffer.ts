@@ -0,0 +1,63 @@
+/* eslint-disable no-bitwise */
+
+// Notifications arrive base64 encoded. Decoding them with base64.decode() and
+// a charCodeAt() loop allocates a string and an array per notification,
+// which adds up at the telemetry rate. decodeBase64Into() writes straight
+// into a buffer that is reused for every notification instead.
+
+const BASE64_ALPHABET =
+  'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/';
+const BASE64_INVALID = 0xff;
+
+const base64Lookup = new Uint8Array(128).fill(BASE64_INVALID);
+for (let i = 0; i < BASE64_ALPHABET.length; i++) {
+  base64Lookup[BASE64_ALPHABET.charCodeAt(i)] = i;
+}
+
+// Largest ATT MTU is 517, so this rarely has to grow
+const FRAME_BUFFER_SIZE = 512;
+
+export type FrameBuffer = {
+  bytes: Uint8Array;
+  view: DataView;
+};
+
+export const createFrameBuffer = (
+  size: number = FRAME_BUFFER_SIZE
+): FrameBuffer => {
+  const bytes = new Uint8Array(size);
+  return { bytes, view: new DataView(bytes.buffer) };
+};
+
+// Decodes base64 text into buffer.bytes, growing it if it is too small.
+// Returns the number of bytes decoded, -1 if text isn't valid base64. The
+// bytes are only valid until the next call.
+export const decodeBase64Into = (buffer: FrameBuffer, text: string): number => {
+  let end = text.length;
+  while (end > 0 && text.charCodeAt(end - 1) === 0x3d) end--; // '='
+
+  const length = Math.floor((end * 3) / 4);
+  if (length > buffer.bytes.length) {
+    buffer.bytes = new Uint8Array(length * 2);
+    buffer.view = new DataView(buffer.bytes.buffer);
+  }
+
+  const bytes = buffer.bytes;
+  let bits = 0;
+  let count = 0;
+  let out = 0;
+  for (let i = 0; i < end; i++) {
+    const c = text.charCodeAt(i);
+    const value = c < 128 ? base64Lookup[c] : BASE64_INVALID;
+    if (value === BASE64_INVALID) return -1;
+
+    bits = (bits << 6) | value;
+    count += 6;
+    if (count >= 8) {
+      count -= 8;
+      bytes[out++] = (bits >> count) & 0xff;
+    }
+  }
+
+  return out;
+};
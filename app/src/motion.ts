@@ -0,0 +1,22 @@
+// PIR edges as the unit captures them, see FRAME_TYPE_MOTION in
+// pico/protocol.h
+
+export const FRAME_TYPE_MOTION = 'M'.charCodeAt(0);
+
+export type Motion = {
+  level: boolean;
+  localUs: number; // unit's clock at the edge, low 32 bits
+  edges: number; // since the previous motion frame, more than 1 if coalesced
+  windowCount: number; // rising edges in the unit's current window
+};
+
+export const decodeMotion = (view: DataView, length: number): Motion | null => {
+  if (length < 9) return null;
+
+  return {
+    level: view.getUint8(1) !== 0,
+    localUs: view.getUint32(2, true),
+    edges: view.getUint8(6),
+    windowCount: view.getUint16(7, true),
+  };
+};
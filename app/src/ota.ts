@@ -0,0 +1,95 @@
+/* eslint-disable no-bitwise */
+
+// Phone side of the firmware update service, see pico/ota.h. The image goes
+// out as write-without-response packets that fill the MTU, at most
+// OTA_WINDOW_SIZE bytes ahead of what the unit has acknowledged.
+
+export const OTA_SERVICE = '4e540010-6e65-7920-7461-636b00000000';
+export const OTA_CHARACTERISTIC_CONTROL =
+  '4e540011-6e65-7920-7461-636b00000000';
+export const OTA_CHARACTERISTIC_DATA = '4e540012-6e65-7920-7461-636b00000000';
+
+export const CMD_OTA_BEGIN = 'B'.charCodeAt(0);
+export const CMD_OTA_APPLY = 'A'.charCodeAt(0);
+export const CMD_OTA_ABORT = 'X'.charCodeAt(0);
+
+export const OTA_STATUS_IDLE = 0;
+export const OTA_STATUS_RECEIVING = 1;
+export const OTA_STATUS_RESYNC = 2;
+export const OTA_STATUS_VERIFYING = 3;
+export const OTA_STATUS_VERIFIED = 4;
+export const OTA_STATUS_ERROR_SIZE = 5;
+export const OTA_STATUS_ERROR_CRC = 6;
+export const OTA_STATUS_ERROR_STATE = 7;
+
+// One flash sector, the unit's receive buffer
+export const OTA_WINDOW_SIZE = 4096;
+export const OTA_DATA_HEADER_LEN = 4;
+// Largest MTU Android lets us ask for, fits one 251 byte LL packet
+export const OTA_MTU = 247;
+// No acknowledgement for this long, resend from the last one
+export const OTA_ACK_TIMEOUT_MS = 2000;
+
+export type OtaStatus = {
+  status: number;
+  received: number;
+  elapsedMs: number;
+};
+
+export type OtaResult = {
+  bytes: number;
+  elapsedMs: number; // on the unit, from OTA_CMD_BEGIN until verified
+  bytesPerSecond: number;
+};
+
+const crcTable = new Uint32Array(256);
+for (let i = 0; i < 256; i++) {
+  let crc = i;
+  for (let bit = 0; bit < 8; bit++) {
+    crc = crc & 1 ? (crc >>> 1) ^ 0xedb88320 : crc >>> 1;
+  }
+  crcTable[i] = crc;
+}
+
+// CRC-32 as zlib computes it, the unit checks the staged image against this
+export const crc32 = (bytes: Uint8Array): number => {
+  let crc = 0xffffffff;
+  for (let i = 0; i < bytes.length; i++) {
+    crc = (crc >>> 8) ^ crcTable[(crc ^ bytes[i]) & 0xff];
+  }
+  return (crc ^ 0xffffffff) >>> 0;
+};
+
+export const encodeOtaBegin = (image: Uint8Array): Uint8Array => {
+  const command = new Uint8Array(9);
+  const view = new DataView(command.buffer);
+  command[0] = CMD_OTA_BEGIN;
+  view.setUint32(1, image.length, true);
+  view.setUint32(5, crc32(image), true);
+  return command;
+};
+
+// Data packet carrying image bytes [offset, offset + length)
+export const encodeOtaData = (
+  image: Uint8Array,
+  offset: number,
+  length: number
+): Uint8Array => {
+  const packet = new Uint8Array(OTA_DATA_HEADER_LEN + length);
+  new DataView(packet.buffer).setUint32(0, offset, true);
+  packet.set(image.subarray(offset, offset + length), OTA_DATA_HEADER_LEN);
+  return packet;
+};
+
+export const decodeOtaStatus = (
+  view: DataView,
+  length: number
+): OtaStatus | null => {
+  if (length < 9) return null;
+
+  return {
+    status: view.getUint8(0),
+    received: view.getUint32(1, true),
+    elapsedMs: view.getUint32(5, true),
+  };
+};
@@ -0,0 +1,120 @@
+/* eslint-disable no-bitwise */
+
+// Decoder for the device's flash sample log, see pico/sample_log.h and
+// pico/sample_codec.h for the format.
+
+export const SAMPLE_LOG_PAGE_SIZE = 256;
+
+const SAMPLE_LOG_PAGE_MAGIC = 0x544e;
+const SAMPLE_LOG_HEADER_SIZE = 26;
+
+const SAMPLE_TOKEN_RUN = 0x01;
+const SAMPLE_TOKEN_SMALL = 0x02;
+
+export type Sample = {
+  ch0: number;
+  ch1: number;
+  pir: number;
+};
+
+export type LogSample = Sample & {
+  boot: number;
+  timeMs: number;
+};
+
+export const zigzagDecode = (value: number) => (value >>> 1) ^ -(value & 1);
+
+// Reads a varint at offset. Returns [value, bytes consumed], consumed is 0 on
+// truncation.
+export const readVarint = (
+  bytes: Uint8Array,
+  offset: number,
+  end: number
+): [number, number] => {
+  let result = 0;
+  for (let n = 0; n < 5 && offset + n < end; n++) {
+    const byte = bytes[offset + n];
+    result += (byte & 0x7f) * 2 ** (7 * n);
+    if (!(byte & 0x80)) {
+      return [result, n + 1];
+    }
+  }
+  return [0, 0];
+};
+
+// Decodes one sample codec token into prev. Returns [repeat, bytes consumed].
+export const decodeSampleToken = (
+  bytes: Uint8Array,
+  offset: number,
+  end: number,
+  prev: Sample
+): [number, number] => {
+  if (offset >= end) return [0, 0];
+
+  const first = bytes[offset];
+  if ((first & 0x03) === SAMPLE_TOKEN_SMALL) {
+    prev.ch0 = (prev.ch0 + zigzagDecode((first >> 3) & 0x07)) & 0xffff;
+    prev.ch1 = (prev.ch1 + zigzagDecode(first >> 6)) & 0xffff;
+    prev.pir = (first >> 2) & 1;
+    return [1, 1];
+  }
+
+  const [token, n] = readVarint(bytes, offset, end);
+  if (n === 0) return [0, 0];
+
+  if (token & SAMPLE_TOKEN_RUN) {
+    return [Math.floor(token / 2), n];
+  }
+
+  const [z1, m] = readVarint(bytes, offset + n, end);
+  if (m === 0) return [0, 0];
+
+  prev.ch0 = (prev.ch0 + zigzagDecode(Math.floor(token / 8))) & 0xffff;
+  prev.ch1 = (prev.ch1 + zigzagDecode(z1)) & 0xffff;
+  prev.pir = (token >> 2) & 1;
+  return [1, n + m];
+};
+
+// Decodes a downloaded log. bytes must start at a page boundary, pages that
+// are erased or cut short are skipped.
+export const decodeSampleLog = (bytes: Uint8Array): LogSample[] => {
+  const samples: LogSample[] = [];
+  const view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+
+  for (
+    let page = 0;
+    page + SAMPLE_LOG_PAGE_SIZE <= bytes.length;
+    page += SAMPLE_LOG_PAGE_SIZE
+  ) {
+    if (view.getUint16(page, true) !== SAMPLE_LOG_PAGE_MAGIC) continue;
+
+    const boot = view.getUint16(page + 2, true);
+    const timeMs = view.getUint32(page + 8, true);
+    const intervalMs = view.getUint16(page + 12, true);
+    const payloadLen = view.getUint16(page + 14, true);
+    const sampleCount = view.getUint32(page + 16, true);
+    const prev: Sample = {
+      ch0: view.getUint16(page + 20, true),
+      ch1: view.getUint16(page + 22, true),
+      pir: bytes[page + 24],
+    };
+
+    let index = 0;
+    const push = () => {
+      samples.push({ ...prev, boot, timeMs: timeMs + index * intervalMs });
+      index++;
+    };
+    push();
+
+    let offset = page + SAMPLE_LOG_HEADER_SIZE;
+    const end = offset + payloadLen;
+    while (offset < end && index < sampleCount) {
+      const [repeat, consumed] = decodeSampleToken(bytes, offset, end, prev);
+      if (consumed === 0) break;
+      offset += consumed;
+      for (let i = 0; i < repeat; i++) push();
+    }
+  }
+
+  return samples;
+};
@@ -0,0 +1,111 @@
+/* eslint-disable no-bitwise */
+
+// Decoder for the live sample stream, see pico/telemetry.h for the format.
+// Compressed frames use the sample log's tokens.
+
+import { decodeSampleToken, Sample } from './sampleLog';
+
+export const FRAME_TYPE_SAMPLES_RAW = 'R'.charCodeAt(0);
+export const FRAME_TYPE_SAMPLES = 'T'.charCodeAt(0);
+
+export const TELEMETRY_MODE_OFF = 0;
+export const TELEMETRY_MODE_RAW = 1;
+export const TELEMETRY_MODE_COMPRESSED = 2;
+
+const TELEMETRY_FLAG_KEYFRAME = 0x01;
+
+// Most samples a frame can hold, the count is a byte
+const TELEMETRY_MAX_SAMPLES = 255;
+
+export type TelemetryDecoder = {
+  synced: boolean;
+  nextSeq: number;
+  prev: Sample;
+  // Decoded samples, reused for every frame
+  samples: Sample[];
+};
+
+export const createTelemetryDecoder = (): TelemetryDecoder => ({
+  synced: false,
+  nextSeq: 0,
+  prev: { ch0: 0, ch1: 0, pir: 0 },
+  samples: Array.from({ length: TELEMETRY_MAX_SAMPLES }, () => ({
+    ch0: 0,
+    ch1: 0,
+    pir: 0,
+  })),
+});
+
+const readUint16 = (bytes: Uint8Array, offset: number) =>
+  bytes[offset] | (bytes[offset + 1] << 8);
+
+const setSample = (sample: Sample, from: Sample) => {
+  sample.ch0 = from.ch0;
+  sample.ch1 = from.ch1;
+  sample.pir = from.pir;
+};
+
+// Decodes a raw or compressed sample frame from the first length bytes of
+// bytes into dec.samples, without allocating. Returns the number of samples,
+// 0 if the frame is malformed or we have to wait for the next keyframe. The
+// samples are overwritten by the next frame.
+export const decodeTelemetryFrame = (
+  dec: TelemetryDecoder,
+  bytes: Uint8Array,
+  length: number = bytes.length
+): number => {
+  const samples = dec.samples;
+
+  if (bytes[0] === FRAME_TYPE_SAMPLES_RAW) {
+    const count = bytes[2];
+    if (length < 3 || 3 + count * 5 > length) return 0;
+
+    for (let i = 0; i < count; i++) {
+      const offset = 3 + i * 5;
+      samples[i].ch0 = readUint16(bytes, offset);
+      samples[i].ch1 = readUint16(bytes, offset + 2);
+      samples[i].pir = bytes[offset + 4];
+    }
+    return count;
+  }
+
+  if (bytes[0] !== FRAME_TYPE_SAMPLES || length < 4) return 0;
+
+  const seq = bytes[1];
+  const flags = bytes[2];
+  const count = bytes[3];
+  const prev = dec.prev;
+  let decoded = 0;
+  let offset = 4;
+
+  const fail = () => {
+    dec.synced = false;
+    return 0;
+  };
+
+  if (flags & TELEMETRY_FLAG_KEYFRAME) {
+    if (length < 9 || count === 0) return fail();
+    prev.ch0 = readUint16(bytes, 4);
+    prev.ch1 = readUint16(bytes, 6);
+    prev.pir = bytes[8];
+    setSample(samples[decoded++], prev);
+    offset = 9;
+    dec.synced = true;
+  } else if (!dec.synced || seq !== dec.nextSeq) {
+    return fail();
+  }
+
+  while (decoded < count) {
+    const [repeat, n] = decodeSampleToken(bytes, offset, length, prev);
+    if (n === 0 || repeat > count - decoded) return fail();
+    offset += n;
+
+    for (let i = 0; i < repeat; i++) {
+      setSample(samples[decoded++], prev);
+    }
+  }
+
+  dec.nextSeq = (seq + 1) & 0xff;
+
+  return count;
+};
@@ -0,0 +1,62 @@
+/* eslint-disable no-bitwise */
+
+// Phone side of the shared time base, see pico/sync_clock.h. The phone's
+// clock is the shared time: we ping the unit a few times, keep the exchange
+// with the shortest round trip and assume the unit took its timestamp half
+// way through it.
+
+export const FRAME_TYPE_TIME_PONG = 'Y'.charCodeAt(0);
+export const CMD_TIME_PING = 'Y'.charCodeAt(0);
+export const CMD_TIME_SET = 'O'.charCodeAt(0);
+
+export const TIME_SYNC_PINGS = 8;
+export const TIME_SYNC_PONG_TIMEOUT_MS = 1000;
+
+export type TimeSyncPoint = {
+  roundTripMs: number;
+  localUs: number; // unit's clock, low 32 bits
+  sharedMs: number; // phone's clock at localUs, low 32 bits
+};
+
+export const nowMs32 = () => Date.now() >>> 0;
+
+export const encodeTimePing = (phoneMs: number): Uint8Array => {
+  const command = new Uint8Array(5);
+  command[0] = CMD_TIME_PING;
+  new DataView(command.buffer).setUint32(1, phoneMs, true);
+  return command;
+};
+
+export const encodeTimeSet = (point: TimeSyncPoint): Uint8Array => {
+  const command = new Uint8Array(9);
+  const view = new DataView(command.buffer);
+  command[0] = CMD_TIME_SET;
+  view.setUint32(1, point.localUs, true);
+  view.setUint32(5, point.sharedMs, true);
+  return command;
+};
+
+// Turns a pong into a sync point, using the phone time it arrived at
+export const decodeTimePong = (
+  bytes: Uint8Array,
+  receivedMs: number
+): TimeSyncPoint | null => {
+  if (bytes[0] !== FRAME_TYPE_TIME_PONG || bytes.length < 9) return null;
+
+  const view = new DataView(bytes.buffer, bytes.byteOffset, bytes.byteLength);
+  const phoneMs = view.getUint32(1, true);
+  const localUs = view.getUint32(5, true);
+  const roundTripMs = (receivedMs - phoneMs) >>> 0;
+
+  return {
+    roundTripMs,
+    localUs,
+    sharedMs: (phoneMs + Math.floor(roundTripMs / 2)) >>> 0,
+  };
+};
+
+export const betterSyncPoint = (
+  best: TimeSyncPoint | null,
+  point: TimeSyncPoint
+): TimeSyncPoint =>
+  !best || point.roundTripMs < best.roundTripMs ? point : best;
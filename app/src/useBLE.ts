@@ -1,10 +1,58 @@
 /* eslint-disable no-bitwise */
 
 import * as ExpoDevice from 'expo-device';
-import { useMemo, useRef, useState } from 'react';
+import { useEffect, useMemo, useRef, useState } from 'react';
 import { PermissionsAndroid, Platform } from 'react-native';
 import base64 from 'react-native-base64';
 import { BleManager, Device, Subscription } from 'react-native-ble-plx';
+import {
+  createDeviceRegistry,
+  DiscoveredDevice,
+  registryPrune,
+  registryPublish,
+  registryUpdate,
+} from './deviceRegistry';
+import { createFrameBuffer, decodeBase64Into } from './frameBuffer';
+import { decodeMotion, FRAME_TYPE_MOTION, Motion } from './motion';
+import {
+  CMD_OTA_ABORT,
+  CMD_OTA_APPLY,
+  decodeOtaStatus,
+  encodeOtaBegin,
+  encodeOtaData,
+  OTA_ACK_TIMEOUT_MS,
+  OTA_CHARACTERISTIC_CONTROL,
+  OTA_CHARACTERISTIC_DATA,
+  OTA_DATA_HEADER_LEN,
+  OTA_MTU,
+  OTA_SERVICE,
+  OTA_STATUS_RECEIVING,
+  OTA_STATUS_RESYNC,
+  OTA_STATUS_VERIFIED,
+  OTA_STATUS_VERIFYING,
+  OTA_WINDOW_SIZE,
+  OtaResult,
+  OtaStatus,
+} from './ota';
+import { decodeSampleLog, LogSample, Sample } from './sampleLog';
+import {
+  createTelemetryDecoder,
+  decodeTelemetryFrame,
+  FRAME_TYPE_SAMPLES,
+  FRAME_TYPE_SAMPLES_RAW,
+} from './telemetry';
+import {
+  betterSyncPoint,
+  decodeTimePong,
+  encodeTimePing,
+  encodeTimeSet,
+  FRAME_TYPE_TIME_PONG,
+  nowMs32,
+  TIME_SYNC_PINGS,
+  TIME_SYNC_PONG_TIMEOUT_MS,
+  TimeSyncPoint,
+} from './timeSync';
+import { useFrameState } from './useFrameState';
 
 const logWithThrottle = (msg: any, delay: number) => {
   const now = Date.now();
@@ -23,33 +71,131 @@ const PICO_SERVICE = '6e400001-b5a3-f393-e0a9-e50e24dcca9e';
 const PICO_CHARACTERISTIC_TX = '6e400002-b5a3-f393-e0a9-e50e24dcca9e';
 const PICO_CHARACTERISTIC_RX = '6e400003-b5a3-f393-e0a9-e50e24dcca9e';
 
+// Scan list refresh, and how long a unit stays listed after its last
+// advertisement
+const SCAN_PUBLISH_INTERVAL_MS = 500;
+const SCAN_DEVICE_TIMEOUT_MS = 10 * 1000;
+
+// See pico/protocol.h
+const FRAME_TYPE_STATE = 'S'.charCodeAt(0);
+const FRAME_TYPE_LOG = 'L'.charCodeAt(0);
+const CMD_LOG_DOWNLOAD = 'D'.charCodeAt(0);
+const CMD_STREAM_MODE = 'M'.charCodeAt(0);
+const CMD_SET_PATTERN = 'W'.charCodeAt(0);
+
+// How a pattern step drives the LED, see pico/led_pwm.h
+export const LED_ENVELOPE_STEP = 0;
+export const LED_ENVELOPE_FADE_IN = 1;
+export const LED_ENVELOPE_FADE_OUT = 2;
+export const LED_ENVELOPE_BREATHE = 3;
+
+export type PatternStep = {
+  durationMs: number;
+  envelope: number;
+};
+
 type State = {
   active: boolean;
   flashIndex: number;
   pattern: number[];
+  envelopes: number[];
 };
 
 interface BluetoothLowEnergyApi {
   requestPermissions(): Promise<boolean>;
   scanForPeripherals(): void;
   stopScanningForPeripherals(): void;
-  allDevices: Device[];
+  allDevices: DiscoveredDevice[];
   connectedDevice: Device | null;
   connectToDevice(id: string): Promise<void>;
   disconnectDevice(): Promise<void>;
   startStreamingData(): void;
   send(data: any): Promise<void>;
+  downloadLog(): Promise<LogSample[]>;
+  setStreamMode(mode: number, maxLatencyMs?: number): Promise<void>;
+  syncTime(): Promise<TimeSyncPoint | null>;
+  setPattern(steps: PatternStep[]): Promise<void>;
+  updateFirmware(
+    image: Uint8Array,
+    onProgress?: (received: number, total: number) => void
+  ): Promise<OtaResult | null>;
   state: State | null;
+  sample: Sample | null;
+  motion: Motion | null;
 }
 
+// Decodes a state frame from the first length bytes of view
+const decodeState = (view: DataView, length: number): State | null => {
+  if (length < 4) return null;
+
+  const active = view.getUint8(1);
+  const flashIndex = view.getUint8(2);
+  const patternLength = Math.min(view.getUint8(3), 16);
+  if (length < 4 + patternLength * 2) return null;
+
+  const pattern = new Array(patternLength);
+  for (let i = 0; i < patternLength; i++) {
+    pattern[i] = view.getUint16(4 + i * 2);
+  }
+  // Envelopes follow all 16 pattern slots, older firmware has none
+  const offset = 4 + 16 * 2;
+  const envelopes = new Array(patternLength).fill(LED_ENVELOPE_STEP);
+  if (length >= offset + 16) {
+    for (let i = 0; i < patternLength; i++) {
+      envelopes[i] = view.getUint8(offset + i);
+    }
+  }
+
+  return { active: !!active, flashIndex, pattern, envelopes };
+};
+
+// The scan filter isn't applied on every platform and Android version
+const advertisesService = (device: Device, uuid: string) =>
+  !!device.serviceUUIDs?.some(
+    (serviceUuid) => serviceUuid.toLowerCase() === uuid
+  );
+
+// The telemetry decoder reuses its samples, React needs its own copy
+const copySample = (sample: Sample | null) => sample && { ...sample };
+
+type LogDownload = {
+  chunks: Uint8Array[];
+  nextOffset: number | null;
+  resolve: ((samples: LogSample[]) => void) | null;
+};
+
 export function useBLE(): BluetoothLowEnergyApi {
   const bleManager = useMemo(() => new BleManager(), []);
   const [connectedDevice, setConnectedDevice] = useState<Device | null>(null);
 
-  const [allDevices, setAllDevices] = useState<Device[]>([]);
-  const [state, setState] = useState<State | null>(null);
+  const [allDevices, setAllDevices] = useState<DiscoveredDevice[]>([]);
+  const deviceRegistryRef = useRef(createDeviceRegistry());
+  const scanPublishTimerRef = useRef<ReturnType<typeof setInterval> | null>(
+    null
+  );
+  // These change with every notification, they are rendered once per frame
+  const [state, setState] = useFrameState<State | null>(null);
+  const [sample, setSample] = useFrameState<Sample | null>(null, copySample);
+  const [motion, setMotion] = useFrameState<Motion | null>(null);
+  const frameBufferRef = useRef(createFrameBuffer());
+  const telemetryDecoderRef = useRef(createTelemetryDecoder());
   const subscriptionRef = useRef<Subscription | null>(null);
   const lastDataRef = useRef<string>('');
+  const pongRef = useRef<((point: TimeSyncPoint) => void) | null>(null);
+  const logDownloadRef = useRef<LogDownload>({
+    chunks: [],
+    nextOffset: null,
+    resolve: null,
+  });
+
+  useEffect(
+    () => () => {
+      if (scanPublishTimerRef.current) {
+        clearInterval(scanPublishTimerRef.current);
+      }
+    },
+    []
+  );
 
   const requestAndroid31Permissions = async () => {
     const bluetoothScanPermission = await PermissionsAndroid.request(
@@ -105,42 +251,69 @@ export function useBLE(): BluetoothLowEnergyApi {
     return true;
   };
 
-  const isDuplicateDevice = (devices: Device[], nextDevice: Device) => {
-    return devices.find((device) => device.id === nextDevice.id);
+  // Advertisements only go into the registry, the list is published to the
+  // UI every SCAN_PUBLISH_INTERVAL_MS if it changed
+  const publishDevices = () => {
+    const registry = deviceRegistryRef.current;
+    registryPrune(registry, Date.now(), SCAN_DEVICE_TIMEOUT_MS);
+    const devices = registryPublish(registry);
+    if (devices) setAllDevices(devices);
   };
 
   const scanForPeripherals = async () => {
-    bleManager.startDeviceScan(null, null, async (error, device) => {
-      if (error) {
-        console.log(error);
-        return;
-      }
+    // Units we are already connected to don't advertise
+    const connected = await bleManager.connectedDevices([PICO_SERVICE]);
+    if (connected.length > 0) {
+      setConnectedDevice(connected[0]);
+    }
 
-      if (device) {
-        if (await device.isConnected()) {
-          setConnectedDevice(device);
-        }
+    if (scanPublishTimerRef.current) {
+      clearInterval(scanPublishTimerRef.current);
+    }
+    scanPublishTimerRef.current = setInterval(
+      publishDevices,
+      SCAN_PUBLISH_INTERVAL_MS
+    );
 
-        setAllDevices((prevDevices) => {
-          if (isDuplicateDevice(prevDevices, device)) {
-            return prevDevices;
-          }
+    // Only Ney Tack units, they advertise the SPP service
+    bleManager.startDeviceScan(
+      [PICO_SERVICE],
+      { allowDuplicates: true },
+      (error, device) => {
+        if (error) {
+          console.log(error);
+          return;
+        }
 
-          return [...prevDevices, device];
-        });
+        if (device && advertisesService(device, PICO_SERVICE)) {
+          registryUpdate(deviceRegistryRef.current, device, Date.now());
+        }
       }
-    });
+    );
   };
 
   const stopScanningForPeripherals = () => {
     bleManager.stopDeviceScan();
+    if (scanPublishTimerRef.current) {
+      clearInterval(scanPublishTimerRef.current);
+      scanPublishTimerRef.current = null;
+    }
+    publishDevices();
   };
 
   const connectToDevice = async (deviceId: string) => {
     try {
+      const startMs = Date.now();
       const device = await bleManager.connectToDevice(deviceId);
+      const connectedMs = Date.now();
       setConnectedDevice(device);
+      // Served from the GATT cache once bonded, the unit's database hash
+      // tells the phone when that is out of date
       await device.discoverAllServicesAndCharacteristics();
+      console.log(
+        `Connected in ${connectedMs - startMs} ms, ` +
+          `services discovered in ${Date.now() - connectedMs} ms`
+      );
     } catch (error) {
       console.log(error);
     }
@@ -186,41 +359,295 @@ export function useBLE(): BluetoothLowEnergyApi {
 
         lastDataRef.current = characteristic.value;
 
-        const rawData = base64.decode(characteristic.value);
+        const frame = frameBufferRef.current;
+        const length = decodeBase64Into(frame, characteristic.value);
+        if (length <= 0) {
+          return;
+        }
+        const bytes = frame.bytes;
 
-        const u8_arr = new Uint8Array(rawData.length);
-        for (let i = 0; i < rawData.length; i++) {
-          u8_arr[i] = rawData.charCodeAt(i);
+        if (bytes[0] === FRAME_TYPE_TIME_PONG) {
+          const point = decodeTimePong(bytes.subarray(0, length), nowMs32());
+          if (point) pongRef.current?.(point);
+          return;
         }
 
-        // console.log(u8_arr);
-        // logWithThrottle(u8_arr, 1000);
-        const buffer = u8_arr.buffer;
+        if (bytes[0] === FRAME_TYPE_MOTION) {
+          const decoded = decodeMotion(frame.view, length);
+          if (decoded) setMotion(decoded);
+          return;
+        }
 
-        const dataView = new DataView(buffer);
+        if (bytes[0] === FRAME_TYPE_LOG) {
+          if (length >= 5) {
+            handleLogFrame(
+              frame.view.getUint32(1, true),
+              bytes.subarray(5, length)
+            );
+          }
+          return;
+        }
 
-        let offset = 0;
-        const active = dataView.getUint8(offset);
-        offset += 1;
-        const flashIndex = dataView.getUint8(offset);
-        offset += 1;
-        const pattern_length = dataView.getUint8(offset);
-        offset += 1;
-        let pattern = new Array(pattern_length);
-        for (let i = 0; i < pattern_length; i++) {
-          pattern[i] = dataView.getUint16(offset);
-          offset += 2;
+        if (
+          bytes[0] === FRAME_TYPE_SAMPLES ||
+          bytes[0] === FRAME_TYPE_SAMPLES_RAW
+        ) {
+          const decoder = telemetryDecoderRef.current;
+          const count = decodeTelemetryFrame(decoder, bytes, length);
+          if (count > 0) {
+            setSample(decoder.samples[count - 1]);
+          }
+          return;
         }
 
-        setState({
-          active: !!active,
-          flashIndex,
-          pattern,
-        });
+        if (bytes[0] === FRAME_TYPE_STATE) {
+          const decoded = decodeState(frame.view, length);
+          if (decoded) setState(decoded);
+        }
       }
     );
   };
 
+  const handleLogFrame = (offset: number, data: Uint8Array) => {
+    const download = logDownloadRef.current;
+
+    if (data.length === 0) {
+      // End of log
+      const bytes = new Uint8Array(
+        download.chunks.reduce((len, chunk) => len + chunk.length, 0)
+      );
+      let position = 0;
+      for (const chunk of download.chunks) {
+        bytes.set(chunk, position);
+        position += chunk.length;
+      }
+      download.chunks = [];
+      download.nextOffset = offset;
+      download.resolve?.(decodeSampleLog(bytes));
+      download.resolve = null;
+      return;
+    }
+
+    if (download.nextOffset !== null && offset !== download.nextOffset) {
+      // The data we asked for has been overwritten, start over from here
+      download.chunks = [];
+    }
+
+    // data is part of the reused frame buffer
+    download.chunks.push(data.slice());
+    download.nextOffset = offset + data.length;
+  };
+
+  // Downloads the part of the device's sample log we haven't seen yet. If a
+  // previous download was interrupted it continues where that one stopped.
+  const downloadLog = async () => {
+    const download = logDownloadRef.current;
+    const offset = download.nextOffset ?? 0;
+
+    const command = new Uint8Array(5);
+    command[0] = CMD_LOG_DOWNLOAD;
+    new DataView(command.buffer).setUint32(1, offset, true);
+
+    const samples = new Promise<LogSample[]>((resolve) => {
+      download.resolve = resolve;
+    });
+    await send(command);
+
+    return samples;
+  };
+
+  // Selects the live sample stream encoding, one of the TELEMETRY_MODE_* values.
+  // Samples wait at most maxLatencyMs for a fuller notification, 1 s if left
+  // out.
+  const setStreamMode = async (mode: number, maxLatencyMs?: number) => {
+    telemetryDecoderRef.current = createTelemetryDecoder();
+    if (maxLatencyMs === undefined) {
+      await send(new Uint8Array([CMD_STREAM_MODE, mode]));
+      return;
+    }
+    const command = new Uint8Array(4);
+    command[0] = CMD_STREAM_MODE;
+    command[1] = mode;
+    new DataView(command.buffer).setUint16(2, maxLatencyMs, true);
+    await send(command);
+  };
+
+  // Syncs the device's clock to ours, which aligns pattern playback with all
+  // other units synced from this phone. Needs startStreamingData() for the
+  // pongs. Returns the sync point used, null if no pong came back.
+  const syncTime = async () => {
+    let best: TimeSyncPoint | null = null;
+
+    for (let i = 0; i < TIME_SYNC_PINGS; i++) {
+      const pong = new Promise<TimeSyncPoint | null>((resolve) => {
+        const timeout = setTimeout(
+          () => resolve(null),
+          TIME_SYNC_PONG_TIMEOUT_MS
+        );
+        pongRef.current = (point) => {
+          clearTimeout(timeout);
+          resolve(point);
+        };
+      });
+      await send(encodeTimePing(nowMs32()));
+
+      const point = await pong;
+      if (point) best = betterSyncPoint(best, point);
+    }
+    pongRef.current = null;
+
+    if (best) {
+      await send(encodeTimeSet(best));
+    }
+    return best;
+  };
+
+  // Replaces the device's pattern, up to 16 steps
+  const setPattern = async (steps: PatternStep[]) => {
+    const command = new Uint8Array(2 + steps.length * 3);
+    const view = new DataView(command.buffer);
+    command[0] = CMD_SET_PATTERN;
+    command[1] = steps.length;
+    steps.forEach((step, i) => {
+      view.setUint16(2 + i * 3, step.durationMs, true);
+      command[4 + i * 3] = step.envelope;
+    });
+    await send(command);
+  };
+
+  // Sends a new firmware image and, once the unit has verified it, tells it
+  // to install it and reboot, which ends the connection. onProgress gets the
+  // bytes the unit has acknowledged. Returns the unit's timing, null if the
+  // update failed.
+  const updateFirmware = async (
+    image: Uint8Array,
+    onProgress?: (received: number, total: number) => void
+  ): Promise<OtaResult | null> => {
+    if (!connectedDevice) {
+      console.log('No connected device');
+      return null;
+    }
+
+    const startMs = Date.now();
+    const device = await connectedDevice.requestMTU(OTA_MTU);
+    const chunkLength = device.mtu - 3 - OTA_DATA_HEADER_LEN;
+
+    // Statuses as they arrive, wake() is set while we wait for one
+    const statuses: OtaStatus[] = [];
+    let wake: (() => void) | null = null;
+    const statusBuffer = createFrameBuffer(16);
+    const subscription = device.monitorCharacteristicForService(
+      OTA_SERVICE,
+      OTA_CHARACTERISTIC_CONTROL,
+      (error, characteristic) => {
+        if (error || !characteristic?.value) {
+          wake?.();
+          return;
+        }
+        const length = decodeBase64Into(statusBuffer, characteristic.value);
+        const status = decodeOtaStatus(statusBuffer.view, length);
+        if (status) statuses.push(status);
+        wake?.();
+      }
+    );
+    const nextStatus = (timeoutMs: number) =>
+      new Promise<OtaStatus | null>((resolve) => {
+        if (statuses.length) {
+          resolve(statuses.shift()!);
+          return;
+        }
+        const timeout = setTimeout(() => {
+          wake = null;
+          resolve(null);
+        }, timeoutMs);
+        wake = () => {
+          clearTimeout(timeout);
+          wake = null;
+          resolve(statuses.shift() ?? null);
+        };
+      });
+    const control = (command: Uint8Array) =>
+      device.writeCharacteristicWithResponseForService(
+        OTA_SERVICE,
+        OTA_CHARACTERISTIC_CONTROL,
+        base64.encodeFromByteArray(command)
+      );
+
+    try {
+      await control(encodeOtaBegin(image));
+
+      let acked = 0;
+      let sent = 0;
+      let result: OtaResult | null = null;
+      while (!result) {
+        // Fill the window, then wait for the unit to program a buffer
+        while (sent < image.length && sent < acked + OTA_WINDOW_SIZE) {
+          const length = Math.min(
+            chunkLength,
+            image.length - sent,
+            acked + OTA_WINDOW_SIZE - sent
+          );
+          await device.writeCharacteristicWithoutResponseForService(
+            OTA_SERVICE,
+            OTA_CHARACTERISTIC_DATA,
+            base64.encodeFromByteArray(encodeOtaData(image, sent, length))
+          );
+          sent += length;
+          if (statuses.length) break;
+        }
+
+        const status = await nextStatus(OTA_ACK_TIMEOUT_MS);
+        if (!status) {
+          // Lost data or a lost acknowledgement, the unit resyncs us
+          sent = acked;
+          continue;
+        }
+
+        switch (status.status) {
+          case OTA_STATUS_RECEIVING:
+            acked = Math.max(acked, status.received);
+            onProgress?.(acked, image.length);
+            break;
+          case OTA_STATUS_RESYNC:
+            acked = status.received;
+            sent = status.received;
+            break;
+          case OTA_STATUS_VERIFYING:
+            acked = image.length;
+            sent = image.length;
+            onProgress?.(image.length, image.length);
+            break;
+          case OTA_STATUS_VERIFIED:
+            result = {
+              bytes: image.length,
+              elapsedMs: status.elapsedMs,
+              bytesPerSecond: Math.round(
+                (image.length * 1000) / Math.max(status.elapsedMs, 1)
+              ),
+            };
+            break;
+          default:
+            console.log('Firmware update failed, status ' + status.status);
+            return null;
+        }
+      }
+
+      console.log(
+        `Firmware update: ${result.bytes} bytes verified in ` +
+          `${result.elapsedMs} ms (${result.bytesPerSecond} B/s), ` +
+          `${Date.now() - startMs} ms in total`
+      );
+      await control(new Uint8Array([CMD_OTA_APPLY]));
+      return result;
+    } catch (error) {
+      console.log(error);
+      control(new Uint8Array([CMD_OTA_ABORT])).catch(() => {});
+      return null;
+    } finally {
+      subscription.remove();
+    }
+  };
+
   const send = async (data: Uint8Array) => {
     if (!connectedDevice) {
       console.log('No connected device');
@@ -248,6 +675,13 @@ export function useBLE(): BluetoothLowEnergyApi {
     allDevices,
     startStreamingData,
     send,
+    downloadLog,
+    setStreamMode,
+    syncTime,
+    setPattern,
+    updateFirmware,
     state,
+    sample,
+    motion,
   };
 }
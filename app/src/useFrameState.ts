@@ -0,0 +1,37 @@
+import { useCallback, useEffect, useRef, useState } from 'react';
+
+// Like useState, but setting it any number of times between two frames only
+// renders once: the newest value is kept in a ref and committed on the next
+// animation frame. For values that change with every notification.
+//
+// snapshot is applied when the value is committed, so the caller can keep
+// mutating one object and React still gets a new one each frame.
+export function useFrameState<T>(
+  initial: T,
+  snapshot: (value: T) => T = (value) => value
+): [T, (value: T) => void] {
+  const [value, setValue] = useState(initial);
+  const latestRef = useRef(initial);
+  const frameRef = useRef<number | null>(null);
+  const snapshotRef = useRef(snapshot);
+  snapshotRef.current = snapshot;
+
+  useEffect(
+    () => () => {
+      if (frameRef.current !== null) cancelAnimationFrame(frameRef.current);
+    },
+    []
+  );
+
+  const setLatest = useCallback((next: T) => {
+    latestRef.current = next;
+    if (frameRef.current !== null) return;
+
+    frameRef.current = requestAnimationFrame(() => {
+      frameRef.current = null;
+      setValue(snapshotRef.current(latestRef.current));
+    });
+  }, []);
+
+  return [value, setLatest];
+}
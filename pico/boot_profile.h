@@ -0,0 +1,96 @@
+// *****************************************************************************
+// Boot profile
+//
+// Units are power-cycled by mains timers, so the time from reset until the
+// unit is connectable matters. boot_mark() records when each boot phase was
+// reached (microseconds since reset), boot_profile_print() reports them.
+// *****************************************************************************
+#ifndef BOOT_PROFILE_H
+#define BOOT_PROFILE_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "pico/stdlib.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define BOOT_PHASE_STDIO 0          // stdio up
+#define BOOT_PHASE_CYW43 1          // cyw43_arch_init() done
+#define BOOT_PHASE_STATE_RESTORED 2 // persisted state applied
+#define BOOT_PHASE_HCI_POWER_ON 3   // controller firmware loaded, HCI init started
+#define BOOT_PHASE_SAMPLE_LOG 4     // sample log scanned
+#define BOOT_PHASE_SENSOR_READY 5   // light sensor initialized
+#define BOOT_PHASE_ADVERTISING 6    // HCI working, advertising
+#define BOOT_PHASE_FIRST_SAMPLE 7   // first light sensor reading
+#define BOOT_PHASE_CONNECTED 8      // first connection
+#define BOOT_NUM_PHASES 9
+
+typedef struct
+{
+  uint32_t time_us[BOOT_NUM_PHASES]; // 0 until the phase is reached
+} BootProfile;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+BootProfile boot_profile;
+
+static const char *boot_phase_names[BOOT_NUM_PHASES] = {
+    "stdio",
+    "cyw43",
+    "state restored",
+    "hci power on",
+    "sample log",
+    "sensor ready",
+    "advertising",
+    "first sample",
+    "connected",
+};
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void boot_mark(int phase);
+uint32_t boot_phase_ms(int phase);
+void boot_profile_print();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// Records the first time a phase is reached, later calls are ignored
+void boot_mark(int phase)
+{
+  if (boot_profile.time_us[phase] == 0)
+  {
+    boot_profile.time_us[phase] = (uint32_t)time_us_64();
+  }
+}
+
+// Rounded up, so a phase that was reached is never reported as 0
+uint32_t boot_phase_ms(int phase)
+{
+  return (boot_profile.time_us[phase] + 999) / 1000;
+}
+
+// Phases are listed in the order they are usually reached, but the sensor and
+// the radio come up in parallel, so no deltas
+void boot_profile_print()
+{
+  printf("Boot profile:\n");
+  for (int i = 0; i < BOOT_NUM_PHASES; i++)
+  {
+    if (boot_profile.time_us[i] == 0)
+    {
+      printf("  %-15s -\n", boot_phase_names[i]);
+      continue;
+    }
+    printf("  %-15s %8" PRIu32 " us\n", boot_phase_names[i], boot_profile.time_us[i]);
+  }
+}
+
+#endif
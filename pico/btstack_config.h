@@ -10,6 +10,14 @@
 #define ENABLE_LOG_INFO
 #define ENABLE_LOG_ERROR
 #define ENABLE_PRINTF_HEXDUMP
+// Ask the controller for 251 byte LL packets, so a full MTU write goes over the
+// air in one packet (firmware updates)
+#define ENABLE_LE_DATA_LENGTH_EXTENSION
+// Bond with LE Secure Connections, see reconnect.h
+#define ENABLE_LE_SECURE_CONNECTIONS
+// Let the controller resolve the private addresses of bonded phones, so
+// advertising directed at a phone's identity address reaches it
+#define ENABLE_LE_PRIVACY_ADDRESS_RESOLUTION
 
 // for the client
 #if RUNNING_AS_CLIENT
@@ -0,0 +1,48 @@
+// *****************************************************************************
+// Flash layout
+//
+// The Pico W has 2 MB of flash. The firmware image lives at the start of it and
+// BTstack keeps its TLV storage (bonds etc.) in the last two sectors, see
+// PICO_FLASH_BANK_STORAGE_OFFSET in pico_btstack. Everything we store ourselves
+// goes in the space right below the BTstack storage.
+//
+//   0x000000  firmware image
+//   ...
+//   OTA_STAGING_FLASH_OFFSET     firmware update staging slot (OTA_SLOT_SIZE)
+//   ...
+//   SAMPLE_LOG_FLASH_OFFSET      sample log ring (SAMPLE_LOG_FLASH_SIZE)
+//   PICO_FLASH_BANK_STORAGE_OFFSET  BTstack TLV (2 sectors)
+//   PICO_FLASH_SIZE_BYTES
+// *****************************************************************************
+#ifndef FLASH_LAYOUT_H
+#define FLASH_LAYOUT_H
+
+#include "hardware/flash.h"
+
+#ifndef PICO_FLASH_BANK_TOTAL_SIZE
+#define PICO_FLASH_BANK_TOTAL_SIZE (FLASH_SECTOR_SIZE * 2u)
+#endif
+
+#ifndef PICO_FLASH_BANK_STORAGE_OFFSET
+#define PICO_FLASH_BANK_STORAGE_OFFSET (PICO_FLASH_SIZE_BYTES - PICO_FLASH_BANK_TOTAL_SIZE)
+#endif
+
+// 120 sectors = 480 kB of sample log. At a sample every 250 ms and the 1.1 to
+// 2.6 bytes per sample the codec achieves (host/telemetry_bench), that is 13
+// to 30 hours before the oldest samples are dropped. It can't grow much: the
+// OTA slot has to hold a whole image and the image has to end below it.
+#ifndef SAMPLE_LOG_FLASH_SIZE
+#define SAMPLE_LOG_FLASH_SIZE (120u * FLASH_SECTOR_SIZE)
+#endif
+
+#define SAMPLE_LOG_FLASH_OFFSET (PICO_FLASH_BANK_STORAGE_OFFSET - SAMPLE_LOG_FLASH_SIZE)
+
+// 160 sectors = 640 kB for an incoming image, see ota.h. The running image
+// must end below it.
+#ifndef OTA_SLOT_SIZE
+#define OTA_SLOT_SIZE (160u * FLASH_SECTOR_SIZE)
+#endif
+
+#define OTA_STAGING_FLASH_OFFSET (SAMPLE_LOG_FLASH_OFFSET - OTA_SLOT_SIZE)
+
+#endif
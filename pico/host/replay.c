@@ -0,0 +1,432 @@
+// *****************************************************************************
+// Trace replay
+//
+// Runs the firmware (ney_tack.c, built for the host against the simulated
+// board in sim/) on a trace downloaded with CMD_TRACE_DOWNLOAD, see trace.h.
+// Light readings, PIR edges and the BLE link are played back at the times they
+// were recorded. What the firmware does in response goes to the event log, a
+// summary with throughput, latency and CPU load is printed at the end.
+//
+//   replay [-s speed] [-t tail_ms] [-o events.txt] [-v] [-d] trace.bin
+//
+//   -s  simulated seconds per real second, default as fast as possible
+//   -t  keep running this long after the last record, default 5000 ms
+//   -o  event log, default stdout
+//   -v  show the firmware's printf output
+//   -d  only print the trace records
+//
+// Virtual time makes runs repeatable: the same trace always gives the same
+// event log, so two firmware versions can be compared with diff.
+// *****************************************************************************
+#define _POSIX_C_SOURCE 200809L
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "sim.h"
+
+// Record format, see trace.h. It can't be included here: its functions are
+// already linked in with ney_tack.c.
+#define TRACE_VERSION 1
+#define TRACE_HEADER_LEN 6
+#define TRACE_RECORD_BOOT 'B'
+#define TRACE_RECORD_LIGHT 'L'
+#define TRACE_RECORD_PIR 'M'
+#define TRACE_RECORD_CONNECTED 'C'
+#define TRACE_RECORD_MTU 'U'
+#define TRACE_RECORD_SUBSCRIBED 'N'
+#define TRACE_RECORD_DISCONNECTED 'D'
+#define TRACE_RECORD_SPP 'W'
+
+#define DEFAULT_TAIL_MS 5000
+
+// Times of traces without a boot record start here
+#define UNANCHORED_START_US 1000000
+
+// The phone's defaults while replaying a trace that starts mid-connection
+#define DEFAULT_CONN_INTERVAL 24 // 30 ms
+#define DEFAULT_MTU 185
+
+typedef struct
+{
+  uint8_t type;
+  uint8_t len;
+  uint64_t time_us;
+  const uint8_t *data;
+} Record;
+
+static uint8_t *trace_data;
+static Record *records;
+static int num_records;
+static int next_record;
+static FILE *report;
+
+int ney_tack_main(void);
+
+static int load(const char *path)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+  {
+    perror(path);
+    return -1;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  trace_data = malloc(size > 0 ? size : 1);
+  if (fread(trace_data, 1, size, file) != (size_t)size)
+  {
+    perror(path);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+
+  records = calloc(size / TRACE_HEADER_LEN + 1, sizeof(Record));
+
+  // Times are the low 32 bits of the µs clock and wrap every ~71 minutes,
+  // unwrap them assuming records are less than half of that apart
+  uint64_t time_us = 0;
+  uint32_t last = 0;
+  long position = 0;
+  while (position + TRACE_HEADER_LEN <= size)
+  {
+    Record *record = &records[num_records];
+    record->type = trace_data[position];
+    record->len = trace_data[position + 1];
+    uint32_t time = (uint32_t)trace_data[position + 2] | ((uint32_t)trace_data[position + 3] << 8) |
+                    ((uint32_t)trace_data[position + 4] << 16) | ((uint32_t)trace_data[position + 5] << 24);
+    record->data = trace_data + position + TRACE_HEADER_LEN;
+
+    if (position + TRACE_HEADER_LEN + record->len > size)
+    {
+      fprintf(stderr, "%s: record at %ld cut off\n", path, position);
+      break;
+    }
+
+    if (num_records == 0)
+    {
+      time_us = time;
+    }
+    else
+    {
+      time_us += (int64_t)(int32_t)(time - last);
+    }
+    last = time;
+    record->time_us = time_us;
+
+    num_records++;
+    position += TRACE_HEADER_LEN + record->len;
+  }
+
+  if (num_records == 0)
+  {
+    fprintf(stderr, "%s: no records\n", path);
+    return -1;
+  }
+
+  // Records taken in an interrupt and the main loop can be slightly out of
+  // order, insertion sort keeps equal times in file order
+  for (int i = 1; i < num_records; i++)
+  {
+    Record record = records[i];
+    int j = i;
+    for (; j > 0 && (int64_t)(records[j - 1].time_us - record.time_us) > 0; j--)
+    {
+      records[j] = records[j - 1];
+    }
+    records[j] = record;
+  }
+
+  if (records[0].type == TRACE_RECORD_BOOT)
+  {
+    if (records[0].len < 1 || records[0].data[0] != TRACE_VERSION)
+    {
+      fprintf(stderr, "%s: trace version %d, expected %d\n", path, records[0].len ? records[0].data[0] : -1,
+              TRACE_VERSION);
+    }
+  }
+  else
+  {
+    // The boot record has been dropped, so times don't line up with boot
+    int64_t shift = UNANCHORED_START_US - (int64_t)records[0].time_us;
+    for (int i = 0; i < num_records; i++)
+    {
+      records[i].time_us += shift;
+    }
+  }
+
+  return 0;
+}
+
+static void dump()
+{
+  for (int i = 0; i < num_records; i++)
+  {
+    const Record *record = &records[i];
+    printf("%8" PRIu64 ".%03u %c", record->time_us / 1000, (unsigned)(record->time_us % 1000), record->type);
+    switch (record->type)
+    {
+    case TRACE_RECORD_LIGHT:
+      printf(" ch0 %u ch1 %u", record->data[0] | (record->data[1] << 8), record->data[2] | (record->data[3] << 8));
+      break;
+    case TRACE_RECORD_PIR:
+      printf(" %u", record->data[0]);
+      break;
+    case TRACE_RECORD_CONNECTED:
+    case TRACE_RECORD_MTU:
+      printf(" %u", record->data[0] | (record->data[1] << 8));
+      break;
+    default:
+      for (int j = 0; j < record->len; j++)
+      {
+        printf(" %02x", record->data[j]);
+      }
+      break;
+    }
+    printf("\n");
+  }
+}
+
+static uint64_t next_us(void)
+{
+  return next_record < num_records ? records[next_record].time_us : UINT64_MAX;
+}
+
+static void deliver(uint64_t now_us)
+{
+  while (next_record < num_records && records[next_record].time_us <= now_us)
+  {
+    const Record *record = &records[next_record++];
+
+    switch (record->type)
+    {
+    case TRACE_RECORD_LIGHT:
+      if (record->len >= 4)
+      {
+        sim_light(record->data[0] | (record->data[1] << 8), record->data[2] | (record->data[3] << 8));
+      }
+      break;
+    case TRACE_RECORD_PIR:
+      if (record->len >= 1)
+      {
+        sim_pir(record->data[0]);
+      }
+      break;
+    case TRACE_RECORD_CONNECTED:
+      if (sim_connected())
+      {
+        sim_disconnect();
+      }
+      sim_connect(record->len >= 2 ? record->data[0] | (record->data[1] << 8) : DEFAULT_CONN_INTERVAL);
+      break;
+    case TRACE_RECORD_MTU:
+      if (sim_connected() && record->len >= 2)
+      {
+        sim_mtu(record->data[0] | (record->data[1] << 8));
+      }
+      break;
+    case TRACE_RECORD_SUBSCRIBED:
+    case TRACE_RECORD_SPP:
+      // The connection may have been set up before the oldest record
+      if (!sim_connected())
+      {
+        sim_connect(DEFAULT_CONN_INTERVAL);
+        sim_mtu(DEFAULT_MTU);
+      }
+      if (!sim_subscribed())
+      {
+        sim_subscribe();
+      }
+      if (record->type == TRACE_RECORD_SPP)
+      {
+        sim_spp_write(record->data, record->len);
+      }
+      break;
+    case TRACE_RECORD_DISCONNECTED:
+      if (sim_connected())
+      {
+        sim_disconnect();
+      }
+      break;
+    }
+  }
+}
+
+static const SimInput input = {next_us, deliver};
+
+static double latency_ms(const SimLatency *latency)
+{
+  return latency->count ? latency->total_us / 1000.0 / latency->count : 0;
+}
+
+static void print_type(int type)
+{
+  if (type > ' ' && type < 0x7f)
+  {
+    fprintf(report, " %c", type);
+  }
+  else
+  {
+    fprintf(report, " 0x%02x", type);
+  }
+}
+
+static void summary(uint64_t start_us, uint64_t end_us, double wall_s)
+{
+  int counts[256] = {0};
+  for (int i = 0; i < num_records; i++)
+  {
+    counts[records[i].type]++;
+  }
+
+  double sim_s = (end_us - start_us) / 1e6;
+  fprintf(report, "\nTrace       %d records over %.1f s:", num_records,
+          (records[num_records - 1].time_us - records[0].time_us) / 1e6);
+  for (int type = 0; type < 256; type++)
+  {
+    if (counts[type])
+    {
+      print_type(type);
+      fprintf(report, " %d", counts[type]);
+    }
+  }
+  fprintf(report, "\n");
+
+  fprintf(report, "Simulated   %.1f s in %.2f s (%.0fx)\n", sim_s, wall_s, wall_s > 0 ? sim_s / wall_s : 0);
+
+  double subscribed_s = sim_stats.subscribed_us / 1e6;
+  fprintf(report, "SPP         %" PRIu32 " frames, %" PRIu64 " bytes, %.2f kB/s over %.1f s subscribed\n",
+          sim_stats.spp_frames, sim_stats.spp_bytes, subscribed_s > 0 ? sim_stats.spp_bytes / 1000.0 / subscribed_s : 0,
+          subscribed_s);
+  fprintf(report, "           ");
+  for (int type = 0; type < 256; type++)
+  {
+    if (sim_stats.spp_frames_by_type[type])
+    {
+      print_type(type);
+      fprintf(report, " %" PRIu32, sim_stats.spp_frames_by_type[type]);
+    }
+  }
+  fprintf(report, ", %" PRIu32 " too long, %" PRIu32 " unsubscribed\n", sim_stats.spp_oversize,
+          sim_stats.spp_unsubscribed);
+  fprintf(report, "Commands    %" PRIu32 ", answered in %.2f ms average, %.2f ms max\n", sim_stats.spp_commands,
+          latency_ms(&sim_stats.command_latency), sim_stats.command_latency.max_us / 1000.0);
+  fprintf(report, "GATT        %" PRIu32 " notifications, %" PRIu32 " attribute changes, %" PRIu32
+                  " connection updates\n",
+          sim_stats.notifications, sim_stats.attr_changes, sim_stats.conn_updates);
+  fprintf(report, "Light       %" PRIu32 " samples, %" PRIu32 " missed, read after %.2f ms average, %.2f ms max\n",
+          sim_stats.light_samples, sim_stats.light_missed, latency_ms(&sim_stats.light_latency),
+          sim_stats.light_latency.max_us / 1000.0);
+  fprintf(report, "LED         %" PRIu32 " level changes, %" PRIu32 " ramps\n", sim_stats.led_changes,
+          sim_stats.led_ramps);
+
+  uint64_t awake_us = end_us - start_us - sim_stats.asleep_us;
+  fprintf(report, "CPU         awake %.2f %%, %.1f MHz average while awake, %" PRIu32 " clock switches\n",
+          end_us > start_us ? 100.0 * awake_us / (end_us - start_us) : 0,
+          awake_us ? sim_stats.awake_kcycles / 1000.0 / awake_us * 1000 : 0, sim_stats.clock_switches);
+}
+
+static void usage()
+{
+  fprintf(stderr, "usage: replay [-s speed] [-t tail_ms] [-o events.txt] [-v] [-d] trace.bin\n");
+  exit(2);
+}
+
+int main(int argc, char **argv)
+{
+  double speed = 0;
+  uint64_t tail_ms = DEFAULT_TAIL_MS;
+  const char *log_path = NULL;
+  int verbose = 0;
+  int dump_only = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "s:t:o:vd")) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      speed = atof(optarg);
+      break;
+    case 't':
+      tail_ms = strtoull(optarg, NULL, 10);
+      break;
+    case 'o':
+      log_path = optarg;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    case 'd':
+      dump_only = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1)
+  {
+    usage();
+  }
+
+  if (load(argv[optind]) < 0)
+  {
+    return 1;
+  }
+
+  if (dump_only)
+  {
+    dump();
+    return 0;
+  }
+
+  // The firmware prints to stdout, keep that apart from the event log and
+  // the summary
+  fflush(stdout);
+  report = fdopen(dup(STDOUT_FILENO), "w");
+  if (!verbose)
+  {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+  }
+
+  FILE *log = report;
+  if (log_path)
+  {
+    log = fopen(log_path, "w");
+    if (!log)
+    {
+      perror(log_path);
+      return 1;
+    }
+  }
+
+  sim_init(log, speed);
+  sim_set_input(&input);
+
+  struct timespec wall_start, wall_end;
+  clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+  uint64_t end_us = records[num_records - 1].time_us + tail_ms * 1000;
+  sim_run(ney_tack_main, end_us);
+
+  clock_gettime(CLOCK_MONOTONIC, &wall_end);
+  fflush(stdout);
+
+  summary(0, sim_now_us(), (wall_end.tv_sec - wall_start.tv_sec) + (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9);
+
+  if (log != report)
+  {
+    fclose(log);
+  }
+  fclose(report);
+  return 0;
+}
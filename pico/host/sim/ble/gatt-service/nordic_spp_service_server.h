@@ -0,0 +1,11 @@
+#ifndef SIM_NORDIC_SPP_SERVICE_SERVER_H
+#define SIM_NORDIC_SPP_SERVICE_SERVER_H
+
+#include "btstack.h"
+
+void nordic_spp_service_server_init(btstack_packet_handler_t packet_handler);
+void nordic_spp_service_server_request_can_send_now(btstack_context_callback_registration_t *request,
+                                                    hci_con_handle_t con_handle);
+int nordic_spp_service_server_send(hci_con_handle_t con_handle, const uint8_t *data, uint16_t size);
+
+#endif
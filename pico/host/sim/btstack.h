@@ -0,0 +1,390 @@
+// Host stand-in for the parts of BTstack the firmware uses. Events are built
+// with the same layout as the real ones, the stack itself is the simulated
+// link in sim.c.
+#ifndef SIM_BTSTACK_H
+#define SIM_BTSTACK_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef UNUSED
+#define UNUSED(x) (void)(x)
+#endif
+
+typedef uint16_t hci_con_handle_t;
+typedef uint8_t bd_addr_t[6];
+
+#define HCI_CON_HANDLE_INVALID 0xffff
+#define ATT_DEFAULT_MTU 23
+#define L2CAP_HEADER_SIZE 4
+
+// As in btstack_config.h
+#define HCI_ACL_PAYLOAD_SIZE (255 + 4)
+
+// Packet types
+#define HCI_EVENT_PACKET 0x04
+#define RFCOMM_DATA_PACKET 0x07
+
+// Events
+#define HCI_EVENT_DISCONNECTION_COMPLETE 0x05
+#define HCI_EVENT_ENCRYPTION_CHANGE 0x08
+#define HCI_EVENT_LE_META 0x3E
+#define BTSTACK_EVENT_STATE 0x60
+#define ATT_EVENT_CONNECTED 0xB3
+#define ATT_EVENT_DISCONNECTED 0xB4
+#define ATT_EVENT_MTU_EXCHANGE_COMPLETE 0xB5
+#define HCI_EVENT_GATTSERVICE_META 0xEC
+#define SM_EVENT_JUST_WORKS_REQUEST 0xC8
+#define SM_EVENT_IDENTITY_RESOLVING_FAILED 0xCE
+#define SM_EVENT_IDENTITY_RESOLVING_SUCCEEDED 0xCF
+#define SM_EVENT_IDENTITY_CREATED 0xD3
+#define SM_EVENT_PAIRING_COMPLETE 0xD4
+
+#define HCI_SUBEVENT_LE_CONNECTION_COMPLETE 0x01
+#define HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE 0x03
+#define GATTSERVICE_SUBEVENT_SPP_SERVICE_CONNECTED 0x01
+#define GATTSERVICE_SUBEVENT_SPP_SERVICE_DISCONNECTED 0x02
+
+#define HCI_STATE_OFF 0
+#define HCI_STATE_WORKING 2
+#define HCI_POWER_OFF 0
+#define HCI_POWER_ON 1
+
+#define IO_CAPABILITY_NO_INPUT_NO_OUTPUT 3
+#define SM_AUTHREQ_BONDING 0x01
+#define SM_AUTHREQ_SECURE_CONNECTION 0x08
+
+#define BLUETOOTH_DATA_TYPE_FLAGS 0x01
+#define BLUETOOTH_DATA_TYPE_COMPLETE_LIST_OF_128_BIT_SERVICE_CLASS_UUIDS 0x07
+#define BLUETOOTH_DATA_TYPE_COMPLETE_LOCAL_NAME 0x09
+
+#define ATT_TRANSACTION_MODE_NONE 0x0
+#define ATT_ERROR_REQUEST_NOT_SUPPORTED 0x06
+#define ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH 0x0d
+#define ATT_ERROR_INSUFFICIENT_ENCRYPTION 0x0f
+#define ATT_ERROR_VALUE_NOT_ALLOWED 0x13
+#define GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION 1
+
+typedef void (*btstack_packet_handler_t)(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
+
+typedef struct btstack_packet_callback_registration
+{
+  struct btstack_packet_callback_registration *next;
+  btstack_packet_handler_t callback;
+} btstack_packet_callback_registration_t;
+
+typedef struct btstack_context_callback_registration
+{
+  struct btstack_context_callback_registration *next;
+  void (*callback)(void *context);
+  void *context;
+} btstack_context_callback_registration_t;
+
+typedef struct btstack_timer_source
+{
+  struct btstack_timer_source *next;
+  uint32_t timeout;
+  void (*process)(struct btstack_timer_source *ts);
+  void *context;
+} btstack_timer_source_t;
+
+typedef enum
+{
+  DATA_SOURCE_CALLBACK_POLL = 1 << 0,
+  DATA_SOURCE_CALLBACK_READ = 1 << 1,
+  DATA_SOURCE_CALLBACK_WRITE = 1 << 2,
+} btstack_data_source_callback_type_t;
+
+typedef struct btstack_data_source
+{
+  struct btstack_data_source *next;
+  void (*process)(struct btstack_data_source *ds, btstack_data_source_callback_type_t callback_type);
+  uint16_t flags;
+} btstack_data_source_t;
+
+typedef uint16_t (*att_read_callback_t)(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t offset,
+                                        uint8_t *buffer, uint16_t buffer_size);
+typedef int (*att_write_callback_t)(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t transaction_mode,
+                                    uint16_t offset, uint8_t *buffer, uint16_t buffer_size);
+
+typedef struct att_service_handler
+{
+  struct att_service_handler *next;
+  uint16_t start_handle;
+  uint16_t end_handle;
+  att_read_callback_t read_callback;
+  att_write_callback_t write_callback;
+  btstack_packet_handler_t packet_handler;
+} att_service_handler_t;
+
+typedef struct
+{
+  int (*get_tag)(void *context, uint32_t tag, uint8_t *buffer, uint32_t buffer_size);
+  int (*store_tag)(void *context, uint32_t tag, const uint8_t *data, uint32_t data_size);
+  void (*delete_tag)(void *context, uint32_t tag);
+} btstack_tlv_t;
+
+// Run loop
+void btstack_run_loop_set_timer(btstack_timer_source_t *ts, uint32_t timeout_in_ms);
+void btstack_run_loop_add_timer(btstack_timer_source_t *ts);
+int btstack_run_loop_remove_timer(btstack_timer_source_t *ts);
+uint32_t btstack_run_loop_get_time_ms(void);
+void btstack_run_loop_set_data_source_handler(btstack_data_source_t *ds,
+                                             void (*process)(btstack_data_source_t *ds,
+                                                             btstack_data_source_callback_type_t callback_type));
+void btstack_run_loop_enable_data_source_callbacks(btstack_data_source_t *ds, uint16_t callbacks);
+void btstack_run_loop_add_data_source(btstack_data_source_t *ds);
+void btstack_run_loop_poll_data_sources_from_irq(void);
+
+// HCI, GAP
+void hci_add_event_handler(btstack_packet_callback_registration_t *callback_handler);
+int hci_power_control(int mode);
+void l2cap_init(void);
+void sm_init(void);
+void sm_set_io_capabilities(int io_capability);
+void sm_set_authentication_requirements(uint8_t auth_req);
+void sm_add_event_handler(btstack_packet_callback_registration_t *callback_handler);
+void sm_request_pairing(hci_con_handle_t con_handle);
+void sm_just_works_confirm(hci_con_handle_t con_handle);
+int sm_le_device_index(hci_con_handle_t con_handle);
+void gap_advertisements_set_params(uint16_t adv_int_min, uint16_t adv_int_max, uint8_t adv_type,
+                                   uint8_t direct_address_typ, bd_addr_t direct_address, uint8_t channel_map,
+                                   uint8_t filter_policy);
+void gap_advertisements_set_data(uint8_t advertising_data_length, uint8_t *advertising_data);
+void gap_advertisements_enable(int enabled);
+int gap_encryption_key_size(hci_con_handle_t con_handle);
+int gap_request_connection_parameter_update(hci_con_handle_t con_handle, uint16_t conn_interval_min,
+                                            uint16_t conn_interval_max, uint16_t conn_latency,
+                                            uint16_t supervision_timeout);
+
+// ATT server
+void att_server_init(const uint8_t *db, att_read_callback_t read_callback, att_write_callback_t write_callback);
+void att_server_register_packet_handler(btstack_packet_handler_t handler);
+void att_server_register_service_handler(att_service_handler_t *handler);
+int att_server_request_to_send_notification(btstack_context_callback_registration_t *callback_registration,
+                                            hci_con_handle_t con_handle);
+int att_server_notify(hci_con_handle_t con_handle, uint16_t attribute_handle, const uint8_t *value, uint16_t value_len);
+uint16_t att_server_get_mtu(hci_con_handle_t con_handle);
+uint16_t att_read_callback_handle_blob(const uint8_t *blob, uint16_t blob_size, uint16_t offset, uint8_t *buffer,
+                                       uint16_t buffer_size);
+
+int gatt_server_get_handle_range_for_service_with_uuid128(const uint8_t *uuid128, uint16_t *start_handle,
+                                                          uint16_t *end_handle);
+uint16_t gatt_server_get_value_handle_for_characteristic_with_uuid128(uint16_t start_handle, uint16_t end_handle,
+                                                                      const uint8_t *uuid128);
+uint16_t gatt_server_get_client_configuration_handle_for_characteristic_with_uuid128(uint16_t start_handle,
+                                                                                     uint16_t end_handle,
+                                                                                     const uint8_t *uuid128);
+
+// TLV
+void btstack_tlv_get_instance(const btstack_tlv_t **tlv_impl, void **tlv_context);
+
+// Utilities
+void printf_hexdump(const void *data, int size);
+
+static inline uint32_t btstack_min(uint32_t a, uint32_t b)
+{
+  return a < b ? a : b;
+}
+
+static inline uint32_t btstack_max(uint32_t a, uint32_t b)
+{
+  return a > b ? a : b;
+}
+
+static inline int bd_addr_cmp(const bd_addr_t a, const bd_addr_t b)
+{
+  return memcmp(a, b, sizeof(bd_addr_t));
+}
+
+static inline uint16_t little_endian_read_16(const uint8_t *buffer, int position)
+{
+  return (uint16_t)(buffer[position] | (buffer[position + 1] << 8));
+}
+
+static inline uint32_t little_endian_read_32(const uint8_t *buffer, int position)
+{
+  return (uint32_t)buffer[position] | ((uint32_t)buffer[position + 1] << 8) |
+         ((uint32_t)buffer[position + 2] << 16) | ((uint32_t)buffer[position + 3] << 24);
+}
+
+static inline void little_endian_store_16(uint8_t *buffer, uint16_t position, uint16_t value)
+{
+  buffer[position] = (uint8_t)value;
+  buffer[position + 1] = (uint8_t)(value >> 8);
+}
+
+static inline void little_endian_store_32(uint8_t *buffer, uint16_t position, uint32_t value)
+{
+  little_endian_store_16(buffer, position, (uint16_t)value);
+  little_endian_store_16(buffer, position + 2, (uint16_t)(value >> 16));
+}
+
+// Event accessors, same offsets as btstack_event.h
+static inline uint8_t hci_event_packet_get_type(const uint8_t *event)
+{
+  return event[0];
+}
+
+static inline uint8_t hci_event_le_meta_get_subevent_code(const uint8_t *event)
+{
+  return event[2];
+}
+
+static inline uint8_t hci_event_gattservice_meta_get_subevent_code(const uint8_t *event)
+{
+  return event[2];
+}
+
+static inline uint8_t btstack_event_state_get_state(const uint8_t *event)
+{
+  return event[2];
+}
+
+static inline uint8_t hci_subevent_le_connection_complete_get_status(const uint8_t *event)
+{
+  return event[3];
+}
+
+static inline hci_con_handle_t hci_subevent_le_connection_complete_get_connection_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 4);
+}
+
+static inline uint8_t hci_subevent_le_connection_complete_get_peer_address_type(const uint8_t *event)
+{
+  return event[7];
+}
+
+// Little endian on the air, reversed like reverse_bd_addr()
+static inline void hci_subevent_le_connection_complete_get_peer_address(const uint8_t *event, bd_addr_t address)
+{
+  for (int i = 0; i < 6; i++)
+  {
+    address[i] = event[13 - i];
+  }
+}
+
+static inline uint16_t hci_subevent_le_connection_complete_get_conn_interval(const uint8_t *event)
+{
+  return little_endian_read_16(event, 14);
+}
+
+static inline uint16_t hci_subevent_le_connection_complete_get_conn_latency(const uint8_t *event)
+{
+  return little_endian_read_16(event, 16);
+}
+
+static inline hci_con_handle_t hci_subevent_le_connection_update_complete_get_connection_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 4);
+}
+
+static inline uint16_t hci_subevent_le_connection_update_complete_get_conn_interval(const uint8_t *event)
+{
+  return little_endian_read_16(event, 6);
+}
+
+static inline uint16_t hci_subevent_le_connection_update_complete_get_conn_latency(const uint8_t *event)
+{
+  return little_endian_read_16(event, 8);
+}
+
+static inline hci_con_handle_t hci_event_disconnection_complete_get_connection_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 3);
+}
+
+static inline uint8_t hci_event_encryption_change_get_status(const uint8_t *event)
+{
+  return event[2];
+}
+
+static inline hci_con_handle_t hci_event_encryption_change_get_connection_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 3);
+}
+
+static inline uint8_t hci_event_encryption_change_get_encryption_enabled(const uint8_t *event)
+{
+  return event[5];
+}
+
+static inline hci_con_handle_t sm_event_just_works_request_get_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 2);
+}
+
+static inline uint8_t sm_event_pairing_complete_get_status(const uint8_t *event)
+{
+  return event[11];
+}
+
+static inline hci_con_handle_t sm_event_identity_resolving_failed_get_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 2);
+}
+
+static inline hci_con_handle_t sm_event_identity_resolving_succeeded_get_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 2);
+}
+
+static inline uint8_t sm_event_identity_resolving_succeeded_get_identity_addr_type(const uint8_t *event)
+{
+  return event[11];
+}
+
+static inline void sm_event_identity_resolving_succeeded_get_identity_address(const uint8_t *event,
+                                                                               bd_addr_t identity_address)
+{
+  for (int i = 0; i < 6; i++)
+  {
+    identity_address[i] = event[17 - i];
+  }
+}
+
+static inline hci_con_handle_t sm_event_identity_created_get_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 2);
+}
+
+static inline uint8_t sm_event_identity_created_get_identity_addr_type(const uint8_t *event)
+{
+  return event[11];
+}
+
+static inline void sm_event_identity_created_get_identity_address(const uint8_t *event, bd_addr_t identity_address)
+{
+  for (int i = 0; i < 6; i++)
+  {
+    identity_address[i] = event[17 - i];
+  }
+}
+
+static inline hci_con_handle_t att_event_connected_get_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 9);
+}
+
+static inline hci_con_handle_t att_event_disconnected_get_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 2);
+}
+
+static inline hci_con_handle_t att_event_mtu_exchange_complete_get_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 2);
+}
+
+static inline uint16_t att_event_mtu_exchange_complete_get_MTU(const uint8_t *event)
+{
+  return little_endian_read_16(event, 4);
+}
+
+static inline hci_con_handle_t gattservice_subevent_spp_service_connected_get_con_handle(const uint8_t *event)
+{
+  return little_endian_read_16(event, 3);
+}
+
+#endif
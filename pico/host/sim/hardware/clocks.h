@@ -0,0 +1,14 @@
+#ifndef SIM_HARDWARE_CLOCKS_H
+#define SIM_HARDWARE_CLOCKS_H
+
+#include "pico/stdlib.h"
+
+enum clock_index
+{
+  clk_sys = 5,
+  clk_peri = 6,
+};
+
+uint32_t clock_get_hz(enum clock_index clk_index);
+
+#endif
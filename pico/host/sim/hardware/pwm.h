@@ -0,0 +1,40 @@
+#ifndef SIM_HARDWARE_PWM_H
+#define SIM_HARDWARE_PWM_H
+
+#include "pico/stdlib.h"
+
+#define NUM_PWM_SLICES 8
+
+typedef struct
+{
+  uint32_t div;
+  uint32_t top;
+} pwm_config;
+
+typedef struct
+{
+  struct
+  {
+    volatile uint32_t csr;
+    volatile uint32_t div;
+    volatile uint32_t ctr;
+    volatile uint32_t cc;
+    volatile uint32_t top;
+  } slice[NUM_PWM_SLICES];
+} pwm_hw_t;
+
+extern pwm_hw_t sim_pwm_hw;
+#define pwm_hw (&sim_pwm_hw)
+
+uint pwm_gpio_to_slice_num(uint gpio);
+uint pwm_get_dreq(uint slice_num);
+pwm_config pwm_get_default_config(void);
+void pwm_config_set_wrap(pwm_config *c, uint16_t wrap);
+void pwm_init(uint slice_num, pwm_config *c, bool start);
+void pwm_set_enabled(uint slice_num, bool enabled);
+void pwm_set_both_levels(uint slice_num, uint16_t level_a, uint16_t level_b);
+void pwm_set_clkdiv_int_frac(uint slice_num, uint8_t integer, uint8_t fract);
+void pwm_set_wrap(uint slice_num, uint16_t wrap);
+void pwm_set_counter(uint slice_num, uint16_t c);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef SIM_HARDWARE_STRUCTS_WATCHDOG_H
+#define SIM_HARDWARE_STRUCTS_WATCHDOG_H
+
+#include <stdint.h>
+
+#define WATCHDOG_CTRL_TRIGGER_BITS 0x80000000u
+
+typedef struct
+{
+  volatile uint32_t ctrl;
+} watchdog_hw_t;
+
+// Writes are ignored, the replay never gets as far as a reset
+extern watchdog_hw_t sim_watchdog_hw;
+#define watchdog_hw (&sim_watchdog_hw)
+
+#endif
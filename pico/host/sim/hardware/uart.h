@@ -0,0 +1,14 @@
+#ifndef SIM_HARDWARE_UART_H
+#define SIM_HARDWARE_UART_H
+
+#include "pico/stdlib.h"
+
+typedef struct uart_inst uart_inst_t;
+extern uart_inst_t uart0_inst;
+
+#define uart_default (&uart0_inst)
+#define PICO_DEFAULT_UART_BAUD_RATE 115200
+
+uint uart_set_baudrate(uart_inst_t *uart, uint baudrate);
+
+#endif
@@ -0,0 +1,10 @@
+// The real header is generated from mygatt.gatt by the Pico build. The
+// simulated ATT server hands out handles as they are looked up instead.
+#ifndef SIM_MYGATT_H
+#define SIM_MYGATT_H
+
+#include <stdint.h>
+
+extern const uint8_t profile_data[];
+
+#endif
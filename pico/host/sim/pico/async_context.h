@@ -0,0 +1,20 @@
+#ifndef SIM_PICO_ASYNC_CONTEXT_H
+#define SIM_PICO_ASYNC_CONTEXT_H
+
+#include "pico/stdlib.h"
+
+typedef struct async_context async_context_t;
+
+typedef struct async_when_pending_worker
+{
+  struct async_when_pending_worker *next;
+  void (*do_work)(async_context_t *context, struct async_when_pending_worker *worker);
+  bool work_pending;
+  void *user_data;
+} async_when_pending_worker_t;
+
+bool async_context_add_when_pending_worker(async_context_t *context, async_when_pending_worker_t *worker);
+void async_context_set_work_pending(async_context_t *context, async_when_pending_worker_t *worker);
+void async_context_wait_for_work_until(async_context_t *context, absolute_time_t until);
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef SIM_PICO_CYW43_ARCH_H
+#define SIM_PICO_CYW43_ARCH_H
+
+#include "pico/stdlib.h"
+#include "pico/async_context.h"
+
+#define CYW43_WL_GPIO_LED_PIN 0
+
+int cyw43_arch_init(void);
+void cyw43_arch_poll(void);
+async_context_t *cyw43_arch_async_context(void);
+void cyw43_arch_gpio_put(uint wl_gpio, bool value);
+
+#endif
@@ -0,0 +1,72 @@
+// Host stand-in for the parts of the Pico SDK the firmware uses, backed by
+// the simulated board in sim.c. Time is virtual, see sim.h.
+#ifndef SIM_PICO_STDLIB_H
+#define SIM_PICO_STDLIB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef unsigned int uint;
+typedef uint64_t absolute_time_t;
+
+// Flash is a RAM array, see hardware/flash.h
+extern uint8_t sim_flash[];
+#define XIP_BASE ((uintptr_t)sim_flash)
+#define PICO_FLASH_SIZE_BYTES (2u * 1024 * 1024)
+
+// Code that runs while flash is being written is placed in RAM
+#define __not_in_flash_func(func_name) func_name
+
+static inline void __compiler_memory_barrier(void)
+{
+  __asm__ volatile("" : : : "memory");
+}
+
+#define PICO_ERROR_NONE 0
+#define PICO_ERROR_TIMEOUT -1
+#define PICO_ERROR_GENERIC -2
+
+#define GPIO_IN 0
+#define GPIO_OUT 1
+
+enum gpio_function
+{
+  GPIO_FUNC_I2C = 3,
+  GPIO_FUNC_PWM = 4,
+  GPIO_FUNC_SIO = 5,
+  GPIO_FUNC_NULL = 0x1f,
+};
+
+#define GPIO_IRQ_LEVEL_LOW 0x1u
+#define GPIO_IRQ_LEVEL_HIGH 0x2u
+#define GPIO_IRQ_EDGE_FALL 0x4u
+#define GPIO_IRQ_EDGE_RISE 0x8u
+
+typedef void (*gpio_irq_callback_t)(uint gpio, uint32_t event_mask);
+
+bool stdio_init_all(void);
+
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+absolute_time_t get_absolute_time(void);
+absolute_time_t from_us_since_boot(uint64_t us);
+uint32_t to_ms_since_boot(absolute_time_t t);
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+void busy_wait_us_32(uint32_t us);
+bool best_effort_wfe_or_timeout(absolute_time_t until);
+
+void gpio_init(uint gpio);
+void gpio_pull_up(uint gpio);
+void gpio_pull_down(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_put(uint gpio, bool value);
+bool gpio_get(uint gpio);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback);
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required);
+
+#endif
@@ -0,0 +1,1884 @@
+// *****************************************************************************
+// Simulated Ney Tack board, see sim.h
+// *****************************************************************************
+#define _POSIX_C_SOURCE 199309L
+
+#include "sim.h"
+
+#include <inttypes.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pico/stdlib.h"
+#include "pico/async_context.h"
+#include "pico/cyw43_arch.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/flash.h"
+#include "hardware/structs/watchdog.h"
+#include "hardware/i2c.h"
+#include "hardware/pwm.h"
+#include "hardware/sync.h"
+#include "hardware/uart.h"
+#include "btstack.h"
+#include "ble/gatt-service/nordic_spp_service_server.h"
+#include "mygatt.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define SIM_NUM_GPIOS 30
+
+// Typical W25Q16 timings
+#define SIM_FLASH_SECTOR_ERASE_US 45000
+#define SIM_FLASH_PAGE_PROGRAM_US 700
+
+// LTR303 registers the model knows about, see ltr303_i2c.h
+#define SIM_LTR303_ALS_CTRL 0x80
+#define SIM_LTR303_PART_ID 0x86
+#define SIM_LTR303_MANU_ID 0x87
+#define SIM_LTR303_CH1DATA 0x88
+#define SIM_LTR303_STATUS 0x8C
+#define SIM_LTR303_INTERRUPT 0x8F
+#define SIM_LTR303_STATUS_NEW_DATA 0x04
+#define SIM_LTR303_STATUS_INTERRUPT 0x08
+
+// PWM wrap DREQs, DREQ_PWM_WRAP0 and up
+#define SIM_DREQ_PWM_WRAP0 24
+
+#define SIM_MAX_TLV_TAGS 16
+#define SIM_MAX_TLV_LEN 128
+#define SIM_MAX_ATTRIBUTES 16
+#define SIM_MAX_ATTRIBUTE_LEN 256
+#define SIM_BLE_QUEUE_SIZE 64
+
+#define SIM_BLE_CONNECT 0
+#define SIM_BLE_MTU 1
+#define SIM_BLE_SUBSCRIBE 2
+#define SIM_BLE_WRITE 3
+#define SIM_BLE_DISCONNECT 4
+#define SIM_BLE_ENCRYPT 5
+
+struct async_context
+{
+  async_when_pending_worker_t *workers;
+};
+
+struct i2c_inst
+{
+  uint baudrate;
+};
+
+struct uart_inst
+{
+  uint baudrate;
+};
+
+typedef struct
+{
+  int dir;
+  int out;
+  int pull; // 1 up, -1 down
+  int driven;
+  int level; // if driven from outside
+  uint32_t irq_events;
+  uint32_t pending_events; // raised while interrupts were disabled
+} SimGpio;
+
+typedef struct
+{
+  uint8_t regs[256];
+  uint8_t pointer;
+  uint16_t ch0;
+  uint16_t ch1;
+  uint64_t ready_us;
+} SimLtr303;
+
+typedef struct
+{
+  uint32_t tag;
+  uint32_t len;
+  uint8_t data[SIM_MAX_TLV_LEN];
+} SimTlvTag;
+
+typedef struct
+{
+  uint8_t uuid128[16];
+  uint16_t value_handle;
+  uint16_t ccc_handle;
+  uint8_t value[SIM_MAX_ATTRIBUTE_LEN];
+  uint16_t value_len;
+} SimAttribute;
+
+typedef struct
+{
+  int type;
+  uint16_t len;
+  uint8_t data[256];
+} SimBleEvent;
+
+typedef struct
+{
+  int powered;
+  int working;
+
+  // Link, as seen by the firmware
+  int connected;
+  int subscribed;
+  uint16_t mtu;
+  uint16_t conn_interval; // units of 1.25 ms
+  uint64_t event_us;      // next connection event
+  uint64_t update_at_us;  // 0 if no parameter update is pending
+  uint16_t update_interval;
+  uint64_t subscribed_since_us;
+  uint64_t command_since_us; // 0 if no command is waiting for an answer
+  int bonded;                // the phone has paired with us and kept the keys
+  int encrypted;
+
+  // Link, including events still queued
+  int will_be_connected;
+  int will_be_subscribed;
+
+  SimBleEvent queue[SIM_BLE_QUEUE_SIZE];
+  int queue_head;
+  int queue_count;
+
+  btstack_context_callback_registration_t *send_requests;
+  int sent_in_callback;
+
+  btstack_packet_callback_registration_t *hci_handlers;
+  btstack_packet_callback_registration_t *sm_handlers;
+  btstack_packet_handler_t att_handler;
+  btstack_packet_handler_t spp_handler;
+  att_service_handler_t *service_handlers;
+  btstack_timer_source_t *timers;
+  btstack_data_source_t *data_sources;
+  volatile int data_sources_polled; // from an interrupt, poll them on the next run
+
+  SimAttribute attributes[SIM_MAX_ATTRIBUTES];
+  int num_attributes;
+  int num_services;
+  uint16_t next_handle; // for the next attribute, in the last service looked up
+
+  uint8_t last_state_frame[256];
+  uint16_t last_state_frame_len;
+} SimBle;
+
+typedef struct
+{
+  FILE *log;
+  double speed;
+  struct timespec real_start;
+
+  uint64_t now_us;
+  uint64_t end_us;
+  jmp_buf end;
+  const SimInput *input;
+
+  int interrupts_disabled;
+  uint32_t sys_khz;
+
+  SimGpio gpio[SIM_NUM_GPIOS];
+  gpio_irq_callback_t gpio_callback;
+  int wl_led;
+
+  SimLtr303 ltr303;
+
+  uint16_t pwm_level[NUM_PWM_SLICES];
+  uint32_t pwm_div[NUM_PWM_SLICES];
+  uint32_t pwm_top[NUM_PWM_SLICES];
+
+  SimTlvTag tlv[SIM_MAX_TLV_TAGS];
+  int num_tlv;
+
+  SimBle ble;
+} Sim;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+SimStats sim_stats;
+
+uint8_t sim_flash[PICO_FLASH_SIZE_BYTES];
+// Linker symbol for the end of the image. It isn't in sim_flash, so firmware
+// updates fail their size check; traces don't record them anyway.
+char __flash_binary_end;
+watchdog_hw_t sim_watchdog_hw;
+pwm_hw_t sim_pwm_hw;
+i2c_inst_t i2c0_inst;
+i2c_inst_t i2c1_inst;
+uart_inst_t uart0_inst;
+const uint8_t profile_data[] = {0};
+
+static Sim sim;
+static async_context_t sim_context;
+
+// *****************************************************************************
+// Time
+// *****************************************************************************
+
+static void sim_log(const char *format, ...)
+{
+  va_list args;
+
+  if (!sim.log)
+  {
+    return;
+  }
+
+  fprintf(sim.log, "%8" PRIu64 ".%03u ", sim.now_us / 1000, (unsigned)(sim.now_us % 1000));
+  va_start(args, format);
+  vfprintf(sim.log, format, args);
+  va_end(args);
+  fputc('\n', sim.log);
+}
+
+static void sim_latency_add(SimLatency *latency, uint64_t us)
+{
+  latency->count++;
+  latency->total_us += us;
+  if (us > latency->max_us)
+  {
+    latency->max_us = us;
+  }
+}
+
+static void sim_pace()
+{
+  if (sim.speed <= 0)
+  {
+    return;
+  }
+
+  double target = sim.now_us / 1e6 / sim.speed;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  double elapsed = (now.tv_sec - sim.real_start.tv_sec) + (now.tv_nsec - sim.real_start.tv_nsec) / 1e9;
+  if (target > elapsed)
+  {
+    double wait = target - elapsed;
+    struct timespec ts = {(time_t)wait, (long)((wait - (time_t)wait) * 1e9)};
+    nanosleep(&ts, NULL);
+  }
+}
+
+static void sim_set_time(uint64_t us, int asleep)
+{
+  if (asleep)
+  {
+    sim_stats.asleep_us += us - sim.now_us;
+  }
+  else
+  {
+    sim_stats.awake_kcycles += (us - sim.now_us) * sim.sys_khz / 1000;
+  }
+  sim.now_us = us;
+}
+
+// Moves the clock forward, handing over every input on the way at its time
+static void sim_advance_to(uint64_t us, int asleep)
+{
+  if (us > sim.end_us)
+  {
+    us = sim.end_us;
+  }
+
+  while (sim.input && sim.input->next_us() <= us)
+  {
+    uint64_t input_us = sim.input->next_us();
+    if (input_us > sim.now_us)
+    {
+      sim_set_time(input_us, asleep);
+    }
+    sim_pace();
+    sim.input->deliver(sim.now_us);
+  }
+
+  if (us > sim.now_us)
+  {
+    sim_set_time(us, asleep);
+  }
+  sim_pace();
+
+  if (sim.now_us >= sim.end_us)
+  {
+    longjmp(sim.end, 1);
+  }
+}
+
+uint64_t sim_now_us(void)
+{
+  return sim.now_us;
+}
+
+uint64_t time_us_64(void)
+{
+  return sim.now_us;
+}
+
+uint32_t time_us_32(void)
+{
+  return (uint32_t)sim.now_us;
+}
+
+absolute_time_t get_absolute_time(void)
+{
+  return sim.now_us;
+}
+
+absolute_time_t from_us_since_boot(uint64_t us)
+{
+  return us;
+}
+
+uint32_t to_ms_since_boot(absolute_time_t t)
+{
+  return (uint32_t)(t / 1000);
+}
+
+void sleep_us(uint64_t us)
+{
+  sim_advance_to(sim.now_us + us, 1);
+}
+
+void sleep_ms(uint32_t ms)
+{
+  sleep_us((uint64_t)ms * 1000);
+}
+
+void busy_wait_us_32(uint32_t us)
+{
+  sim_advance_to(sim.now_us + us, 0);
+}
+
+bool best_effort_wfe_or_timeout(absolute_time_t until)
+{
+  uint64_t next_us = sim.input ? sim.input->next_us() : UINT64_MAX;
+
+  sim_advance_to(next_us < until ? next_us : until, 1);
+  return sim.now_us >= until;
+}
+
+bool stdio_init_all(void)
+{
+  return true;
+}
+
+// *****************************************************************************
+// GPIO
+// *****************************************************************************
+
+static void sim_gpio_raise(uint gpio, uint32_t events)
+{
+  events &= sim.gpio[gpio].irq_events;
+  if (!events || !sim.gpio_callback)
+  {
+    return;
+  }
+
+  if (sim.interrupts_disabled)
+  {
+    sim.gpio[gpio].pending_events |= events;
+    return;
+  }
+
+  sim.gpio_callback(gpio, events);
+}
+
+// Drives a pin from outside (sensor, PIR)
+static void sim_gpio_drive(uint gpio, int level)
+{
+  SimGpio *pin = &sim.gpio[gpio];
+  int old = gpio_get(gpio);
+
+  pin->driven = 1;
+  pin->level = level;
+
+  if (gpio_get(gpio) != old)
+  {
+    sim_gpio_raise(gpio, level ? GPIO_IRQ_EDGE_RISE : GPIO_IRQ_EDGE_FALL);
+  }
+}
+
+void gpio_init(uint gpio)
+{
+  sim.gpio[gpio].dir = GPIO_IN;
+  sim.gpio[gpio].out = 0;
+}
+
+void gpio_pull_up(uint gpio)
+{
+  sim.gpio[gpio].pull = 1;
+}
+
+void gpio_pull_down(uint gpio)
+{
+  sim.gpio[gpio].pull = -1;
+}
+
+void gpio_set_dir(uint gpio, bool out)
+{
+  sim.gpio[gpio].dir = out ? GPIO_OUT : GPIO_IN;
+}
+
+void gpio_put(uint gpio, bool value)
+{
+  SimGpio *pin = &sim.gpio[gpio];
+
+  if (pin->out == value)
+  {
+    return;
+  }
+  pin->out = value;
+  if (pin->dir == GPIO_OUT)
+  {
+    sim_log("gpio %u %d", gpio, value);
+    sim_stats.led_changes++;
+  }
+}
+
+bool gpio_get(uint gpio)
+{
+  SimGpio *pin = &sim.gpio[gpio];
+
+  if (pin->dir == GPIO_OUT)
+  {
+    return pin->out;
+  }
+  if (pin->driven)
+  {
+    return pin->level;
+  }
+  return pin->pull > 0;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn)
+{
+  (void)gpio;
+  (void)fn;
+}
+
+void gpio_set_irq_enabled_with_callback(uint gpio, uint32_t events, bool enabled, gpio_irq_callback_t callback)
+{
+  if (enabled)
+  {
+    sim.gpio[gpio].irq_events |= events;
+  }
+  else
+  {
+    sim.gpio[gpio].irq_events &= ~events;
+  }
+  sim.gpio_callback = callback;
+}
+
+uint32_t save_and_disable_interrupts(void)
+{
+  uint32_t status = sim.interrupts_disabled;
+
+  sim.interrupts_disabled = 1;
+  return status;
+}
+
+void restore_interrupts(uint32_t status)
+{
+  sim.interrupts_disabled = status;
+  if (status)
+  {
+    return;
+  }
+
+  for (uint gpio = 0; gpio < SIM_NUM_GPIOS; gpio++)
+  {
+    uint32_t events = sim.gpio[gpio].pending_events;
+    if (events)
+    {
+      sim.gpio[gpio].pending_events = 0;
+      sim_gpio_raise(gpio, events);
+    }
+  }
+}
+
+// *****************************************************************************
+// Clocks, UART
+// *****************************************************************************
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required)
+{
+  (void)required;
+
+  if (freq_khz != sim.sys_khz)
+  {
+    sim.sys_khz = freq_khz;
+    sim_stats.clock_switches++;
+    sim_log("clock %" PRIu32 " kHz", freq_khz);
+  }
+  return true;
+}
+
+uint32_t clock_get_hz(enum clock_index clk_index)
+{
+  (void)clk_index;
+  return sim.sys_khz * 1000;
+}
+
+uint uart_set_baudrate(uart_inst_t *uart, uint baudrate)
+{
+  uart->baudrate = baudrate;
+  return baudrate;
+}
+
+// *****************************************************************************
+// I2C with an LTR303 on i2c1
+// *****************************************************************************
+
+static void sim_ltr303_reset()
+{
+  SimLtr303 *ltr = &sim.ltr303;
+
+  memset(ltr->regs, 0, sizeof(ltr->regs));
+  ltr->regs[SIM_LTR303_PART_ID] = 0xA0;
+  ltr->regs[SIM_LTR303_MANU_ID] = 0x05;
+  ltr->regs[SIM_LTR303_INTERRUPT] = 0x08;
+  ltr->ready_us = 0;
+  sim_gpio_drive(SIM_LTR303_INT_PIN, 1);
+}
+
+static void sim_ltr303_write(uint8_t reg, uint8_t value)
+{
+  if (reg == SIM_LTR303_ALS_CTRL && (value & 0x02))
+  {
+    sim_ltr303_reset();
+    return;
+  }
+  sim.ltr303.regs[reg] = value;
+}
+
+static uint8_t sim_ltr303_read(uint8_t reg)
+{
+  SimLtr303 *ltr = &sim.ltr303;
+
+  switch (reg)
+  {
+  case SIM_LTR303_CH1DATA:
+    if (ltr->regs[SIM_LTR303_STATUS] & SIM_LTR303_STATUS_NEW_DATA)
+    {
+      sim_latency_add(&sim_stats.light_latency, sim.now_us - ltr->ready_us);
+    }
+    return (uint8_t)ltr->ch1;
+  case SIM_LTR303_CH1DATA + 1:
+    return (uint8_t)(ltr->ch1 >> 8);
+  case SIM_LTR303_CH1DATA + 2:
+    return (uint8_t)ltr->ch0;
+  case SIM_LTR303_CH1DATA + 3:
+    ltr->regs[SIM_LTR303_STATUS] &= ~SIM_LTR303_STATUS_NEW_DATA;
+    return (uint8_t)(ltr->ch0 >> 8);
+  case SIM_LTR303_STATUS:
+  {
+    // Reading the status clears the interrupt
+    uint8_t status = ltr->regs[SIM_LTR303_STATUS];
+    ltr->regs[SIM_LTR303_STATUS] &= ~SIM_LTR303_STATUS_INTERRUPT;
+    sim_gpio_drive(SIM_LTR303_INT_PIN, 1);
+    return status;
+  }
+  default:
+    return ltr->regs[reg];
+  }
+}
+
+// 9 clocks per byte, plus the address byte
+static void sim_i2c_transfer_time(i2c_inst_t *i2c, size_t len)
+{
+  uint baudrate = i2c->baudrate ? i2c->baudrate : 100000;
+
+  busy_wait_us_32((uint32_t)((len + 1) * 9 * 1000000ull / baudrate));
+}
+
+uint i2c_init(i2c_inst_t *i2c, uint baudrate)
+{
+  i2c->baudrate = baudrate;
+  return baudrate;
+}
+
+void i2c_deinit(i2c_inst_t *i2c)
+{
+  (void)i2c;
+}
+
+uint i2c_set_baudrate(i2c_inst_t *i2c, uint baudrate)
+{
+  i2c->baudrate = baudrate;
+  return baudrate;
+}
+
+int i2c_write_timeout_us(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop, uint timeout_us)
+{
+  (void)nostop;
+  (void)timeout_us;
+
+  if (i2c != i2c1 || addr != SIM_LTR303_ADDR)
+  {
+    sim_i2c_transfer_time(i2c, 0);
+    return PICO_ERROR_GENERIC;
+  }
+
+  sim_i2c_transfer_time(i2c, len);
+  if (len > 0)
+  {
+    sim.ltr303.pointer = src[0];
+    for (size_t i = 1; i < len; i++)
+    {
+      sim_ltr303_write(sim.ltr303.pointer++, src[i]);
+    }
+  }
+  return (int)len;
+}
+
+int i2c_read_timeout_us(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop, uint timeout_us)
+{
+  (void)nostop;
+  (void)timeout_us;
+
+  if (i2c != i2c1 || addr != SIM_LTR303_ADDR)
+  {
+    sim_i2c_transfer_time(i2c, 0);
+    return PICO_ERROR_GENERIC;
+  }
+
+  sim_i2c_transfer_time(i2c, len);
+  for (size_t i = 0; i < len; i++)
+  {
+    dst[i] = sim_ltr303_read(sim.ltr303.pointer++);
+  }
+  return (int)len;
+}
+
+int i2c_write_blocking(i2c_inst_t *i2c, uint8_t addr, const uint8_t *src, size_t len, bool nostop)
+{
+  return i2c_write_timeout_us(i2c, addr, src, len, nostop, 0);
+}
+
+int i2c_read_blocking(i2c_inst_t *i2c, uint8_t addr, uint8_t *dst, size_t len, bool nostop)
+{
+  return i2c_read_timeout_us(i2c, addr, dst, len, nostop, 0);
+}
+
+// *****************************************************************************
+// Flash
+// *****************************************************************************
+
+void flash_range_erase(uint32_t flash_offs, size_t count)
+{
+  memset(sim_flash + flash_offs, 0xFF, count);
+  busy_wait_us_32((uint32_t)(count / FLASH_SECTOR_SIZE * SIM_FLASH_SECTOR_ERASE_US));
+}
+
+void flash_range_program(uint32_t flash_offs, const uint8_t *data, size_t count)
+{
+  // Programming can only clear bits
+  for (size_t i = 0; i < count; i++)
+  {
+    sim_flash[flash_offs + i] &= data[i];
+  }
+  busy_wait_us_32((uint32_t)(count / FLASH_PAGE_SIZE * SIM_FLASH_PAGE_PROGRAM_US));
+}
+
+// *****************************************************************************
+// PWM and DMA (LED)
+// *****************************************************************************
+
+uint pwm_gpio_to_slice_num(uint gpio)
+{
+  return (gpio >> 1) & 7;
+}
+
+uint pwm_get_dreq(uint slice_num)
+{
+  return SIM_DREQ_PWM_WRAP0 + slice_num;
+}
+
+pwm_config pwm_get_default_config(void)
+{
+  pwm_config config = {.div = 1, .top = 0xffff};
+  return config;
+}
+
+void pwm_config_set_wrap(pwm_config *c, uint16_t wrap)
+{
+  c->top = wrap;
+}
+
+void pwm_init(uint slice_num, pwm_config *c, bool start)
+{
+  (void)start;
+  sim.pwm_div[slice_num] = c->div;
+  sim.pwm_top[slice_num] = c->top;
+}
+
+void pwm_set_enabled(uint slice_num, bool enabled)
+{
+  (void)slice_num;
+  (void)enabled;
+}
+
+void pwm_set_both_levels(uint slice_num, uint16_t level_a, uint16_t level_b)
+{
+  (void)level_b;
+
+  sim_pwm_hw.slice[slice_num].cc = level_a | ((uint32_t)level_b << 16);
+  if (sim.pwm_level[slice_num] != level_a)
+  {
+    sim.pwm_level[slice_num] = level_a;
+    sim_stats.led_changes++;
+    sim_log("pwm %u %u", slice_num, level_a);
+  }
+}
+
+void pwm_set_clkdiv_int_frac(uint slice_num, uint8_t integer, uint8_t fract)
+{
+  (void)fract;
+  sim.pwm_div[slice_num] = integer;
+}
+
+void pwm_set_wrap(uint slice_num, uint16_t wrap)
+{
+  sim.pwm_top[slice_num] = wrap;
+}
+
+void pwm_set_counter(uint slice_num, uint16_t c)
+{
+  (void)slice_num;
+  (void)c;
+}
+
+int dma_claim_unused_channel(bool required)
+{
+  (void)required;
+  return 0;
+}
+
+void dma_channel_abort(uint channel)
+{
+  (void)channel;
+}
+
+dma_channel_config dma_channel_get_default_config(uint channel)
+{
+  (void)channel;
+  dma_channel_config config = {DMA_SIZE_32, true, false, 0};
+  return config;
+}
+
+void channel_config_set_transfer_data_size(dma_channel_config *c, enum dma_channel_transfer_size size)
+{
+  c->size = size;
+}
+
+void channel_config_set_read_increment(dma_channel_config *c, bool incr)
+{
+  c->read_increment = incr;
+}
+
+void channel_config_set_write_increment(dma_channel_config *c, bool incr)
+{
+  c->write_increment = incr;
+}
+
+void channel_config_set_dreq(dma_channel_config *c, uint dreq)
+{
+  c->dreq = dreq;
+}
+
+// Only knows the LED envelopes: a 16 bit table into a PWM compare register,
+// paced by another slice's wrap. Logged as one ramp, the last level stays.
+void dma_channel_configure(uint channel, const dma_channel_config *config, volatile void *write_addr,
+                           const volatile void *read_addr, uint transfer_count, bool trigger)
+{
+  (void)channel;
+
+  uintptr_t cc = (uintptr_t)&sim_pwm_hw.slice[0].cc;
+  uintptr_t addr = (uintptr_t)write_addr;
+  if (!trigger || config->size != DMA_SIZE_16 || transfer_count == 0 || addr < cc ||
+      (addr - cc) % sizeof(sim_pwm_hw.slice[0]) != 0 || config->dreq < SIM_DREQ_PWM_WRAP0)
+  {
+    return;
+  }
+
+  uint slice = (addr - cc) / sizeof(sim_pwm_hw.slice[0]);
+  uint pacing = config->dreq - SIM_DREQ_PWM_WRAP0;
+  const uint16_t *table = (const uint16_t *)read_addr;
+  uint64_t duration_us = (uint64_t)transfer_count * sim.pwm_div[pacing] * (sim.pwm_top[pacing] + 1) * 1000 /
+                         (sim.sys_khz ? sim.sys_khz : 1);
+
+  sim_stats.led_ramps++;
+  sim_log("pwm %u ramp %u -> %u, %" PRIu64 " ms", slice, table[0], table[transfer_count - 1], duration_us / 1000);
+  sim.pwm_level[slice] = table[transfer_count - 1];
+}
+
+// *****************************************************************************
+// CYW43
+// *****************************************************************************
+
+static void sim_ble_poll();
+static void sim_ble_watch_attributes();
+static void sim_ble_queue(int type, const uint8_t *data, uint16_t len);
+static uint64_t sim_ble_next_us();
+
+int cyw43_arch_init(void)
+{
+  return 0;
+}
+
+async_context_t *cyw43_arch_async_context(void)
+{
+  return &sim_context;
+}
+
+void cyw43_arch_gpio_put(uint wl_gpio, bool value)
+{
+  (void)wl_gpio;
+
+  if (sim.wl_led != value)
+  {
+    sim.wl_led = value;
+    sim_log("wl_led %d", value);
+  }
+}
+
+static int sim_work_pending()
+{
+  for (async_when_pending_worker_t *worker = sim_context.workers; worker; worker = worker->next)
+  {
+    if (worker->work_pending)
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void cyw43_arch_poll(void)
+{
+  sim_advance_to(sim.now_us + SIM_POLL_COST_US, 0);
+
+  sim_ble_poll();
+
+  for (async_when_pending_worker_t *worker = sim_context.workers; worker; worker = worker->next)
+  {
+    if (worker->work_pending)
+    {
+      worker->work_pending = false;
+      worker->do_work(&sim_context, worker);
+    }
+  }
+
+  sim_ble_watch_attributes();
+}
+
+bool async_context_add_when_pending_worker(async_context_t *context, async_when_pending_worker_t *worker)
+{
+  worker->next = context->workers;
+  context->workers = worker;
+  return true;
+}
+
+void async_context_set_work_pending(async_context_t *context, async_when_pending_worker_t *worker)
+{
+  (void)context;
+  worker->work_pending = true;
+}
+
+// Sleeps until `until`, a GPIO interrupt or BTstack work, whatever is first
+void async_context_wait_for_work_until(async_context_t *context, absolute_time_t until)
+{
+  (void)context;
+
+  while (sim.now_us < until && !sim_work_pending())
+  {
+    uint64_t wake_us = until;
+    uint64_t ble_us = sim_ble_next_us();
+    if (ble_us < wake_us)
+    {
+      wake_us = ble_us;
+    }
+    if (wake_us <= sim.now_us)
+    {
+      return;
+    }
+
+    // Stops at the next input, which may raise an interrupt
+    uint64_t input_us = sim.input ? sim.input->next_us() : UINT64_MAX;
+    sim_advance_to(input_us < wake_us ? input_us : wake_us, 1);
+
+    if (sim.now_us >= ble_us)
+    {
+      return;
+    }
+  }
+}
+
+// *****************************************************************************
+// BLE
+// *****************************************************************************
+
+static uint64_t sim_ble_interval_us(uint16_t interval)
+{
+  return interval * 1250ull;
+}
+
+// Moves event_us to the first connection event after now
+static void sim_ble_skip_conn_events()
+{
+  uint64_t interval_us = sim_ble_interval_us(sim.ble.conn_interval);
+
+  if (sim.now_us >= sim.ble.event_us)
+  {
+    sim.ble.event_us += ((sim.now_us - sim.ble.event_us) / interval_us + 1) * interval_us;
+  }
+}
+
+// When the firmware has to run for BTstack next
+static uint64_t sim_ble_next_us()
+{
+  uint64_t next_us = UINT64_MAX;
+
+  if ((sim.ble.powered && !sim.ble.working) || sim.ble.queue_count > 0 || sim.ble.data_sources_polled)
+  {
+    return sim.now_us;
+  }
+  if (sim.ble.timers)
+  {
+    next_us = (uint64_t)sim.ble.timers->timeout * 1000;
+  }
+  if (sim.ble.update_at_us && sim.ble.update_at_us < next_us)
+  {
+    next_us = sim.ble.update_at_us;
+  }
+  if (sim.ble.connected && sim.ble.send_requests)
+  {
+    if (sim.ble.event_us < next_us)
+    {
+      next_us = sim.ble.event_us;
+    }
+  }
+  return next_us;
+}
+
+static void sim_ble_hci_event(uint8_t *event, uint16_t size)
+{
+  for (btstack_packet_callback_registration_t *handler = sim.ble.hci_handlers; handler; handler = handler->next)
+  {
+    handler->callback(HCI_EVENT_PACKET, 0, event, size);
+  }
+}
+
+static void sim_ble_sm_event(uint8_t *event, uint16_t size)
+{
+  for (btstack_packet_callback_registration_t *handler = sim.ble.sm_handlers; handler; handler = handler->next)
+  {
+    handler->callback(HCI_EVENT_PACKET, 0, event, size);
+  }
+}
+
+// The phone connects from a private address, after bonding we know its
+// public identity address
+static void sim_ble_identity_event(uint8_t type)
+{
+  uint8_t event[20];
+
+  memset(event, 0, sizeof(event));
+  event[0] = type;
+  event[1] = sizeof(event) - 2;
+  little_endian_store_16(event, 2, SIM_CON_HANDLE);
+  event[4] = 1;
+  memcpy(&event[5], (const uint8_t[]){0x5a, 0x4c, 0x3e, 0x2d, 0x1c, 0xc0}, 6);
+  event[11] = 0;
+  memcpy(&event[12], (const uint8_t[]){0x66, 0x55, 0x44, 0x33, 0x22, 0x11}, 6);
+  sim_ble_sm_event(event, type == SM_EVENT_IDENTITY_RESOLVING_FAILED ? 11 : sizeof(event));
+}
+
+static void sim_ble_att_event(uint8_t *event, uint16_t size)
+{
+  if (sim.ble.att_handler)
+  {
+    sim.ble.att_handler(HCI_EVENT_PACKET, 0, event, size);
+  }
+}
+
+static void sim_ble_spp_event(uint8_t subevent)
+{
+  uint8_t event[5] = {HCI_EVENT_GATTSERVICE_META, 3, subevent};
+
+  little_endian_store_16(event, 3, SIM_CON_HANDLE);
+  if (sim.ble.spp_handler)
+  {
+    sim.ble.spp_handler(HCI_EVENT_PACKET, 0, event, sizeof(event));
+  }
+}
+
+static void sim_ble_subscribed_time()
+{
+  if (sim.ble.subscribed)
+  {
+    sim_stats.subscribed_us += sim.now_us - sim.ble.subscribed_since_us;
+    sim.ble.subscribed_since_us = sim.now_us;
+  }
+}
+
+static void sim_ble_process(SimBleEvent *ble_event)
+{
+  uint8_t event[19];
+
+  switch (ble_event->type)
+  {
+  case SIM_BLE_CONNECT:
+    sim.ble.connected = 1;
+    sim.ble.mtu = ATT_DEFAULT_MTU;
+    sim.ble.conn_interval = little_endian_read_16(ble_event->data, 0);
+    sim.ble.event_us = sim.now_us + sim_ble_interval_us(sim.ble.conn_interval);
+    sim.ble.update_at_us = 0;
+    sim_log("connected, interval %u", sim.ble.conn_interval);
+
+    memset(event, 0, sizeof(event));
+    event[0] = HCI_EVENT_LE_META;
+    event[1] = sizeof(event) - 2;
+    event[2] = HCI_SUBEVENT_LE_CONNECTION_COMPLETE;
+    little_endian_store_16(event, 4, SIM_CON_HANDLE);
+    event[7] = 1; // random address, the same every time
+    memcpy(&event[8], (const uint8_t[]){0x5a, 0x4c, 0x3e, 0x2d, 0x1c, 0xc0}, 6);
+    little_endian_store_16(event, 14, sim.ble.conn_interval);
+    sim_ble_hci_event(event, sizeof(event));
+
+    memset(event, 0, sizeof(event));
+    event[0] = ATT_EVENT_CONNECTED;
+    event[1] = 9;
+    little_endian_store_16(event, 9, SIM_CON_HANDLE);
+    sim_ble_att_event(event, 11);
+
+    // A bonded phone is recognized and encrypts with its keys on its own
+    if (sim.ble.bonded)
+    {
+      sim_ble_identity_event(SM_EVENT_IDENTITY_RESOLVING_SUCCEEDED);
+      sim_ble_queue(SIM_BLE_ENCRYPT, NULL, 0);
+    }
+    else
+    {
+      sim_ble_identity_event(SM_EVENT_IDENTITY_RESOLVING_FAILED);
+    }
+    break;
+
+  case SIM_BLE_ENCRYPT:
+    if (!sim.ble.connected)
+    {
+      break;
+    }
+    if (sim.ble.encrypted)
+    {
+      break;
+    }
+    sim_log("encrypted%s", sim.ble.bonded ? "" : ", bonded");
+    sim.ble.encrypted = 1;
+    event[0] = HCI_EVENT_ENCRYPTION_CHANGE;
+    event[1] = 4;
+    event[2] = 0;
+    little_endian_store_16(event, 3, SIM_CON_HANDLE);
+    event[5] = 1;
+    sim_ble_hci_event(event, 6);
+    if (!sim.ble.bonded)
+    {
+      // Keys are distributed over the encrypted link
+      sim.ble.bonded = 1;
+      sim_ble_identity_event(SM_EVENT_IDENTITY_CREATED);
+    }
+    break;
+
+  case SIM_BLE_MTU:
+    sim.ble.mtu = little_endian_read_16(ble_event->data, 0);
+    sim_log("mtu %u", sim.ble.mtu);
+    event[0] = ATT_EVENT_MTU_EXCHANGE_COMPLETE;
+    event[1] = 4;
+    little_endian_store_16(event, 2, SIM_CON_HANDLE);
+    little_endian_store_16(event, 4, sim.ble.mtu);
+    sim_ble_att_event(event, 6);
+    break;
+
+  case SIM_BLE_SUBSCRIBE:
+    sim_log("subscribed");
+    sim.ble.subscribed = 1;
+    sim.ble.subscribed_since_us = sim.now_us;
+    sim_ble_spp_event(GATTSERVICE_SUBEVENT_SPP_SERVICE_CONNECTED);
+    break;
+
+  case SIM_BLE_WRITE:
+    sim_log("spp rx %c, %u bytes", ble_event->data[0] >= 0x20 && ble_event->data[0] < 0x7f ? ble_event->data[0] : '?',
+            ble_event->len);
+    sim_stats.spp_commands++;
+    if (!sim.ble.command_since_us)
+    {
+      sim.ble.command_since_us = sim.now_us;
+    }
+    if (sim.ble.spp_handler)
+    {
+      sim.ble.spp_handler(RFCOMM_DATA_PACKET, SIM_CON_HANDLE, ble_event->data, ble_event->len);
+    }
+    break;
+
+  case SIM_BLE_DISCONNECT:
+    sim_log("disconnected");
+    sim_ble_subscribed_time();
+    sim.ble.connected = 0;
+    sim.ble.subscribed = 0;
+    sim.ble.encrypted = 0;
+    sim.ble.send_requests = NULL;
+    sim.ble.update_at_us = 0;
+    sim.ble.command_since_us = 0;
+
+    sim_ble_spp_event(GATTSERVICE_SUBEVENT_SPP_SERVICE_DISCONNECTED);
+
+    event[0] = ATT_EVENT_DISCONNECTED;
+    event[1] = 2;
+    little_endian_store_16(event, 2, SIM_CON_HANDLE);
+    sim_ble_att_event(event, 4);
+
+    event[0] = HCI_EVENT_DISCONNECTION_COMPLETE;
+    event[1] = 4;
+    event[2] = 0;
+    little_endian_store_16(event, 3, SIM_CON_HANDLE);
+    event[5] = 0x13; // remote user terminated
+    sim_ble_hci_event(event, 6);
+    break;
+  }
+}
+
+// Lets queued can-send-now requests send, up to what one connection event
+// carries
+static void sim_ble_connection_event()
+{
+  int budget = SIM_PACKETS_PER_CONN_EVENT;
+
+  while (budget > 0 && sim.ble.connected && sim.ble.send_requests)
+  {
+    btstack_context_callback_registration_t *request = sim.ble.send_requests;
+    sim.ble.send_requests = request->next;
+    request->next = NULL;
+
+    sim.ble.sent_in_callback = 0;
+    request->callback(request->context);
+    budget -= sim.ble.sent_in_callback;
+  }
+}
+
+static void sim_ble_poll()
+{
+  if (sim.ble.powered && !sim.ble.working)
+  {
+    uint8_t event[3] = {BTSTACK_EVENT_STATE, 1, HCI_STATE_WORKING};
+    sim.ble.working = 1;
+    sim_log("hci working");
+    sim_ble_hci_event(event, sizeof(event));
+  }
+
+  while (sim.ble.queue_count > 0)
+  {
+    SimBleEvent *ble_event = &sim.ble.queue[sim.ble.queue_head];
+    sim.ble.queue_head = (sim.ble.queue_head + 1) % SIM_BLE_QUEUE_SIZE;
+    sim.ble.queue_count--;
+    sim_ble_process(ble_event);
+  }
+
+  if (sim.ble.update_at_us && sim.now_us >= sim.ble.update_at_us)
+  {
+    uint8_t event[12] = {HCI_EVENT_LE_META, 10, HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE};
+
+    sim.ble.conn_interval = sim.ble.update_interval;
+    sim.ble.event_us = sim.ble.update_at_us;
+    sim.ble.update_at_us = 0;
+    sim_stats.conn_updates++;
+    sim_log("connection interval %u", sim.ble.conn_interval);
+
+    little_endian_store_16(event, 4, SIM_CON_HANDLE);
+    little_endian_store_16(event, 6, sim.ble.conn_interval);
+    sim_ble_hci_event(event, sizeof(event));
+  }
+
+  if (sim.ble.connected && sim.now_us >= sim.ble.event_us)
+  {
+    // Events without anything to send pass unnoticed
+    if (sim.ble.send_requests)
+    {
+      sim_ble_connection_event();
+    }
+    sim_ble_skip_conn_events();
+  }
+
+  if (sim.ble.data_sources_polled)
+  {
+    sim.ble.data_sources_polled = 0;
+    for (btstack_data_source_t *ds = sim.ble.data_sources; ds; ds = ds->next)
+    {
+      if (ds->flags & DATA_SOURCE_CALLBACK_POLL)
+      {
+        ds->process(ds, DATA_SOURCE_CALLBACK_POLL);
+      }
+    }
+  }
+
+  uint32_t now_ms = btstack_run_loop_get_time_ms();
+  while (sim.ble.timers && (int32_t)(sim.ble.timers->timeout - now_ms) <= 0)
+  {
+    btstack_timer_source_t *timer = sim.ble.timers;
+    sim.ble.timers = timer->next;
+    timer->next = NULL;
+    timer->process(timer);
+  }
+}
+
+static void sim_ble_queue(int type, const uint8_t *data, uint16_t len)
+{
+  if (sim.ble.queue_count >= SIM_BLE_QUEUE_SIZE)
+  {
+    fprintf(stderr, "sim: BLE event queue full\n");
+    return;
+  }
+
+  SimBleEvent *event = &sim.ble.queue[(sim.ble.queue_head + sim.ble.queue_count) % SIM_BLE_QUEUE_SIZE];
+  event->type = type;
+  event->len = len > sizeof(event->data) ? sizeof(event->data) : len;
+  if (data)
+  {
+    memcpy(event->data, data, event->len);
+  }
+  sim.ble.queue_count++;
+}
+
+static SimAttribute *sim_ble_attribute(const uint8_t *uuid128)
+{
+  for (int i = 0; i < sim.ble.num_attributes; i++)
+  {
+    if (memcmp(sim.ble.attributes[i].uuid128, uuid128, 16) == 0)
+    {
+      return &sim.ble.attributes[i];
+    }
+  }
+
+  if (sim.ble.num_attributes >= SIM_MAX_ATTRIBUTES)
+  {
+    return NULL;
+  }
+
+  SimAttribute *attribute = &sim.ble.attributes[sim.ble.num_attributes];
+  memcpy(attribute->uuid128, uuid128, 16);
+  attribute->value_handle = sim.ble.next_handle;
+  sim.ble.next_handle += 3;
+  attribute->ccc_handle = attribute->value_handle + 1;
+  sim.ble.num_attributes++;
+  return attribute;
+}
+
+// Reads every characteristic value the firmware looked up and logs changes,
+// which shows state transitions even without a subscribed phone
+static void sim_ble_watch_attributes()
+{
+  uint8_t value[SIM_MAX_ATTRIBUTE_LEN];
+
+  for (int i = 0; i < sim.ble.num_attributes; i++)
+  {
+    SimAttribute *attribute = &sim.ble.attributes[i];
+
+    for (att_service_handler_t *handler = sim.ble.service_handlers; handler; handler = handler->next)
+    {
+      if (attribute->value_handle < handler->start_handle || attribute->value_handle > handler->end_handle ||
+          !handler->read_callback)
+      {
+        continue;
+      }
+
+      uint16_t len = handler->read_callback(SIM_CON_HANDLE, attribute->value_handle, 0, value, sizeof(value));
+      if (len == attribute->value_len && memcmp(value, attribute->value, len) == 0)
+      {
+        break;
+      }
+
+      memcpy(attribute->value, value, len);
+      attribute->value_len = len;
+      sim_stats.attr_changes++;
+
+      if (sim.log)
+      {
+        sim_log("attr %02x%02x%02x%02x %u bytes", attribute->uuid128[0], attribute->uuid128[1],
+                attribute->uuid128[2], attribute->uuid128[3], len);
+      }
+      break;
+    }
+  }
+}
+
+void btstack_run_loop_set_timer(btstack_timer_source_t *ts, uint32_t timeout_in_ms)
+{
+  ts->timeout = btstack_run_loop_get_time_ms() + timeout_in_ms;
+}
+
+int btstack_run_loop_remove_timer(btstack_timer_source_t *ts)
+{
+  for (btstack_timer_source_t **it = &sim.ble.timers; *it; it = &(*it)->next)
+  {
+    if (*it == ts)
+    {
+      *it = ts->next;
+      ts->next = NULL;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void btstack_run_loop_add_timer(btstack_timer_source_t *ts)
+{
+  btstack_run_loop_remove_timer(ts);
+
+  btstack_timer_source_t **it = &sim.ble.timers;
+  while (*it && (int32_t)((*it)->timeout - ts->timeout) <= 0)
+  {
+    it = &(*it)->next;
+  }
+  ts->next = *it;
+  *it = ts;
+}
+
+uint32_t btstack_run_loop_get_time_ms(void)
+{
+  return (uint32_t)(sim.now_us / 1000);
+}
+
+void btstack_run_loop_set_data_source_handler(btstack_data_source_t *ds,
+                                             void (*process)(btstack_data_source_t *ds,
+                                                             btstack_data_source_callback_type_t callback_type))
+{
+  ds->process = process;
+}
+
+void btstack_run_loop_enable_data_source_callbacks(btstack_data_source_t *ds, uint16_t callbacks)
+{
+  ds->flags |= callbacks;
+}
+
+void btstack_run_loop_add_data_source(btstack_data_source_t *ds)
+{
+  ds->next = sim.ble.data_sources;
+  sim.ble.data_sources = ds;
+}
+
+void btstack_run_loop_poll_data_sources_from_irq(void)
+{
+  sim.ble.data_sources_polled = 1;
+}
+
+void hci_add_event_handler(btstack_packet_callback_registration_t *callback_handler)
+{
+  callback_handler->next = sim.ble.hci_handlers;
+  sim.ble.hci_handlers = callback_handler;
+}
+
+int hci_power_control(int mode)
+{
+  sim.ble.powered = mode == HCI_POWER_ON;
+  return 0;
+}
+
+void l2cap_init(void)
+{
+}
+
+void sm_init(void)
+{
+}
+
+void sm_set_io_capabilities(int io_capability)
+{
+  (void)io_capability;
+}
+
+void sm_set_authentication_requirements(uint8_t auth_req)
+{
+  (void)auth_req;
+}
+
+// The phone always uses Just Works, that is not asked for
+void sm_add_event_handler(btstack_packet_callback_registration_t *callback_handler)
+{
+  callback_handler->next = sim.ble.sm_handlers;
+  sim.ble.sm_handlers = callback_handler;
+}
+
+void sm_just_works_confirm(hci_con_handle_t con_handle)
+{
+  (void)con_handle;
+}
+
+// The phone pairs and bonds, or encrypts if it already has
+void sm_request_pairing(hci_con_handle_t con_handle)
+{
+  (void)con_handle;
+
+  sim_ble_queue(SIM_BLE_ENCRYPT, NULL, 0);
+}
+
+int sm_le_device_index(hci_con_handle_t con_handle)
+{
+  (void)con_handle;
+
+  return sim.ble.connected && sim.ble.bonded ? 0 : -1;
+}
+
+void gap_advertisements_set_params(uint16_t adv_int_min, uint16_t adv_int_max, uint8_t adv_type,
+                                   uint8_t direct_address_typ, bd_addr_t direct_address, uint8_t channel_map,
+                                   uint8_t filter_policy)
+{
+  (void)adv_int_max;
+  (void)direct_address_typ;
+  (void)channel_map;
+  (void)filter_policy;
+
+  if (adv_type == 0x01)
+  {
+    sim_log("advertising directed at %02x:%02x:%02x:%02x:%02x:%02x", direct_address[0], direct_address[1],
+            direct_address[2], direct_address[3], direct_address[4], direct_address[5]);
+  }
+  else
+  {
+    sim_log("advertising every %u", adv_int_min);
+  }
+}
+
+void gap_advertisements_set_data(uint8_t advertising_data_length, uint8_t *advertising_data)
+{
+  (void)advertising_data_length;
+  (void)advertising_data;
+}
+
+void gap_advertisements_enable(int enabled)
+{
+  (void)enabled;
+}
+
+int gap_encryption_key_size(hci_con_handle_t con_handle)
+{
+  (void)con_handle;
+
+  return sim.ble.connected && sim.ble.encrypted ? 16 : 0;
+}
+
+// The phone accepts every request and picks the shortest interval allowed
+int gap_request_connection_parameter_update(hci_con_handle_t con_handle, uint16_t conn_interval_min,
+                                            uint16_t conn_interval_max, uint16_t conn_latency,
+                                            uint16_t supervision_timeout)
+{
+  (void)con_handle;
+  (void)conn_interval_max;
+  (void)conn_latency;
+  (void)supervision_timeout;
+
+  if (!sim.ble.connected)
+  {
+    return 1;
+  }
+
+  sim.ble.update_interval = conn_interval_min;
+  sim_ble_skip_conn_events();
+  sim.ble.update_at_us = sim.ble.event_us + SIM_CONN_UPDATE_EVENTS * sim_ble_interval_us(sim.ble.conn_interval);
+  return 0;
+}
+
+void att_server_init(const uint8_t *db, att_read_callback_t read_callback, att_write_callback_t write_callback)
+{
+  (void)db;
+  (void)read_callback;
+  (void)write_callback;
+}
+
+void att_server_register_packet_handler(btstack_packet_handler_t handler)
+{
+  sim.ble.att_handler = handler;
+}
+
+void att_server_register_service_handler(att_service_handler_t *handler)
+{
+  handler->next = sim.ble.service_handlers;
+  sim.ble.service_handlers = handler;
+}
+
+static void sim_ble_request_send(btstack_context_callback_registration_t *request)
+{
+  btstack_context_callback_registration_t **it = &sim.ble.send_requests;
+
+  for (; *it; it = &(*it)->next)
+  {
+    if (*it == request)
+    {
+      return;
+    }
+  }
+  request->next = NULL;
+  *it = request;
+}
+
+int att_server_request_to_send_notification(btstack_context_callback_registration_t *callback_registration,
+                                            hci_con_handle_t con_handle)
+{
+  (void)con_handle;
+
+  if (!sim.ble.connected)
+  {
+    return 1;
+  }
+  sim_ble_request_send(callback_registration);
+  return 0;
+}
+
+int att_server_notify(hci_con_handle_t con_handle, uint16_t attribute_handle, const uint8_t *value, uint16_t value_len)
+{
+  (void)con_handle;
+  (void)value;
+
+  sim_stats.notifications++;
+  sim.ble.sent_in_callback++;
+  if (value_len > sim.ble.mtu - 3)
+  {
+    sim_log("notify 0x%04x too long, %u bytes", attribute_handle, value_len);
+  }
+  return 0;
+}
+
+uint16_t att_server_get_mtu(hci_con_handle_t con_handle)
+{
+  (void)con_handle;
+  return sim.ble.mtu;
+}
+
+uint16_t att_read_callback_handle_blob(const uint8_t *blob, uint16_t blob_size, uint16_t offset, uint8_t *buffer,
+                                       uint16_t buffer_size)
+{
+  if (offset > blob_size)
+  {
+    return 0;
+  }
+
+  uint16_t len = blob_size - offset;
+  if (buffer)
+  {
+    if (len > buffer_size)
+    {
+      len = buffer_size;
+    }
+    memcpy(buffer, blob + offset, len);
+  }
+  return len;
+}
+
+int gatt_server_get_handle_range_for_service_with_uuid128(const uint8_t *uuid128, uint16_t *start_handle,
+                                                          uint16_t *end_handle)
+{
+  (void)uuid128;
+
+  // Each service gets its own range, the characteristics looked up next go
+  // in it
+  sim.ble.num_services++;
+  *start_handle = 0x0100 * sim.ble.num_services;
+  *end_handle = *start_handle + 0xff;
+  sim.ble.next_handle = *start_handle + 1;
+  return 1;
+}
+
+uint16_t gatt_server_get_value_handle_for_characteristic_with_uuid128(uint16_t start_handle, uint16_t end_handle,
+                                                                      const uint8_t *uuid128)
+{
+  (void)start_handle;
+  (void)end_handle;
+
+  SimAttribute *attribute = sim_ble_attribute(uuid128);
+  return attribute ? attribute->value_handle : 0;
+}
+
+uint16_t gatt_server_get_client_configuration_handle_for_characteristic_with_uuid128(uint16_t start_handle,
+                                                                                     uint16_t end_handle,
+                                                                                     const uint8_t *uuid128)
+{
+  (void)start_handle;
+  (void)end_handle;
+
+  SimAttribute *attribute = sim_ble_attribute(uuid128);
+  return attribute ? attribute->ccc_handle : 0;
+}
+
+void nordic_spp_service_server_init(btstack_packet_handler_t packet_handler)
+{
+  sim.ble.spp_handler = packet_handler;
+}
+
+void nordic_spp_service_server_request_can_send_now(btstack_context_callback_registration_t *request,
+                                                    hci_con_handle_t con_handle)
+{
+  att_server_request_to_send_notification(request, con_handle);
+}
+
+// State frames are only logged when they change, they are sent whenever
+// nothing else is
+int nordic_spp_service_server_send(hci_con_handle_t con_handle, const uint8_t *data, uint16_t size)
+{
+  (void)con_handle;
+
+  sim.ble.sent_in_callback++;
+
+  if (!sim.ble.subscribed)
+  {
+    sim_stats.spp_unsubscribed++;
+    return 1;
+  }
+
+  sim_stats.spp_frames++;
+  sim_stats.spp_bytes += size;
+  if (size > 0)
+  {
+    sim_stats.spp_frames_by_type[data[0]]++;
+  }
+  if (size > sim.ble.mtu - 3)
+  {
+    sim_stats.spp_oversize++;
+    sim_log("spp tx too long, %u bytes, mtu %u", size, sim.ble.mtu);
+  }
+
+  if (sim.ble.command_since_us)
+  {
+    sim_latency_add(&sim_stats.command_latency, sim.now_us - sim.ble.command_since_us);
+    sim.ble.command_since_us = 0;
+  }
+
+  if (size > 0 && data[0] == 'S')
+  {
+    if (size == sim.ble.last_state_frame_len && memcmp(data, sim.ble.last_state_frame, size) == 0)
+    {
+      return 0;
+    }
+    memcpy(sim.ble.last_state_frame, data, size);
+    sim.ble.last_state_frame_len = size;
+  }
+
+  if (size > 0 && data[0] == 'S' && size >= 4)
+  {
+    sim_log("spp tx S active %u, index %u, length %u", data[1], data[2], data[3]);
+  }
+  else
+  {
+    sim_log("spp tx %c, %u bytes", size > 0 && data[0] >= 0x20 && data[0] < 0x7f ? data[0] : '?', size);
+  }
+  return 0;
+}
+
+// *****************************************************************************
+// TLV
+// *****************************************************************************
+
+static SimTlvTag *sim_tlv_find(uint32_t tag)
+{
+  for (int i = 0; i < sim.num_tlv; i++)
+  {
+    if (sim.tlv[i].tag == tag)
+    {
+      return &sim.tlv[i];
+    }
+  }
+  return NULL;
+}
+
+static int sim_tlv_get_tag(void *context, uint32_t tag, uint8_t *buffer, uint32_t buffer_size)
+{
+  (void)context;
+
+  SimTlvTag *entry = sim_tlv_find(tag);
+  if (!entry)
+  {
+    return 0;
+  }
+  memcpy(buffer, entry->data, entry->len < buffer_size ? entry->len : buffer_size);
+  return (int)entry->len;
+}
+
+static int sim_tlv_store_tag(void *context, uint32_t tag, const uint8_t *data, uint32_t data_size)
+{
+  (void)context;
+
+  SimTlvTag *entry = sim_tlv_find(tag);
+  if (!entry)
+  {
+    if (sim.num_tlv >= SIM_MAX_TLV_TAGS)
+    {
+      return 1;
+    }
+    entry = &sim.tlv[sim.num_tlv++];
+    entry->tag = tag;
+  }
+  if (data_size > SIM_MAX_TLV_LEN)
+  {
+    return 1;
+  }
+  memcpy(entry->data, data, data_size);
+  entry->len = data_size;
+  return 0;
+}
+
+static void sim_tlv_delete_tag(void *context, uint32_t tag)
+{
+  (void)context;
+
+  SimTlvTag *entry = sim_tlv_find(tag);
+  if (entry)
+  {
+    *entry = sim.tlv[--sim.num_tlv];
+  }
+}
+
+static const btstack_tlv_t sim_tlv = {
+    .get_tag = sim_tlv_get_tag,
+    .store_tag = sim_tlv_store_tag,
+    .delete_tag = sim_tlv_delete_tag,
+};
+
+void btstack_tlv_get_instance(const btstack_tlv_t **tlv_impl, void **tlv_context)
+{
+  *tlv_impl = &sim_tlv;
+  *tlv_context = NULL;
+}
+
+void printf_hexdump(const void *data, int size)
+{
+  for (int i = 0; i < size; i++)
+  {
+    printf("%02X ", ((const uint8_t *)data)[i]);
+  }
+  printf("\n");
+}
+
+// *****************************************************************************
+// Inputs
+// *****************************************************************************
+
+void sim_light(uint16_t ch0, uint16_t ch1)
+{
+  SimLtr303 *ltr = &sim.ltr303;
+
+  sim_stats.light_samples++;
+  if (!(ltr->regs[SIM_LTR303_ALS_CTRL] & 0x01))
+  {
+    // Not enabled yet
+    sim_stats.light_missed++;
+    return;
+  }
+
+  if (ltr->regs[SIM_LTR303_STATUS] & SIM_LTR303_STATUS_NEW_DATA)
+  {
+    sim_stats.light_missed++;
+  }
+
+  ltr->ch0 = ch0;
+  ltr->ch1 = ch1;
+  ltr->ready_us = sim.now_us;
+  ltr->regs[SIM_LTR303_STATUS] |= SIM_LTR303_STATUS_NEW_DATA;
+
+  if (ltr->regs[SIM_LTR303_INTERRUPT] & 0x02)
+  {
+    ltr->regs[SIM_LTR303_STATUS] |= SIM_LTR303_STATUS_INTERRUPT;
+    sim_gpio_drive(SIM_LTR303_INT_PIN, 0);
+  }
+}
+
+void sim_pir(int level)
+{
+  sim_gpio_drive(SIM_PIR_PIN, level);
+}
+
+void sim_connect(uint16_t conn_interval)
+{
+  uint8_t data[2];
+
+  little_endian_store_16(data, 0, conn_interval ? conn_interval : 24);
+  sim.ble.will_be_connected = 1;
+  sim_ble_queue(SIM_BLE_CONNECT, data, sizeof(data));
+}
+
+void sim_mtu(uint16_t mtu)
+{
+  uint8_t data[2];
+
+  little_endian_store_16(data, 0, mtu);
+  sim_ble_queue(SIM_BLE_MTU, data, sizeof(data));
+}
+
+void sim_subscribe(void)
+{
+  sim.ble.will_be_subscribed = 1;
+  sim_ble_queue(SIM_BLE_SUBSCRIBE, NULL, 0);
+}
+
+void sim_spp_write(const uint8_t *data, uint16_t len)
+{
+  sim_ble_queue(SIM_BLE_WRITE, data, len);
+}
+
+void sim_disconnect(void)
+{
+  sim.ble.will_be_connected = 0;
+  sim.ble.will_be_subscribed = 0;
+  sim_ble_queue(SIM_BLE_DISCONNECT, NULL, 0);
+}
+
+int sim_connected(void)
+{
+  return sim.ble.will_be_connected;
+}
+
+int sim_subscribed(void)
+{
+  return sim.ble.will_be_subscribed;
+}
+
+// *****************************************************************************
+// Control
+// *****************************************************************************
+
+void sim_init(FILE *log, double speed)
+{
+  memset(&sim, 0, sizeof(sim));
+  memset(&sim_stats, 0, sizeof(sim_stats));
+  memset(sim_flash, 0xFF, sizeof(sim_flash));
+
+  sim.log = log;
+  sim.speed = speed;
+  sim.sys_khz = 125000;
+  sim.end_us = UINT64_MAX;
+
+  // PIR output low, LTR303 INT released
+  sim_gpio_drive(SIM_PIR_PIN, 0);
+  sim_ltr303_reset();
+}
+
+void sim_set_input(const SimInput *input)
+{
+  sim.input = input;
+}
+
+void sim_run(int (*firmware_main)(void), uint64_t end_us)
+{
+  sim.end_us = end_us;
+  clock_gettime(CLOCK_MONOTONIC, &sim.real_start);
+
+  if (setjmp(sim.end) == 0)
+  {
+    firmware_main();
+  }
+
+  sim_ble_subscribed_time();
+}
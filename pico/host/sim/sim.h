@@ -0,0 +1,114 @@
+// *****************************************************************************
+// Simulated Ney Tack board
+//
+// Lets the firmware (ney_tack.c, unchanged) run on the host. The Pico SDK and
+// BTstack headers in this directory are backed by a simulated board: a PIR on
+// GP22, an LTR303 on i2c1 with its INT pin on GP28, flash, the PWM/DMA LED and
+// a BLE link to a single phone.
+//
+// Time is virtual. It only moves when the firmware sleeps, busy-waits, talks
+// to the sensor or polls, so a run only depends on its inputs and can go as
+// fast as the host allows (or be paced to a multiple of real time).
+//
+// Inputs come from a SimInput, everything the firmware does in response is
+// written to the event log and counted in sim_stats.
+// *****************************************************************************
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define SIM_PIR_PIN 22
+#define SIM_LTR303_INT_PIN 28
+#define SIM_LTR303_ADDR 0x29
+
+#define SIM_CON_HANDLE 0x0040
+
+// Virtual time one pass of the firmware's main loop costs
+#define SIM_POLL_COST_US 20
+
+// Notifications the phone accepts per connection event
+#define SIM_PACKETS_PER_CONN_EVENT 4
+
+// Connection events until a parameter update takes effect
+#define SIM_CONN_UPDATE_EVENTS 6
+
+typedef struct
+{
+  // Time of the next input, UINT64_MAX if there is none
+  uint64_t (*next_us)(void);
+  // Applies all inputs due at now_us with the sim_* input functions
+  void (*deliver)(uint64_t now_us);
+} SimInput;
+
+typedef struct
+{
+  uint32_t count;
+  uint64_t total_us;
+  uint64_t max_us;
+} SimLatency;
+
+typedef struct
+{
+  // BLE
+  uint32_t spp_frames;
+  uint64_t spp_bytes;
+  uint32_t spp_frames_by_type[256];
+  uint32_t spp_oversize;     // longer than the MTU allows
+  uint32_t spp_unsubscribed; // sent without notifications enabled
+  uint32_t spp_commands;
+  SimLatency command_latency; // SPP write until the next frame goes out
+  uint64_t subscribed_us;
+  uint32_t notifications;
+  uint32_t conn_updates;
+  uint32_t attr_changes;
+
+  // Light sensor
+  uint32_t light_samples;
+  uint32_t light_missed;       // overwritten before the firmware read them
+  SimLatency light_latency;    // measurement ready until the firmware reads it
+
+  // LED
+  uint32_t led_changes;
+  uint32_t led_ramps;
+
+  // CPU
+  uint64_t asleep_us;
+  uint64_t awake_kcycles; // kHz * ms, for the average clock while awake
+  uint32_t clock_switches;
+} SimStats;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+extern SimStats sim_stats;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+// speed is simulated seconds per real second, 0 for as fast as possible
+void sim_init(FILE *log, double speed);
+void sim_set_input(const SimInput *input);
+// Runs the firmware until the virtual clock reaches end_us
+void sim_run(int (*firmware_main)(void), uint64_t end_us);
+uint64_t sim_now_us(void);
+
+// Inputs
+void sim_light(uint16_t ch0, uint16_t ch1);
+void sim_pir(int level);
+void sim_connect(uint16_t conn_interval);
+void sim_mtu(uint16_t mtu);
+void sim_subscribe(void);
+void sim_spp_write(const uint8_t *data, uint16_t len);
+void sim_disconnect(void);
+int sim_connected(void);
+int sim_subscribed(void);
+
+#endif
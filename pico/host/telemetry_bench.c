@@ -0,0 +1,229 @@
+// *****************************************************************************
+// Telemetry compression benchmark
+//
+// Streams synthetic light/PIR traces through the raw and compressed telemetry
+// encoders and the sample log codec, checks that everything decodes back to
+// the input and prints bytes per sample and samples per notification, for
+// full frames and for frames sent at the firmware's default latency bound.
+// *****************************************************************************
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "telemetry.h"
+
+#define NUM_SAMPLES (4 * 60 * 60 * 4) // 4 hours of 250 ms samples
+#define SAMPLE_PERIOD_MS 250
+#define LATENCY_MS 1000 // TELEMETRY_MAX_LATENCY_MS in ney_tack.c
+
+typedef struct
+{
+  const char *name;
+  int noise;       // +- counts of sensor noise
+  int pir_pulses;  // motion events per hour
+} Trace;
+
+static const Trace traces[] = {
+    {"still, no noise", 0, 0},
+    {"indoor, +-1 noise", 1, 20},
+    {"indoor, +-3 noise", 3, 60},
+    {"busy, +-20 noise", 20, 600},
+};
+
+// Default MTU 23 (less the Nordic packet type byte), 185 (iOS) and 247
+// (Android) minus the ATT header
+static const int payload_lens[] = {19, 182, 244};
+
+static Sample samples[NUM_SAMPLES];
+static Sample decoded[NUM_SAMPLES];
+
+static void generate(const Trace *trace, unsigned seed)
+{
+  srand(seed);
+
+  int pir_left = 0;
+  for (int i = 0; i < NUM_SAMPLES; i++)
+  {
+    // Slow daylight curve with the odd cloud
+    double t = (double)i / NUM_SAMPLES;
+    double light = 2000 + 1500 * sin(t * M_PI);
+    if ((i / 2000) % 7 == 3)
+    {
+      light *= 0.6;
+    }
+
+    int noise0 = trace->noise ? rand() % (2 * trace->noise + 1) - trace->noise : 0;
+    int noise1 = trace->noise ? rand() % (2 * trace->noise + 1) - trace->noise : 0;
+
+    if (pir_left == 0 && trace->pir_pulses && rand() % (4 * 60 * 60) < trace->pir_pulses)
+    {
+      pir_left = 4 + rand() % 40; // 1-11 s pulse
+    }
+
+    samples[i].ch0 = (uint16_t)(light + noise0);
+    samples[i].ch1 = (uint16_t)(light * 0.3 + noise1);
+    samples[i].pir = pir_left > 0;
+    if (pir_left > 0)
+    {
+      pir_left--;
+    }
+  }
+}
+
+static int equal(const Sample *a, const Sample *b)
+{
+  return a->ch0 == b->ch0 && a->ch1 == b->ch1 && a->pir == b->pir;
+}
+
+// Streams all samples in frames of at most max_samples, 0 for full frames.
+// Returns the number of frames, or -1 if the decoded samples don't match.
+static int stream(int mode, int payload_len, int max_samples, long *bytes, double *ns_per_sample)
+{
+  TelemetryEncoder enc;
+  TelemetryDecoder dec = {0};
+  uint8_t frame[TELEMETRY_MAX_FRAME_LEN];
+  Sample frame_samples[TELEMETRY_MAX_SAMPLES_PER_FRAME];
+  int frames = 0;
+  int next = 0;
+  int checked = 0;
+  double encode_seconds = 0;
+
+  telemetry_encoder_init(&enc, mode);
+  *bytes = 0;
+
+  while (next < NUM_SAMPLES)
+  {
+    clock_t start = clock();
+    int limit = max_samples && NUM_SAMPLES - next > max_samples ? next + max_samples : NUM_SAMPLES;
+    telemetry_frame_begin(&enc, frame, payload_len);
+    while (next < limit && telemetry_frame_put(&enc, &samples[next]))
+    {
+      next++;
+    }
+    int len = telemetry_frame_end(&enc);
+    encode_seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    if (len == 0 || len > payload_len)
+    {
+      return -1;
+    }
+
+    int count = telemetry_frame_decode(&dec, frame, len, frame_samples, TELEMETRY_MAX_SAMPLES_PER_FRAME);
+    if (count < 0)
+    {
+      return -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+      decoded[checked++] = frame_samples[i];
+    }
+
+    *bytes += len;
+    frames++;
+  }
+
+  for (int i = 0; i < NUM_SAMPLES; i++)
+  {
+    if (!equal(&samples[i], &decoded[i]))
+    {
+      return -1;
+    }
+  }
+
+  *ns_per_sample = encode_seconds * 1e9 / NUM_SAMPLES;
+  return frames;
+}
+
+// Encodes all samples with the sample log codec. Returns the number of bytes,
+// or -1 if they don't decode back.
+static long log_codec_bytes()
+{
+  static uint8_t buf[NUM_SAMPLES * 8];
+  SampleEncoder enc;
+  long n = 0;
+
+  sample_encoder_reset(&enc, &samples[0]);
+  for (int i = 1; i < NUM_SAMPLES; i++)
+  {
+    n += sample_encoder_put(&enc, &samples[i], buf + n, sizeof(buf) - n);
+  }
+  n += sample_encoder_flush(&enc, buf + n, sizeof(buf) - n);
+
+  Sample prev = samples[0];
+  int index = 1;
+  long offset = 0;
+  while (offset < n)
+  {
+    uint32_t repeat;
+    int consumed = sample_decode(buf + offset, n - offset, &prev, &repeat);
+    if (consumed == 0)
+    {
+      return -1;
+    }
+    offset += consumed;
+    for (uint32_t i = 0; i < repeat; i++)
+    {
+      if (index >= NUM_SAMPLES || !equal(&prev, &samples[index++]))
+      {
+        return -1;
+      }
+    }
+  }
+
+  return index == NUM_SAMPLES ? n : -1;
+}
+
+int main()
+{
+  int failed = 0;
+
+  printf("%d samples per trace\n\n", NUM_SAMPLES);
+
+  for (unsigned t = 0; t < sizeof(traces) / sizeof(traces[0]); t++)
+  {
+    generate(&traces[t], t + 1);
+    printf("%s\n", traces[t].name);
+
+    for (unsigned p = 0; p < sizeof(payload_lens) / sizeof(payload_lens[0]); p++)
+    {
+      for (int bounded = 0; bounded < 2; bounded++)
+      {
+        int max_samples = bounded ? LATENCY_MS / SAMPLE_PERIOD_MS : 0;
+        long raw_bytes;
+        long compressed_bytes;
+        double raw_ns;
+        double compressed_ns;
+        int raw_frames = stream(TELEMETRY_MODE_RAW, payload_lens[p], max_samples, &raw_bytes, &raw_ns);
+        int compressed_frames =
+            stream(TELEMETRY_MODE_COMPRESSED, payload_lens[p], max_samples, &compressed_bytes, &compressed_ns);
+
+        if (raw_frames < 0 || compressed_frames < 0)
+        {
+          printf("  payload %3d: DECODE MISMATCH\n", payload_lens[p]);
+          failed = 1;
+          continue;
+        }
+
+        printf("  payload %3d %s: raw %5.2f B/sample %5.1f samples/frame | compressed %5.2f B/sample %6.1f samples/frame %5.1f ns/sample | %4.1fx\n",
+               payload_lens[p], bounded ? "at 1 s" : "full  ",
+               (double)raw_bytes / NUM_SAMPLES, (double)NUM_SAMPLES / raw_frames,
+               (double)compressed_bytes / NUM_SAMPLES, (double)NUM_SAMPLES / compressed_frames, compressed_ns,
+               (double)raw_frames / compressed_frames);
+      }
+    }
+
+    long log_bytes = log_codec_bytes();
+    if (log_bytes < 0)
+    {
+      printf("  sample log: DECODE MISMATCH\n");
+      failed = 1;
+    }
+    else
+    {
+      printf("  sample log: %.2f B/sample\n", (double)log_bytes / NUM_SAMPLES);
+    }
+    printf("\n");
+  }
+
+  return failed;
+}
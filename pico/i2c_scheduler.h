@@ -0,0 +1,358 @@
+// *****************************************************************************
+// I2C bus scheduler
+//
+// Samples any number of SensorDevices (sensor_driver.h) on one or more buses.
+// Every device has a period; a sample is released every period and has to be
+// done before the next one is released (its deadline).
+//
+// Each call to i2c_scheduler_run() executes at most one transaction per bus:
+// of the devices on that bus that have work due, the one with the earliest
+// deadline goes first, priority breaks ties. Because a device never holds the
+// bus for a whole sample (start and read are separate transactions), a due
+// sample waits for at most one transaction of every other device on its bus,
+// so adding sensors doesn't multiply the sample latency.
+//
+// When a device stops responding its bus is recovered (clocked free and
+// re-initialized) and all devices on it are brought up again. Parts that need
+// time after a reset get it as a separate step, nothing here sleeps.
+// *****************************************************************************
+#ifndef I2C_SCHEDULER_H
+#define I2C_SCHEDULER_H
+
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "my_i2c.h"
+#include "sensor_driver.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define I2C_SCHEDULER_MAX_DEVICES 8
+#define I2C_SCHEDULER_MAX_BUSES 2
+
+// Poll again this soon when a device has no measurement ready yet
+#define SENSOR_NOT_READY_RETRY_US 10000
+// Try again this late when a device failed to initialize
+#define SENSOR_INIT_RETRY_US 1000000
+// Recover the bus after this many failed initializations in a row, even if it
+// looks idle. A held SDA line is recovered right away.
+#ifndef SENSOR_INIT_RECOVER_FAILURES
+#define SENSOR_INIT_RECOVER_FAILURES 3
+#endif
+
+#define SENSOR_STATE_INIT 0
+#define SENSOR_STATE_START 1
+#define SENSOR_STATE_READ 2
+#define SENSOR_STATE_SETUP 3 // waiting out the driver's init_delay_us
+
+typedef struct
+{
+  SensorDevice *devices[I2C_SCHEDULER_MAX_DEVICES];
+  int num_devices;
+  I2cBus *buses[I2C_SCHEDULER_MAX_BUSES];
+  int num_buses;
+} I2cScheduler;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static I2cScheduler i2c_scheduler;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+int i2c_scheduler_add(SensorDevice *dev);
+int i2c_scheduler_run(uint64_t now_us);
+uint64_t i2c_scheduler_next_us();
+void i2c_scheduler_data_ready(SensorDevice *dev, uint64_t now_us);
+void i2c_scheduler_clock_changed();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// Registers a device. The bus is set up the first time one of its devices is
+// added, the device itself is initialized by the first i2c_scheduler_run().
+int i2c_scheduler_add(SensorDevice *dev)
+{
+  if (i2c_scheduler.num_devices >= I2C_SCHEDULER_MAX_DEVICES)
+  {
+    return -1;
+  }
+
+  int known_bus = 0;
+  for (int i = 0; i < i2c_scheduler.num_buses; i++)
+  {
+    if (i2c_scheduler.buses[i] == dev->bus)
+    {
+      known_bus = 1;
+    }
+  }
+
+  if (!known_bus)
+  {
+    if (i2c_scheduler.num_buses >= I2C_SCHEDULER_MAX_BUSES)
+    {
+      return -1;
+    }
+    i2c_bus_init(dev->bus);
+    i2c_scheduler.buses[i2c_scheduler.num_buses++] = dev->bus;
+  }
+
+  dev->state = SENSOR_STATE_INIT;
+  dev->initialized = 0;
+  dev->next_us = 0;
+  dev->deadline_us = 0;
+  i2c_scheduler.devices[i2c_scheduler.num_devices++] = dev;
+
+  return 0;
+}
+
+static void i2c_scheduler_recover_bus(I2cBus *bus, uint64_t now_us)
+{
+  i2c_bus_recover(bus->i2c, bus->sda_pin, bus->scl_pin);
+  i2c_bus_init(bus);
+
+  for (int i = 0; i < i2c_scheduler.num_devices; i++)
+  {
+    SensorDevice *dev = i2c_scheduler.devices[i];
+    // Devices that failed to initialize keep their retry time, a bus that
+    // stays stuck is recovered once per SENSOR_INIT_RETRY_US
+    if (dev->bus == bus && dev->state != SENSOR_STATE_INIT)
+    {
+      dev->state = SENSOR_STATE_INIT;
+      dev->next_us = now_us;
+    }
+  }
+
+  i2c_stats_print();
+}
+
+static uint64_t sensor_not_ready_retry_us(SensorDevice *dev)
+{
+  return dev->not_ready_retry_us ? dev->not_ready_retry_us : SENSOR_NOT_READY_RETRY_US;
+}
+
+// Moves on to the next sample once the current one is done
+static void sensor_schedule_next(SensorDevice *dev, uint64_t now_us)
+{
+  dev->release_us += dev->period_us;
+  if (dev->release_us < now_us)
+  {
+    // We fell behind, drop the samples we can't catch up on
+    dev->release_us = now_us;
+  }
+
+  dev->state = SENSOR_STATE_START;
+  dev->next_us = dev->release_us;
+  dev->deadline_us = dev->release_us + dev->period_us;
+}
+
+static void sensor_init_failed(SensorDevice *dev, uint64_t now_us)
+{
+  printf("Failed to initialize %s\n", dev->name);
+  dev->failures++;
+  dev->init_failures++;
+  // A device that is just missing leaves the bus idle, retrying later
+  // covers that. One reset mid-transfer may hold SDA low until the bus is
+  // clocked free.
+  if (gpio_get(dev->bus->sda_pin) && dev->init_failures < SENSOR_INIT_RECOVER_FAILURES)
+  {
+    dev->bus->needs_recovery = 0;
+  }
+  else
+  {
+    dev->bus->needs_recovery = 1;
+    dev->init_failures = 0;
+  }
+  dev->state = SENSOR_STATE_INIT;
+  dev->next_us = now_us + SENSOR_INIT_RETRY_US;
+}
+
+static void sensor_init_done(SensorDevice *dev, uint64_t now_us)
+{
+  dev->init_failures = 0;
+  dev->initialized = 1;
+  dev->release_us = now_us;
+  dev->state = SENSOR_STATE_START;
+  dev->next_us = now_us;
+  dev->deadline_us = now_us + dev->period_us;
+}
+
+static void sensor_run_transaction(SensorDevice *dev, uint64_t now_us)
+{
+  int result;
+  SensorReading reading;
+
+  switch (dev->state)
+  {
+  case SENSOR_STATE_INIT:
+    if (dev->driver->init(dev))
+    {
+      sensor_init_failed(dev, now_us);
+      break;
+    }
+    if (dev->driver->setup)
+    {
+      // Come back when the part is ready instead of blocking the bus
+      dev->state = SENSOR_STATE_SETUP;
+      dev->next_us = now_us + dev->driver->init_delay_us;
+      break;
+    }
+    sensor_init_done(dev, now_us);
+    break;
+
+  case SENSOR_STATE_SETUP:
+    if (dev->driver->setup(dev))
+    {
+      sensor_init_failed(dev, now_us);
+      break;
+    }
+    sensor_init_done(dev, now_us);
+    break;
+
+  case SENSOR_STATE_START:
+    result = dev->driver->start(dev);
+    if (result == 1)
+    {
+      dev->state = SENSOR_STATE_READ;
+      dev->next_us = now_us;
+    }
+    else
+    {
+      if (result < 0)
+      {
+        dev->failures++;
+      }
+      dev->next_us = now_us + sensor_not_ready_retry_us(dev);
+    }
+    break;
+
+  case SENSOR_STATE_READ:
+    result = dev->driver->read(dev, dev->raw);
+    if (result != 0)
+    {
+      if (result < 0)
+      {
+        dev->failures++;
+      }
+      dev->state = SENSOR_STATE_START;
+      dev->next_us = now_us + sensor_not_ready_retry_us(dev);
+      break;
+    }
+
+    reading.time_us = now_us;
+    reading.num_values = 0;
+    dev->driver->decode(dev, dev->raw, &reading);
+
+    dev->readings++;
+    if (now_us > dev->deadline_us)
+    {
+      dev->deadline_misses++;
+    }
+    if (now_us - dev->release_us > dev->max_latency_us)
+    {
+      dev->max_latency_us = now_us - dev->release_us;
+    }
+
+    if (dev->on_reading)
+    {
+      dev->on_reading(dev, &reading);
+    }
+
+    sensor_schedule_next(dev, now_us);
+    break;
+  }
+}
+
+// Runs at most one transaction per bus. Returns the number of transactions run.
+int i2c_scheduler_run(uint64_t now_us)
+{
+  int transactions = 0;
+
+  for (int b = 0; b < i2c_scheduler.num_buses; b++)
+  {
+    I2cBus *bus = i2c_scheduler.buses[b];
+
+    if (bus->needs_recovery)
+    {
+      i2c_scheduler_recover_bus(bus, now_us);
+      transactions++;
+      continue;
+    }
+
+    SensorDevice *next = NULL;
+    for (int i = 0; i < i2c_scheduler.num_devices; i++)
+    {
+      SensorDevice *dev = i2c_scheduler.devices[i];
+
+      if (dev->bus != bus || dev->next_us > now_us)
+      {
+        continue;
+      }
+
+      if (!next ||
+          dev->deadline_us < next->deadline_us ||
+          (dev->deadline_us == next->deadline_us && dev->priority < next->priority))
+      {
+        next = dev;
+      }
+    }
+
+    if (next)
+    {
+      sensor_run_transaction(next, now_us);
+      transactions++;
+    }
+  }
+
+  return transactions;
+}
+
+// Returns when the next transaction is due
+uint64_t i2c_scheduler_next_us()
+{
+  uint64_t next_us = UINT64_MAX;
+
+  for (int i = 0; i < i2c_scheduler.num_devices; i++)
+  {
+    if (i2c_scheduler.devices[i]->next_us < next_us)
+    {
+      next_us = i2c_scheduler.devices[i]->next_us;
+    }
+  }
+
+  for (int b = 0; b < i2c_scheduler.num_buses; b++)
+  {
+    if (i2c_scheduler.buses[b]->needs_recovery)
+    {
+      next_us = 0;
+    }
+  }
+
+  return next_us;
+}
+
+// Call from the device's data ready interrupt (or after waking up on it).
+// Polls the device right away instead of waiting for the next retry.
+void i2c_scheduler_data_ready(SensorDevice *dev, uint64_t now_us)
+{
+  if (dev->state == SENSOR_STATE_START && dev->release_us <= now_us)
+  {
+    dev->next_us = now_us;
+  }
+}
+
+// The i2c clock dividers are derived from clk_sys, call after changing it
+void i2c_scheduler_clock_changed()
+{
+  for (int b = 0; b < i2c_scheduler.num_buses; b++)
+  {
+    i2c_set_baudrate(i2c_scheduler.buses[b]->i2c, i2c_scheduler.buses[b]->baudrate);
+  }
+}
+
+#endif
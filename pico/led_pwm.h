@@ -0,0 +1,167 @@
+// *****************************************************************************
+// PWM LED output with brightness envelopes
+//
+// The LED pin is driven by its PWM slice. Ramps (fade in, fade out, breathing)
+// are played by DMA: it copies a precomputed duty cycle table into the slice's
+// compare register, paced by the wrap of a second, otherwise unused slice.
+// Once started an envelope needs no CPU at all, so it stays smooth no matter
+// what BLE or the sensors are doing.
+//
+// The pacing slice runs off clk_sys, so an envelope started before a clock
+// switch plays at the wrong speed. Pattern playback holds the full clock (see
+// power.h), which keeps that from happening.
+// *****************************************************************************
+#ifndef LED_PWM_H
+#define LED_PWM_H
+
+#include "pico/stdlib.h"
+#include "hardware/clocks.h"
+#include "hardware/dma.h"
+#include "hardware/pwm.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+// 12 bit duty cycle, ~12 kHz at 48 MHz, ~30 kHz at 125 MHz
+#define LED_PWM_WRAP 4095
+
+// Table entries per ramp
+#define LED_PWM_STEPS 256
+
+// Paces the envelope DMA. Its pins (GP14/GP15) are not switched to PWM.
+#ifndef LED_PWM_PACING_SLICE
+#define LED_PWM_PACING_SLICE 7
+#endif
+
+// How a pattern step drives the LED
+#define LED_ENVELOPE_STEP 0     // on for even steps, off for odd ones
+#define LED_ENVELOPE_FADE_IN 1  // off to full over the step
+#define LED_ENVELOPE_FADE_OUT 2 // full to off over the step
+#define LED_ENVELOPE_BREATHE 3  // off to full and back over the step
+#define LED_NUM_ENVELOPES 4
+
+typedef struct
+{
+  uint slice;
+  int dma_channel;
+  // Fade in followed by fade out, so all three envelopes are one range of it
+  uint16_t table[2 * LED_PWM_STEPS];
+} LedPwm;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static LedPwm led_pwm;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void led_pwm_init(uint pin);
+void led_pwm_set_level(uint16_t level);
+void led_pwm_envelope(int envelope, uint32_t duration_ms);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+void led_pwm_init(uint pin)
+{
+  // Quadratic brightness curve, perceived brightness is far from linear
+  for (int i = 0; i < LED_PWM_STEPS; i++)
+  {
+    uint32_t level = (uint32_t)LED_PWM_WRAP * i * i / ((LED_PWM_STEPS - 1) * (LED_PWM_STEPS - 1));
+    led_pwm.table[i] = level;
+    led_pwm.table[2 * LED_PWM_STEPS - 1 - i] = level;
+  }
+
+  gpio_set_function(pin, GPIO_FUNC_PWM);
+  led_pwm.slice = pwm_gpio_to_slice_num(pin);
+
+  pwm_config config = pwm_get_default_config();
+  pwm_config_set_wrap(&config, LED_PWM_WRAP);
+  pwm_init(led_pwm.slice, &config, true);
+
+  pwm_config pacing = pwm_get_default_config();
+  pwm_init(LED_PWM_PACING_SLICE, &pacing, false);
+
+  led_pwm.dma_channel = dma_claim_unused_channel(true);
+
+  led_pwm_set_level(0);
+}
+
+// Stops a running envelope and sets a fixed duty cycle (0..LED_PWM_WRAP)
+void led_pwm_set_level(uint16_t level)
+{
+  dma_channel_abort(led_pwm.dma_channel);
+  pwm_set_enabled(LED_PWM_PACING_SLICE, false);
+
+  // Sets both channels of the slice, like the DMA does, only the LED pin is
+  // switched to PWM
+  pwm_set_both_levels(led_pwm.slice, level, level);
+}
+
+// Plays one of the LED_ENVELOPE_* ramps over duration_ms, the last level
+// stays on once it is done
+void led_pwm_envelope(int envelope, uint32_t duration_ms)
+{
+  const uint16_t *from;
+  uint count;
+
+  switch (envelope)
+  {
+  case LED_ENVELOPE_FADE_IN:
+    from = led_pwm.table;
+    count = LED_PWM_STEPS;
+    break;
+  case LED_ENVELOPE_FADE_OUT:
+    from = led_pwm.table + LED_PWM_STEPS;
+    count = LED_PWM_STEPS;
+    break;
+  case LED_ENVELOPE_BREATHE:
+    from = led_pwm.table;
+    count = 2 * LED_PWM_STEPS;
+    break;
+  default:
+    return;
+  }
+
+  led_pwm_set_level(from[0]);
+
+  // One table entry per pacing slice wrap. The 8 bit integer divider covers
+  // up to ~0.35 s per entry at 48 MHz, a ~90 s ramp.
+  uint64_t cycles = (uint64_t)clock_get_hz(clk_sys) * duration_ms / 1000 / count;
+  uint32_t div = cycles / 65536 + 1;
+  if (div > 255)
+  {
+    div = 255;
+  }
+  uint32_t wrap = cycles / div;
+  if (wrap > 65536)
+  {
+    wrap = 65536;
+  }
+  if (wrap < 1)
+  {
+    wrap = 1;
+  }
+
+  pwm_set_clkdiv_int_frac(LED_PWM_PACING_SLICE, div, 0);
+  pwm_set_wrap(LED_PWM_PACING_SLICE, wrap - 1);
+  pwm_set_counter(LED_PWM_PACING_SLICE, 0);
+
+  // 16 bit writes to a peripheral register are replicated to both halves, so
+  // this sets channel A and B of the compare register at once
+  dma_channel_config config = dma_channel_get_default_config(led_pwm.dma_channel);
+  channel_config_set_transfer_data_size(&config, DMA_SIZE_16);
+  channel_config_set_read_increment(&config, true);
+  channel_config_set_write_increment(&config, false);
+  channel_config_set_dreq(&config, pwm_get_dreq(LED_PWM_PACING_SLICE));
+
+  dma_channel_configure(led_pwm.dma_channel, &config, &pwm_hw->slice[led_pwm.slice].cc, from, count, true);
+  pwm_set_enabled(LED_PWM_PACING_SLICE, true);
+}
+
+#endif
@@ -13,14 +13,13 @@
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "my_i2c.h"
+#include "sensor_driver.h"
 #include "hardware/i2c.h"
 
 // *****************************************************************************
 // Definitions
 // *****************************************************************************
 
-#define I2C_PORT i2c1
-
 #define LTR303_I2CADDR_DEFAULT 0x29    // I2C address
 #define LTR303_REG_PART_ID 0x86        // Part id/revision register
 #define LTR303_REG_MANU_ID 0x87        // Manufacturer ID register
@@ -38,85 +37,148 @@
 
 #define LTR_ALS_CTRL_ALS_MODE_ACTIVE 0b00000001
 
+// 100 ms integration, a new measurement every 200 ms, so every 250 ms sample
+// finds fresh data instead of waiting for the 500 ms default
+#define LTR303_MEAS_RATE_100MS_200MS 0b00000010
+
+// INT pin active (low) after every measurement: with the high threshold at 0
+// and the low threshold at 0xFFFF every value is out of range
+#define LTR303_INTERRUPT_ENABLE 0b00000010
+
+#define LTR303_RAW_LEN 4
+
+// Datasheet: wait 10 ms after a software reset
+#define LTR303_RESET_US 10000
+
+// The LTR-329 is the LTR-303 without the interrupt pin, same registers
+#define LTR329_I2CADDR_DEFAULT LTR303_I2CADDR_DEFAULT
+
 // *****************************************************************************
-// Global variables
+// Function declarations
 // *****************************************************************************
 
+int ltr303_i2c_init(SensorDevice *dev);
+int ltr303_i2c_setup(SensorDevice *dev);
+int ltr303_i2c_setup_interrupt(SensorDevice *dev);
+int ltr303_i2c_configure(SensorDevice *dev, int interrupt);
+int ltr303_i2c_reset(SensorDevice *dev);
+int ltr303_i2c_enable(SensorDevice *dev);
+int ltr303_i2c_has_new_data(SensorDevice *dev);
+int ltr303_i2c_read_raw(SensorDevice *dev, uint8_t *raw);
+void ltr303_i2c_decode(SensorDevice *dev, const uint8_t *raw, SensorReading *reading);
+
 // *****************************************************************************
-// Function declarations
+// Global variables
 // *****************************************************************************
 
-int ltr303_i2c_init();
-int ltr303_i2c_reset();
-int ltr303_i2c_enable();
-int ltr303_i2c_has_new_data();
-int ltr303_i2c_read_both_channels(uint16_t *ch0_value, uint16_t *ch1_value);
+const SensorDriver ltr303_driver = {
+    .name = "LTR303",
+    .raw_len = LTR303_RAW_LEN,
+    .init = ltr303_i2c_init,
+    .setup = ltr303_i2c_setup_interrupt,
+    .init_delay_us = LTR303_RESET_US,
+    .start = ltr303_i2c_has_new_data,
+    .read = ltr303_i2c_read_raw,
+    .decode = ltr303_i2c_decode,
+};
+
+const SensorDriver ltr329_driver = {
+    .name = "LTR329",
+    .raw_len = LTR303_RAW_LEN,
+    .init = ltr303_i2c_init,
+    .setup = ltr303_i2c_setup,
+    .init_delay_us = LTR303_RESET_US,
+    .start = ltr303_i2c_has_new_data,
+    .read = ltr303_i2c_read_raw,
+    .decode = ltr303_i2c_decode,
+};
 
 // *****************************************************************************
 // Function definitions
 // *****************************************************************************
 
-int ltr303_i2c_init()
+// Probes the part and resets it. It answers again after LTR303_RESET_US, then
+// ltr303_i2c_setup() takes over.
+int ltr303_i2c_init(SensorDevice *dev)
 {
-  i2c_init(I2C_PORT, 400 * 1000);
-
-  gpio_set_function(26, GPIO_FUNC_I2C);
-  gpio_set_function(27, GPIO_FUNC_I2C);
-  gpio_pull_up(26);
-  gpio_pull_up(27);
-
   // Buffer to store raw reads
   uint8_t data[4];
 
   // Read part ID to make sure we can communicate with the LTR303
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_REG_PART_ID, data, 1);
-
-  if (data[0] != LTR303_DEVICE_ID)
+  if (sensor_reg_read(dev, LTR303_REG_PART_ID, data, 1) || data[0] != LTR303_DEVICE_ID)
   {
     return -1;
   }
 
   // Read manufacturer ID to make sure we can communicate with the LTR303
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_REG_MANU_ID, data, 1);
-
-  if (data[0] != LTR303_MANUFACTURER_ID)
+  if (sensor_reg_read(dev, LTR303_REG_MANU_ID, data, 1) || data[0] != LTR303_MANUFACTURER_ID)
   {
     return -1;
   }
 
   // The data sheet says that the device will initially be in a 'powered down' state.
   // We need to set the device to active mode.
-  if (ltr303_i2c_reset())
+  if (ltr303_i2c_reset(dev))
   {
-    printf("Failed to reset LTR303\n");
+    printf("Failed to reset %s\n", dev->name);
     return -1;
   }
 
-  if (ltr303_i2c_enable())
+  return 0;
+}
+
+static int ltr303_i2c_setup_common(SensorDevice *dev, int interrupt)
+{
+  uint8_t data[1];
+
+  // The reset clears the control register once it is done
+  if (sensor_reg_read(dev, LTR303_ALS_CTRL, data, 1) || data[0] != 0x00)
   {
-    printf("Failed to enable LTR303\n");
+    printf("Failed to reset %s\n", dev->name);
+    return -1;
+  }
+
+  // Has to happen in standby, before the device is enabled
+  if (ltr303_i2c_configure(dev, interrupt))
+  {
+    printf("Failed to configure %s\n", dev->name);
+    return -1;
+  }
+
+  if (ltr303_i2c_enable(dev))
+  {
+    printf("Failed to enable %s\n", dev->name);
     return -1;
   }
 
   return 0;
 }
 
-int ltr303_i2c_reset()
+int ltr303_i2c_setup(SensorDevice *dev)
 {
-  uint8_t data[1];
-
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_ALS_CTRL, data, 1);
+  return ltr303_i2c_setup_common(dev, 0);
+}
 
-  data[0] |= (1 << 1); // reset
+// Also drives the INT pin low after every measurement, so the MCU can sleep
+// until data is ready. Only the LTR303 has the pin.
+int ltr303_i2c_setup_interrupt(SensorDevice *dev)
+{
+  return ltr303_i2c_setup_common(dev, 1);
+}
 
-  reg_write(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_ALS_CTRL, &data[0], 1);
+int ltr303_i2c_reset(SensorDevice *dev)
+{
+  uint8_t data[1];
 
-  // datasheet tells us to sleep for 10ms after reset
-  sleep_ms(10);
+  if (sensor_reg_read(dev, LTR303_ALS_CTRL, data, 1))
+  {
+    return -1;
+  }
 
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_ALS_CTRL, data, 1);
+  data[0] |= (1 << 1); // reset
 
-  if (data[0] != 0x00)
+  // The part needs LTR303_RESET_US before it can be talked to again
+  if (sensor_reg_write(dev, LTR303_ALS_CTRL, &data[0], 1))
   {
     return -1;
   }
@@ -124,19 +186,23 @@ int ltr303_i2c_reset()
   return 0;
 }
 
-int ltr303_i2c_enable()
+int ltr303_i2c_enable(SensorDevice *dev)
 {
   uint8_t data[1];
 
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_ALS_CTRL, data, 1);
+  if (sensor_reg_read(dev, LTR303_ALS_CTRL, data, 1))
+  {
+    return -1;
+  }
 
   data[0] |= (1 << 0); // active mode
 
-  reg_write(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_ALS_CTRL, &data[0], 1);
-
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_ALS_CTRL, data, 1);
+  if (sensor_reg_write(dev, LTR303_ALS_CTRL, &data[0], 1))
+  {
+    return -1;
+  }
 
-  if (!(data[0] & LTR_ALS_CTRL_ALS_MODE_ACTIVE))
+  if (sensor_reg_read(dev, LTR303_ALS_CTRL, data, 1) || !(data[0] & LTR_ALS_CTRL_ALS_MODE_ACTIVE))
   {
     return -1;
   }
@@ -144,32 +210,60 @@ int ltr303_i2c_enable()
   return 0;
 }
 
-// ch0 is Visible + IR
-// ch1 is IR only
-// get visible by subtracting ch1 from ch0
-int ltr303_i2c_read_both_channels(uint16_t *ch0_value, uint16_t *ch1_value)
+int ltr303_i2c_configure(SensorDevice *dev, int interrupt)
 {
-  uint8_t data[4];
+  uint8_t data[2];
 
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_CH1DATA, data, 4);
-  *ch1_value = (data[1] << 8) | data[0];
-  *ch0_value = (data[3] << 8) | data[2];
+  data[0] = LTR303_MEAS_RATE_100MS_200MS;
+  if (sensor_reg_write(dev, LTR303_MEAS_RATE, data, 1))
+  {
+    return -1;
+  }
 
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_STATUS, data, 1);
+  if (!interrupt)
+  {
+    return 0;
+  }
 
-  if (data[0] & 0x80)
+  data[0] = 0x00;
+  data[1] = 0x00;
+  if (sensor_reg_write(dev, LTR303_REG_THRESHHIGH_LSB, data, 2))
   {
-    return 1;
+    return -1;
+  }
+
+  data[0] = 0xFF;
+  data[1] = 0xFF;
+  if (sensor_reg_write(dev, LTR303_REG_THRESHLOW_LSB, data, 2))
+  {
+    return -1;
+  }
+
+  // Interrupt after every out of range measurement
+  data[0] = 0x00;
+  if (sensor_reg_write(dev, LTR303_REG_INTPERSIST, data, 1))
+  {
+    return -1;
+  }
+
+  data[0] = LTR303_INTERRUPT_ENABLE;
+  if (sensor_reg_write(dev, LTR303_REG_INTERRUPT, data, 1))
+  {
+    return -1;
   }
 
   return 0;
 }
 
-int ltr303_i2c_has_new_data()
+// Reading the status also clears a pending interrupt
+int ltr303_i2c_has_new_data(SensorDevice *dev)
 {
   uint8_t data[1];
 
-  reg_read(I2C_PORT, LTR303_I2CADDR_DEFAULT, LTR303_STATUS, data, 1);
+  if (sensor_reg_read(dev, LTR303_STATUS, data, 1))
+  {
+    return -1;
+  }
 
   if (data[0] & 0x04)
   {
@@ -179,4 +273,40 @@ int ltr303_i2c_has_new_data()
   return 0;
 }
 
+// Reads both channels. Returns 1 if the status register flags the data as
+// invalid.
+int ltr303_i2c_read_raw(SensorDevice *dev, uint8_t *raw)
+{
+  uint8_t status[1];
+
+  if (sensor_reg_read(dev, LTR303_CH1DATA, raw, LTR303_RAW_LEN))
+  {
+    return -1;
+  }
+
+  if (sensor_reg_read(dev, LTR303_STATUS, status, 1))
+  {
+    return -1;
+  }
+
+  if (status[0] & 0x80)
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+// values[0] is ch0, Visible + IR
+// values[1] is ch1, IR only
+// get visible by subtracting ch1 from ch0
+void ltr303_i2c_decode(SensorDevice *dev, const uint8_t *raw, SensorReading *reading)
+{
+  (void)dev;
+
+  reading->values[1] = (raw[1] << 8) | raw[0];
+  reading->values[0] = (raw[3] << 8) | raw[2];
+  reading->num_values = 2;
+}
+
 #endif
@@ -0,0 +1,183 @@
+// *****************************************************************************
+// Memory budget
+//
+// With MEMORY_BUDGET set, the free part of the core 0 stack is painted at
+// boot and memory_budget_stack_peak() finds how deep it has been used since.
+// Together with the static RAM each subsystem takes (memory_budget_set()),
+// the size of .data/.bss and the heap in use, this shows what a change costs
+// and how much room is left for the RAM rings (TRACE_BUFFER_SIZE,
+// TELEMETRY_QUEUE_SIZE).
+//
+// Without MEMORY_BUDGET nothing is painted and the report is left out.
+// *****************************************************************************
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdio.h>
+#include "pico/stdlib.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#ifndef MEMORY_BUDGET
+#define MEMORY_BUDGET 0
+#endif
+
+#define MEMORY_STACK_PAINT 0x57ac57acu
+
+// Words below the painting function's frame that are left alone, for the
+// calls it makes itself
+#define MEMORY_STACK_PAINT_MARGIN_WORDS 32
+
+#define MEMORY_SUBSYSTEM_SPP 0       // connection context, notification buffer
+#define MEMORY_SUBSYSTEM_TELEMETRY 1 // sample queue, encoder
+#define MEMORY_SUBSYSTEM_SAMPLE_LOG 2
+#define MEMORY_SUBSYSTEM_TRACE 3
+#define MEMORY_SUBSYSTEM_OTA 4
+#define MEMORY_SUBSYSTEM_GATT 5 // ney_tack_service
+#define MEMORY_SUBSYSTEM_SENSORS 6
+#define MEMORY_SUBSYSTEM_LED 7
+#define MEMORY_SUBSYSTEM_POWER 8
+#define MEMORY_NUM_SUBSYSTEMS 9
+
+typedef struct
+{
+  uint32_t subsystem_bytes[MEMORY_NUM_SUBSYSTEMS];
+} MemoryBudget;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static MemoryBudget memory_budget;
+
+#if MEMORY_BUDGET
+static const char *memory_subsystem_names[MEMORY_NUM_SUBSYSTEMS] = {
+    "spp",
+    "telemetry",
+    "sample log",
+    "trace",
+    "ota",
+    "gatt",
+    "sensors",
+    "led",
+    "power",
+};
+
+// From the linker script. Core 0 runs on the stack in SCRATCH_Y.
+extern char __StackBottom, __StackTop;
+extern char __data_start__, __data_end__, __bss_start__, __bss_end__;
+extern char __end__, __HeapLimit;
+#endif
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void memory_budget_paint_stack();
+void memory_budget_set(int subsystem, uint32_t bytes);
+uint32_t memory_budget_stack_size();
+uint32_t memory_budget_stack_peak();
+uint32_t memory_budget_static_bytes();
+uint32_t memory_budget_heap_bytes();
+uint32_t memory_budget_free_bytes();
+void memory_budget_print();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// Call first thing in main(), the stack is shallowest there
+void __attribute__((noinline)) memory_budget_paint_stack()
+{
+#if MEMORY_BUDGET
+  uint32_t here;
+  uint32_t *word = (uint32_t *)&__StackBottom;
+  uint32_t *end = &here - MEMORY_STACK_PAINT_MARGIN_WORDS;
+
+  while (word < end)
+  {
+    *word++ = MEMORY_STACK_PAINT;
+  }
+#endif
+}
+
+void memory_budget_set(int subsystem, uint32_t bytes)
+{
+  memory_budget.subsystem_bytes[subsystem] = bytes;
+}
+
+uint32_t memory_budget_stack_size()
+{
+#if MEMORY_BUDGET
+  return (uint32_t)(&__StackTop - &__StackBottom);
+#else
+  return 0;
+#endif
+}
+
+// Deepest the stack has been since memory_budget_paint_stack(), the first
+// word that lost its paint counting from the bottom
+uint32_t memory_budget_stack_peak()
+{
+#if MEMORY_BUDGET
+  const uint32_t *word = (const uint32_t *)&__StackBottom;
+  const uint32_t *top = (const uint32_t *)&__StackTop;
+
+  while (word < top && *word == MEMORY_STACK_PAINT)
+  {
+    word++;
+  }
+  return (uint32_t)((const char *)top - (const char *)word);
+#else
+  return 0;
+#endif
+}
+
+// .data and .bss, every static and global variable
+uint32_t memory_budget_static_bytes()
+{
+#if MEMORY_BUDGET
+  return (uint32_t)((&__data_end__ - &__data_start__) + (&__bss_end__ - &__bss_start__));
+#else
+  return 0;
+#endif
+}
+
+uint32_t memory_budget_heap_bytes()
+{
+#if MEMORY_BUDGET
+  return (uint32_t)mallinfo().uordblks;
+#else
+  return 0;
+#endif
+}
+
+// RAM that neither the statics nor the heap have claimed
+uint32_t memory_budget_free_bytes()
+{
+#if MEMORY_BUDGET
+  struct mallinfo info = mallinfo();
+  return (uint32_t)(&__HeapLimit - &__end__) - (uint32_t)info.arena + (uint32_t)info.fordblks;
+#else
+  return 0;
+#endif
+}
+
+void memory_budget_print()
+{
+#if MEMORY_BUDGET
+  printf("Memory: stack %" PRIu32 " of %" PRIu32 " bytes, static %" PRIu32 ", heap %" PRIu32 ", free %" PRIu32 "\n",
+         memory_budget_stack_peak(), memory_budget_stack_size(), memory_budget_static_bytes(),
+         memory_budget_heap_bytes(), memory_budget_free_bytes());
+  for (int i = 0; i < MEMORY_NUM_SUBSYSTEMS; i++)
+  {
+    printf("  %-10s %6" PRIu32 " bytes\n", memory_subsystem_names[i], memory_budget.subsystem_bytes[i]);
+  }
+#endif
+}
+
+#endif
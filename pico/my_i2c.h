@@ -1,10 +1,143 @@
 #ifndef MY_I2C_H
 #define MY_I2C_H
 
+#include <inttypes.h>
 #include <stdio.h>
 #include "pico/stdlib.h"
 #include "hardware/i2c.h"
 
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+// Deadline for a single i2c transfer. With the blocking SDK calls a glitch on
+// the bus can hang the whole firmware (BLE included) forever, with a deadline
+// the transfer fails instead and the caller can retry or recover the bus.
+// Set to 0 to use the blocking calls.
+#ifndef I2C_TIMEOUT_US
+#define I2C_TIMEOUT_US 1000
+#endif
+
+// Longest register write, the register address comes on top. The message is
+// built on the stack, a fixed size keeps the stack use known.
+#define I2C_MAX_WRITE_LEN 8
+
+// Half period of the clock pulses used to free a stuck bus (100 kHz)
+#define I2C_RECOVER_HALF_PERIOD_US 5
+#define I2C_RECOVER_CLOCKS 9
+
+// An i2c block and the pins it is routed to. Several devices can share a bus.
+typedef struct
+{
+  i2c_inst_t *i2c;
+  uint sda_pin;
+  uint scl_pin;
+  uint baudrate;
+  int needs_recovery; // set when a device stopped responding
+} I2cBus;
+
+typedef struct
+{
+  uint32_t transfers;      // write or read transfers started
+  uint32_t timeouts;       // transfers that hit I2C_TIMEOUT_US
+  uint32_t errors;         // transfers that failed otherwise (NAK, ...)
+  uint32_t retries;        // transactions repeated after a failure
+  uint32_t recoveries;     // bus recoveries
+  uint32_t max_latency_us; // slowest register read/write seen
+} I2cStats;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+I2cStats i2c_stats;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void i2c_bus_init(I2cBus *bus);
+int reg_write(i2c_inst_t *i2c, const uint addr, const uint8_t reg, uint8_t *buf, const uint8_t nbytes);
+int reg_read(i2c_inst_t *i2c, const uint addr, const uint8_t reg, uint8_t *buf, const uint8_t nbytes);
+void i2c_bus_recover(i2c_inst_t *i2c, uint sda_pin, uint scl_pin);
+void i2c_stats_print();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+void i2c_bus_init(I2cBus *bus)
+{
+  i2c_init(bus->i2c, bus->baudrate);
+
+  gpio_set_function(bus->sda_pin, GPIO_FUNC_I2C);
+  gpio_set_function(bus->scl_pin, GPIO_FUNC_I2C);
+  gpio_pull_up(bus->sda_pin);
+  gpio_pull_up(bus->scl_pin);
+
+  bus->needs_recovery = 0;
+}
+
+static int i2c_write_checked(i2c_inst_t *i2c, const uint addr, const uint8_t *src, size_t len, bool nostop)
+{
+  int result;
+
+  i2c_stats.transfers++;
+
+#if I2C_TIMEOUT_US > 0
+  result = i2c_write_timeout_us(i2c, addr, src, len, nostop, I2C_TIMEOUT_US);
+#else
+  result = i2c_write_blocking(i2c, addr, src, len, nostop);
+#endif
+
+  if (result == PICO_ERROR_TIMEOUT)
+  {
+    i2c_stats.timeouts++;
+  }
+  else if (result < 0)
+  {
+    i2c_stats.errors++;
+  }
+
+  return result;
+}
+
+static int i2c_read_checked(i2c_inst_t *i2c, const uint addr, uint8_t *dst, size_t len, bool nostop)
+{
+  int result;
+
+  i2c_stats.transfers++;
+
+#if I2C_TIMEOUT_US > 0
+  result = i2c_read_timeout_us(i2c, addr, dst, len, nostop, I2C_TIMEOUT_US);
+#else
+  result = i2c_read_blocking(i2c, addr, dst, len, nostop);
+#endif
+
+  if (result == PICO_ERROR_TIMEOUT)
+  {
+    i2c_stats.timeouts++;
+  }
+  else if (result < 0)
+  {
+    i2c_stats.errors++;
+  }
+
+  return result;
+}
+
+static void i2c_track_latency(uint32_t start_us)
+{
+  uint32_t latency_us = time_us_32() - start_us;
+
+  if (latency_us > i2c_stats.max_latency_us)
+  {
+    i2c_stats.max_latency_us = latency_us;
+  }
+}
+
+// Returns the number of bytes written, or a negative PICO_ERROR_* code. At
+// most I2C_MAX_WRITE_LEN bytes.
 int reg_write(
     i2c_inst_t *i2c,
     const uint addr,
@@ -12,12 +145,12 @@ int reg_write(
     uint8_t *buf,
     const uint8_t nbytes)
 {
-  int num_bytes_read = 0;
+  int result;
 
-  // Q: why is the length of msg `nbytes + 1`?
+  // Q: why does msg have room for `I2C_MAX_WRITE_LEN + 1` bytes?
   // A: because we need to start with the register address and
   //    then append the data to write to the register
-  uint8_t msg[nbytes + 1];
+  uint8_t msg[I2C_MAX_WRITE_LEN + 1];
 
   if (nbytes < 1)
   {
@@ -26,6 +159,10 @@ int reg_write(
     // We return 0 to indicate that no bytes were written.
     return 0;
   }
+  if (nbytes > I2C_MAX_WRITE_LEN)
+  {
+    return PICO_ERROR_GENERIC;
+  }
 
   // append register address to front of data packet
   msg[0] = reg;
@@ -34,13 +171,23 @@ int reg_write(
     msg[i + 1] = buf[i];
   }
 
+  uint32_t start_us = time_us_32();
+
   // Q: can we write to more than one register?
   // write data to register(s) over i2c
-  i2c_write_blocking(i2c, addr, msg, nbytes + 1, false);
+  result = i2c_write_checked(i2c, addr, msg, nbytes + 1, false);
 
-  return num_bytes_read;
+  i2c_track_latency(start_us);
+
+  if (result < 0)
+  {
+    return result;
+  }
+
+  return result - 1;
 }
 
+// Returns the number of bytes read, or a negative PICO_ERROR_* code
 int reg_read(
     i2c_inst_t *i2c,
     const uint addr,
@@ -59,12 +206,66 @@ int reg_read(
 
   // Q: can we read more than one register?
 
+  uint32_t start_us = time_us_32();
+
   // prepping the device to read from a register
-  i2c_write_blocking(i2c, addr, &reg, 1, true);
+  int result = i2c_write_checked(i2c, addr, &reg, 1, true);
+  if (result < 0)
+  {
+    i2c_track_latency(start_us);
+    return result;
+  }
+
   // Read data from register over i2c
-  num_bytes_read = i2c_read_blocking(i2c, addr, buf, nbytes, false);
+  num_bytes_read = i2c_read_checked(i2c, addr, buf, nbytes, false);
+
+  i2c_track_latency(start_us);
 
   return num_bytes_read;
 }
 
+// Frees a bus where a slave holds SDA low, e.g. because we were reset in the
+// middle of a read. We take the pins over and clock SCL until the slave lets
+// go of SDA, then send a STOP. The caller has to i2c_bus_init() the bus again
+// and re-initialize its devices afterwards.
+void i2c_bus_recover(i2c_inst_t *i2c, uint sda_pin, uint scl_pin)
+{
+  i2c_stats.recoveries++;
+
+  i2c_deinit(i2c);
+
+  gpio_init(sda_pin);
+  gpio_init(scl_pin);
+  gpio_pull_up(sda_pin);
+  gpio_pull_up(scl_pin);
+
+  // Open drain: only ever drive low, let the pull-ups pull high
+  gpio_set_dir(sda_pin, GPIO_IN);
+  gpio_put(scl_pin, 0);
+  gpio_set_dir(scl_pin, GPIO_IN);
+
+  for (int i = 0; i < I2C_RECOVER_CLOCKS && !gpio_get(sda_pin); i++)
+  {
+    gpio_set_dir(scl_pin, GPIO_OUT);
+    busy_wait_us_32(I2C_RECOVER_HALF_PERIOD_US);
+    gpio_set_dir(scl_pin, GPIO_IN);
+    busy_wait_us_32(I2C_RECOVER_HALF_PERIOD_US);
+  }
+
+  // STOP: SDA low to high while SCL is high
+  gpio_put(sda_pin, 0);
+  gpio_set_dir(sda_pin, GPIO_OUT);
+  busy_wait_us_32(I2C_RECOVER_HALF_PERIOD_US);
+  gpio_set_dir(sda_pin, GPIO_IN);
+  busy_wait_us_32(I2C_RECOVER_HALF_PERIOD_US);
+
+  printf("I2C bus recovered, SDA %s\n", gpio_get(sda_pin) ? "released" : "still stuck");
+}
+
+void i2c_stats_print()
+{
+  printf("I2C: %" PRIu32 " transfers, %" PRIu32 " timeouts, %" PRIu32 " errors, %" PRIu32 " retries, %" PRIu32 " recoveries, max %" PRIu32 " us\n",
+         i2c_stats.transfers, i2c_stats.timeouts, i2c_stats.errors, i2c_stats.retries, i2c_stats.recoveries, i2c_stats.max_latency_us);
+}
+
 #endif
\ No newline at end of file
@@ -7,6 +7,21 @@
 #include "mygatt.h"
 #include "ble/gatt-service/nordic_spp_service_server.h"
 #include "ltr303_i2c.h"
+#include "i2c_scheduler.h"
+#include "sample_log.h"
+#include "telemetry.h"
+#include "protocol.h"
+#include "power.h"
+#include "boot_profile.h"
+#include "sync_clock.h"
+#include "led_pwm.h"
+#include "ney_tack_service.h"
+#include "trace.h"
+#include "ota.h"
+#include "memory_budget.h"
+#include "task_scheduler.h"
+#include "pir.h"
+#include "reconnect.h"
 
 #ifndef EXIT_SUCCESS
 #define EXIT_SUCCESS 0
@@ -18,9 +33,89 @@
 #define REPORT_INTERVAL_MS 3000
 #define STATE_CHECK_INTERVAL_MS 300
 
+// Connection interval while streaming the sample log or syncing the time
+// (units of 1.25 ms) and the interval to go back to when done (500 ms)
+#define LOG_DOWNLOAD_CONN_INTERVAL_MIN 6
+#define LOG_DOWNLOAD_CONN_INTERVAL_MAX 12
+#define IDLE_CONN_INTERVAL 400
+
+// The phone's own (short) connection interval is kept this long after
+// connecting, for its service discovery and subscriptions
+#define CONN_IDLE_DELAY_MS 3000
+
+// Samples waiting to be streamed. A frame goes out once the queued samples
+// fill one, or once the oldest has waited TELEMETRY_MAX_LATENCY_MS, which
+// keeps the stream live at about 4 samples per notification. A client that
+// would rather have fewer, fuller notifications raises the bound with
+// CMD_STREAM_MODE, up to TELEMETRY_LATENCY_LIMIT_MS.
+#ifndef TELEMETRY_QUEUE_SIZE
+#define TELEMETRY_QUEUE_SIZE 256
+#endif
+#ifndef TELEMETRY_MAX_LATENCY_MS
+#define TELEMETRY_MAX_LATENCY_MS 1000
+#endif
+#define TELEMETRY_LATENCY_LIMIT_MS 60000
+
+#define SENSOR_PERIOD_MS 250
+
+// LTR303 INT output (open drain, active low). The sensor wakes us when a
+// measurement is ready, polling is only the fallback.
+#define LTR303_INT_PIN 28
+#define LTR303_INT_RETRY_US 100000
+
+#define POWER_REPORT_INTERVAL_MS 60000
+
+// PIR sensor output, high while motion is seen
+#define PIR_PIN 22
+
+// A second LTR303/LTR329 on i2c0 (GP4/GP5). The LTR303 address is fixed, so
+// two of them need separate buses.
+#ifndef SECOND_LIGHT_SENSOR
+#define SECOND_LIGHT_SENSOR 0
+#endif
+
+// BTstack TLV tags the pattern state and the config are persisted under
+#define STATE_TLV_TAG (('N' << 24) | ('T' << 16) | ('S' << 8) | 'T')
+#define CONFIG_TLV_TAG (('N' << 24) | ('T' << 16) | ('C' << 8) | 'F')
+
+// How often the metrics characteristic is refreshed
+#define METRICS_INTERVAL_MS 5000
+
+// Bounds for NeyTackConfig.sensor_period_ms
+#define CONFIG_SENSOR_PERIOD_MIN_MS 50
+#define CONFIG_SENSOR_PERIOD_MAX_MS 60000
+
+// Drive LED_PIN with PWM, which lets patterns use brightness envelopes. 0 for
+// a plain GPIO, envelope steps then just switch the LED on.
+#ifndef LED_OUTPUT_PWM
+#define LED_OUTPUT_PWM 1
+#endif
+
+// Largest notification payload our ACL buffers allow (ATT MTU - 3). Every
+// SPP frame and the state characteristic value are built in one buffer of
+// this size, see notify_buffer.
+#define NOTIFY_BUFFER_SIZE (HCI_ACL_PAYLOAD_SIZE - L2CAP_HEADER_SIZE - 3)
+
 #define FLASHER_STATE_OFF 0
 #define FLASHER_STATE_ON 1
 
+// Task priorities, when several are due the pattern goes first: a late LED
+// step is visible, a late report is not
+#define TASK_PRIORITY_FLASHER 4
+#define TASK_PRIORITY_PIR 3
+#define TASK_PRIORITY_SENSOR 2
+#define TASK_PRIORITY_OTA 1
+#define TASK_PRIORITY_PERIODIC 0
+
+// Longest a run of each task should take. The sensor task prints every
+// reading, the OTA task may erase a 64 KB block and the report prints a page.
+#define TASK_BUDGET_FLASHER_US 2000
+#define TASK_BUDGET_PIR_US 500
+#define TASK_BUDGET_SENSOR_US 10000
+#define TASK_BUDGET_OTA_US 400000
+#define TASK_BUDGET_PERIODIC_US 2000
+#define TASK_BUDGET_REPORT_US 200000
+
 // *****************************************************************************
 // Type Definitions
 // *****************************************************************************
@@ -31,11 +126,25 @@ typedef struct
   int le_notification_enabled;
   hci_con_handle_t connection_handle;
   int counter;
-  char test_data[200];
   int test_data_len;
   uint32_t test_data_sent;
   uint32_t test_data_start;
   btstack_context_callback_registration_t send_request;
+  int max_payload_len;
+  int log_download_active;
+  uint32_t log_download_offset;
+  int trace_download_active;
+  uint32_t trace_download_offset;
+  int power_stats_requested;
+  int boot_profile_requested;
+  int memory_report_requested;
+  uint8_t motion_edges; // PIR edges since the last motion frame
+  uint8_t motion_level;
+  uint32_t motion_time_us;
+  int time_sync_active;
+  int time_pong_pending;
+  uint32_t time_ping_phone_ms;
+  uint32_t time_ping_local_us;
 } nordic_spp_le_streamer_connection_t;
 
 typedef struct
@@ -44,8 +153,18 @@ typedef struct
   uint8_t flash_index;
   uint8_t pattern_length;
   uint16_t pattern[16];
+  uint8_t envelope[16]; // LED_ENVELOPE_* per pattern step
 } State;
 
+// Value of the config characteristic: version u8, sensor_period_ms u16
+#define CONFIG_VERSION 1
+#define CONFIG_LEN 3
+
+typedef struct
+{
+  uint16_t sensor_period_ms;
+} Config;
+
 // *****************************************************************************
 // Global Variables
 // *****************************************************************************
@@ -56,15 +175,122 @@ State STATE = {
     .pattern = {1000, 1000, 250, 250},
 };
 
-uint8_t serialized_state[sizeof(STATE)];
-int serialized_state_len = 0;
+Config CONFIG = {
+    .sensor_period_ms = SENSOR_PERIOD_MS,
+};
+
+// Frames are built and sent (or the value copied) in one go, so one
+// connection and the GATT service can share a single buffer
+static uint8_t notify_buffer[NOTIFY_BUFFER_SIZE];
+
+static void light_sensor_reading(SensorDevice *dev, const SensorReading *reading);
+
+static I2cBus sensor_bus = {
+    .i2c = i2c1,
+    .sda_pin = 26,
+    .scl_pin = 27,
+    .baudrate = 400 * 1000,
+};
+
+static SensorDevice light_sensor = {
+    .name = "LTR303",
+    .driver = &ltr303_driver,
+    .bus = &sensor_bus,
+    .addr = LTR303_I2CADDR_DEFAULT,
+    .period_us = SENSOR_PERIOD_MS * 1000,
+    .priority = 0,
+    .not_ready_retry_us = LTR303_INT_RETRY_US,
+    .on_reading = light_sensor_reading,
+};
+
+#if SECOND_LIGHT_SENSOR
+static I2cBus sensor_bus_2 = {
+    .i2c = i2c0,
+    .sda_pin = 4,
+    .scl_pin = 5,
+    .baudrate = 400 * 1000,
+};
+
+static SensorDevice light_sensor_2 = {
+    .name = "LTR329",
+    .driver = &ltr329_driver,
+    .bus = &sensor_bus_2,
+    .addr = LTR329_I2CADDR_DEFAULT,
+    .period_us = SENSOR_PERIOD_MS * 1000,
+    .priority = 1,
+    .on_reading = light_sensor_reading,
+};
+#endif
+
+static TelemetryEncoder telemetry_encoder;
+static TelemetryEncoder telemetry_sizer; // the frame the queue would make
+static int telemetry_frame_full = 0;
+static Sample telemetry_queue[TELEMETRY_QUEUE_SIZE];
+static uint32_t telemetry_queue_ms[TELEMETRY_QUEUE_SIZE]; // queued at
+static int telemetry_queue_head = 0;
+static int telemetry_queue_count = 0;
+static uint32_t telemetry_latency_ms = TELEMETRY_MAX_LATENCY_MS;
 
 int led_state = 0;
 int flasher_state = 0;
 const uint LED_PIN = 21;
 
-static btstack_timer_source_t state_check_timer;
-static btstack_timer_source_t flasher_timer;
+static uint64_t flasher_task_run(uint64_t now_us, int signalled);
+static uint64_t pir_task_run(uint64_t now_us, int signalled);
+static uint64_t sensor_task_run(uint64_t now_us, int signalled);
+static uint64_t ota_task_run(uint64_t now_us, int signalled);
+static uint64_t state_check_task_run(uint64_t now_us, int signalled);
+static uint64_t metrics_task_run(uint64_t now_us, int signalled);
+static uint64_t report_task_run(uint64_t now_us, int signalled);
+
+static Task flasher_task = {
+    .name = "flasher",
+    .priority = TASK_PRIORITY_FLASHER,
+    .budget_us = TASK_BUDGET_FLASHER_US,
+    .run = flasher_task_run,
+};
+
+static Task pir_task = {
+    .name = "pir",
+    .priority = TASK_PRIORITY_PIR,
+    .budget_us = TASK_BUDGET_PIR_US,
+    .run = pir_task_run,
+};
+
+static Task sensor_task = {
+    .name = "sensor",
+    .priority = TASK_PRIORITY_SENSOR,
+    .budget_us = TASK_BUDGET_SENSOR_US,
+    .run = sensor_task_run,
+};
+
+static Task ota_task = {
+    .name = "ota",
+    .priority = TASK_PRIORITY_OTA,
+    .budget_us = TASK_BUDGET_OTA_US,
+    .run = ota_task_run,
+};
+
+static Task state_check_task = {
+    .name = "state",
+    .priority = TASK_PRIORITY_PERIODIC,
+    .budget_us = TASK_BUDGET_PERIODIC_US,
+    .run = state_check_task_run,
+};
+
+static Task metrics_task = {
+    .name = "metrics",
+    .priority = TASK_PRIORITY_PERIODIC,
+    .budget_us = TASK_BUDGET_PERIODIC_US,
+    .run = metrics_task_run,
+};
+
+static Task report_task = {
+    .name = "report",
+    .priority = TASK_PRIORITY_PERIODIC,
+    .budget_us = TASK_BUDGET_REPORT_US,
+    .run = report_task_run,
+};
 
 const uint8_t adv_data[] = {
     // Flags indicating the device's capabilities (general discoverable mode and BR/EDR not supported)
@@ -106,6 +332,7 @@ const uint8_t adv_data_len = sizeof(adv_data);
 
 static btstack_packet_callback_registration_t hci_event_callback_registration;
 static nordic_spp_le_streamer_connection_t nordic_spp_le_streamer_connection;
+static btstack_timer_source_t conn_idle_timer;
 
 // *****************************************************************************
 // Function Declarations
@@ -113,6 +340,7 @@ static nordic_spp_le_streamer_connection_t nordic_spp_le_streamer_connection;
 
 void led_toggle();
 void led_set(int state);
+void led_envelope(int envelope, uint32_t duration_ms);
 
 static void nordic_spp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
 static void att_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size);
@@ -122,12 +350,41 @@ static void init_connection();
 static nordic_spp_le_streamer_connection_t *connection_for_conn_handle(hci_con_handle_t con_handle);
 static void test_reset(nordic_spp_le_streamer_connection_t *context);
 static void test_track_sent(nordic_spp_le_streamer_connection_t *context, int bytes_sent);
-void serialize_state(State state, uint8_t *serialized_data, int *serialized_data_len);
+void serialize_state(const State *state, uint8_t *serialized_data, int *serialized_data_len);
+static void handle_command(nordic_spp_le_streamer_connection_t *context, uint8_t *packet, uint16_t size);
+static void log_download_start(nordic_spp_le_streamer_connection_t *context, uint32_t offset);
+static void log_download_send(nordic_spp_le_streamer_connection_t *context);
+static void trace_download_start(nordic_spp_le_streamer_connection_t *context, uint32_t offset);
+static void trace_download_send(nordic_spp_le_streamer_connection_t *context);
+static void telemetry_queue_push(const Sample *sample);
+static void telemetry_size_frame();
+static int telemetry_ready();
+static int telemetry_send(nordic_spp_le_streamer_connection_t *context);
+static void power_stats_send(nordic_spp_le_streamer_connection_t *context);
+static void boot_profile_send(nordic_spp_le_streamer_connection_t *context);
+static void memory_report_send(nordic_spp_le_streamer_connection_t *context);
+static void motion_send(nordic_spp_le_streamer_connection_t *context);
+static void memory_budget_account();
+static void time_ping_received(nordic_spp_le_streamer_connection_t *context, uint32_t phone_ms);
+static void time_set_received(nordic_spp_le_streamer_connection_t *context, uint32_t local_us, uint32_t shared_ms);
+static void time_pong_send(nordic_spp_le_streamer_connection_t *context);
+static int flash_sync_index(uint32_t *remaining_ms);
+static void set_pattern(const uint8_t *data, uint16_t size);
+static void state_restore();
+static void state_save();
+static void state_publish();
+static void config_restore();
+static void config_apply();
+static void config_publish();
+static int config_written(const uint8_t *data, uint16_t len);
+static void ota_active_changed(hci_con_handle_t con_handle, int active);
+static void ota_work_pending();
+static void conn_idle_handler(btstack_timer_source_t *ts);
+static void metrics_publish();
+static void gpio_event(uint gpio, uint32_t events);
 
-static void state_check_handler(btstack_timer_source_t *ts);
-static void flasher_handler(btstack_timer_source_t *ts);
 static void start_flasher();
-static int flash_tick();
+static void flash_tick(uint32_t duration_ms);
 
 // *****************************************************************************
 // Main
@@ -135,65 +392,41 @@ static int flash_tick();
 
 int main()
 {
+  memory_budget_paint_stack();
+  memory_budget_account();
+
   stdio_init_all();
+  boot_mark(BOOT_PHASE_STDIO);
+  trace_init();
 
   if (cyw43_arch_init())
   {
     printf("Wi-Fi init failed");
     return EXIT_FAILURE;
   }
+  boot_mark(BOOT_PHASE_CYW43);
 
-  gpio_init(22);
-  gpio_pull_down(22);
-  gpio_set_dir(22, GPIO_IN);
+  pir_init(PIR_PIN, PIR_DEBOUNCE_US);
+  trace_record(TRACE_RECORD_PIR, &pir.level, 1);
 
+#if LED_OUTPUT_PWM
+  led_pwm_init(LED_PIN);
+#else
   gpio_init(LED_PIN);
   gpio_set_dir(LED_PIN, GPIO_OUT);
+#endif
 
-  if (ltr303_i2c_init())
-  {
-    printf("Failed to initialize LTR303\n");
-    return EXIT_FAILURE;
-  }
-
-  uint16_t visible_and_ir;
-  uint16_t ir_only;
-  uint8_t motion_pin;
-
-  while (true)
-  {
-    if (!ltr303_i2c_has_new_data())
-    {
-      continue;
-    }
-
-    if (ltr303_i2c_read_both_channels(&visible_and_ir, &ir_only))
-    {
-      continue;
-    }
-
-    motion_pin = gpio_get(22);
-
-    led_set(motion_pin);
-
-    printf("motion_pin: %d\n", motion_pin);
-    printf("visible_and_ir: %d\n", visible_and_ir);
-    printf("ir_only: %d\n", ir_only);
-    printf("\n");
-
-    sleep_ms(250);
-  }
+  gpio_init(LTR303_INT_PIN);
+  gpio_pull_up(LTR303_INT_PIN);
+  gpio_set_dir(LTR303_INT_PIN, GPIO_IN);
 
   // will be called when a Bluetooth event is received by the Bluetooth controller
   hci_event_callback_registration.callback = &hci_packet_handler;
   hci_add_event_handler(&hci_event_callback_registration);
 
-  // set one-shot timer
-  state_check_timer.process = &state_check_handler;
-  btstack_run_loop_set_timer(&state_check_timer, STATE_CHECK_INTERVAL_MS);
-  btstack_run_loop_add_timer(&state_check_timer);
-
-  flasher_timer.process = &flasher_handler;
+  // Our own work runs as tasks on the BTstack run loop. Nothing runs before
+  // the main loop polls it, the tasks are all added below.
+  task_scheduler_init();
 
   // By calling l2cap_init(), the Bluetooth stack is initialized and ready to establish L2CAP
   // connections with other Bluetooth devices.
@@ -226,6 +459,10 @@ int main()
   // wireless serial connection, such as wireless debugging or data transfer.
   nordic_spp_service_server_init(&nordic_spp_packet_handler);
 
+  // Our own service, one characteristic per kind of data
+  ney_tack_service_init(&config_written);
+  ota_init(&ota_active_changed, &ota_work_pending);
+
   // att_server_register_packet_handler() is a function call that registers a packet handler
   // function with the Attribute Protocol (ATT) server of the Bluetooth stack.
   // The packet handler function is responsible for processing incoming ATT packets and generating
@@ -272,20 +509,72 @@ int main()
   // The advertising data array contains information about the device that is broadcast to other
   // Bluetooth devices during advertising.
   gap_advertisements_set_data(adv_data_len, (uint8_t *)adv_data);
+  // Bonding, and advertising faster than the above while a phone is likely to
+  // come back (after a disconnect or a reboot), see reconnect.h
+  reconnect_init(adv_int_min);
+  conn_idle_timer.process = &conn_idle_handler;
   // Enable broadcast advertising data to other Bluetooth devices
   gap_advertisements_enable(1);
 
   init_connection();
 
+  // Resume the pattern from before the power cycle right away, not only once a
+  // phone has connected
+  state_restore();
+  config_restore();
+  boot_mark(BOOT_PHASE_STATE_RESTORED);
+  state_publish();
+  config_publish();
+  if (STATE.active)
+  {
+    start_flasher();
+  }
+
   // By calling hci_power_control() with the HCI_POWER_ON argument, the Bluetooth controller is
   // turned on and is ready to be used for communication with other Bluetooth devices.
   hci_power_control(HCI_POWER_ON);
+  boot_mark(BOOT_PHASE_HCI_POWER_ON);
+
+  // The controller works through its HCI init sequence while we scan the log
+  // and bring up the sensors. BTstack runs from the async context's low
+  // priority interrupt (pico_cyw43_arch_none), which preempts us here.
+  sample_log_init();
+  boot_mark(BOOT_PHASE_SAMPLE_LOG);
+
+  telemetry_encoder_init(&telemetry_encoder, TELEMETRY_MODE_OFF);
+
+  // The sensors are initialized by the scheduler, which keeps retrying if
+  // they don't respond
+  i2c_scheduler_add(&light_sensor);
+#if SECOND_LIGHT_SENSOR
+  i2c_scheduler_add(&light_sensor_2);
+#endif
+
+  // Drop to the reduced clock, motion and new light measurements wake us up
+  power_init(&i2c_scheduler_clock_changed, cyw43_arch_async_context());
+  power_set_gpio_handler(&gpio_event);
+  power_add_wake_gpio(PIR_PIN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL);
+  power_add_wake_gpio(LTR303_INT_PIN, GPIO_IRQ_EDGE_FALL);
+
+  uint64_t now_us = time_us_64();
+  task_add(&flasher_task, STATE.active ? now_us : TASK_IDLE);
+  task_add(&pir_task, TASK_IDLE);
+  task_add(&sensor_task, now_us);
+  task_add(&ota_task, TASK_IDLE);
+  task_add(&state_check_task, now_us + STATE_CHECK_INTERVAL_MS * 1000);
+  task_add(&metrics_task, now_us + METRICS_INTERVAL_MS * 1000);
+  task_add(&report_task, now_us + POWER_REPORT_INTERVAL_MS * 1000);
+
+  while (true)
+  {
+    // Does nothing on the device: with pico_cyw43_arch_none BTstack, CYW43
+    // and our tasks all run from the async context's low priority interrupt,
+    // so task code must never sleep. The host sim runs them from here.
+    cyw43_arch_poll();
 
-  // By calling btstack_run_loop_execute(), the BTstack run loop is started, and the Bluetooth
-  // device is ready to handle incoming Bluetooth events and callbacks. This function call is
-  // typically used at the end of the initialization process to start the Bluetooth stack and begin
-  // handling Bluetooth events.
-  btstack_run_loop_execute();
+    // Sleep until the next task is due, a wake GPIO fires or BTstack has work
+    power_sleep_until_us(task_scheduler_next_us());
+  }
 
   return EXIT_SUCCESS;
 }
@@ -294,6 +583,53 @@ int main()
 // Function Definitions
 // *****************************************************************************
 
+// Called by the i2c scheduler for every new light sensor reading
+static void light_sensor_reading(SensorDevice *dev, const SensorReading *reading)
+{
+  uint16_t visible_and_ir = reading->values[0];
+  uint16_t ir_only = reading->values[1];
+
+  if (dev != &light_sensor)
+  {
+    printf("%s visible_and_ir: %d, ir_only: %d\n", dev->name, visible_and_ir, ir_only);
+    return;
+  }
+
+  boot_mark(BOOT_PHASE_FIRST_SAMPLE);
+
+  uint8_t raw[4];
+  little_endian_store_16(raw, 0, visible_and_ir);
+  little_endian_store_16(raw, 2, ir_only);
+  trace_record_at(TRACE_RECORD_LIGHT, (uint32_t)reading->time_us, raw, sizeof(raw));
+
+  // Short pulses since the last reading count as well
+  uint8_t motion_pin = pir_take_motion();
+
+  printf("motion_pin: %d\n", motion_pin);
+  printf("visible_and_ir: %d\n", visible_and_ir);
+  printf("ir_only: %d\n", ir_only);
+  printf("\n");
+
+  Sample sample = {
+      .ch0 = visible_and_ir,
+      .ch1 = ir_only,
+      .pir = motion_pin,
+  };
+  sample_log_append(&sample, to_ms_since_boot(get_absolute_time()));
+  telemetry_queue_push(&sample);
+
+  if (ney_tack_service_subscribed(NEY_TACK_CHARACTERISTIC_SENSOR))
+  {
+    // ch0 u16, ch1 u16, pir u8, time_ms u32
+    uint8_t value[9];
+    little_endian_store_16(value, 0, sample.ch0);
+    little_endian_store_16(value, 2, sample.ch1);
+    value[4] = sample.pir;
+    little_endian_store_32(value, 5, (uint32_t)(reading->time_us / 1000));
+    ney_tack_service_set_value(NEY_TACK_CHARACTERISTIC_SENSOR, value, sizeof(value));
+  }
+}
+
 void led_toggle()
 {
   led_set(!led_state);
@@ -306,10 +642,30 @@ void led_set(int state)
     return;
   }
   led_state = state;
+#if LED_OUTPUT_PWM
+  led_pwm_set_level(led_state ? LED_PWM_WRAP : 0);
+#else
   gpio_put(LED_PIN, led_state);
+#endif
   cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, led_state);
 }
 
+// Plays a brightness ramp on LED_PIN. The CYW43 LED can't dim, it stays on
+// for the whole envelope.
+void led_envelope(int envelope, uint32_t duration_ms)
+{
+#if LED_OUTPUT_PWM
+  led_pwm_envelope(envelope, duration_ms);
+  cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, 1);
+  // Neither on nor off, the next led_set() has to apply
+  led_state = -1;
+#else
+  (void)envelope;
+  (void)duration_ms;
+  led_set(1);
+#endif
+}
+
 // This function is called when a Nordic SPP packet is received
 static void nordic_spp_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
 {
@@ -339,6 +695,8 @@ static void nordic_spp_packet_handler(uint8_t packet_type, uint16_t channel, uin
       {
         break;
       }
+      trace_record(TRACE_RECORD_SUBSCRIBED, NULL, 0);
+      reconnect_ready(con_handle);
       // Enable LE notification
       context->le_notification_enabled = 1;
       // Reset the test
@@ -373,16 +731,7 @@ static void nordic_spp_packet_handler(uint8_t packet_type, uint16_t channel, uin
     // Handle RFCOMM data packets
     printf("RECV: ");
     printf_hexdump(packet, size);
-
-    // TODO: Add code to handle received data
-    if (STATE.active == 0)
-    {
-      STATE.active = 1;
-    }
-    else
-    {
-      STATE.active = 0;
-    }
+    trace_record(TRACE_RECORD_SPP, packet, size);
 
     // Get the connection context for the channel
     context = connection_for_conn_handle((hci_con_handle_t)channel);
@@ -390,6 +739,7 @@ static void nordic_spp_packet_handler(uint8_t packet_type, uint16_t channel, uin
     {
       break;
     }
+    handle_command(context, packet, size);
     // Track the sent data
     test_track_sent(context, size);
     break;
@@ -426,28 +776,50 @@ static void att_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
     // Initialize the connection properties
     context->counter = 'A';
     context->test_data_len = ATT_DEFAULT_MTU - 4; // -1 for nordic 0x01 packet type
+    context->max_payload_len = context->test_data_len;
+    context->log_download_active = 0;
+    context->trace_download_active = 0;
+    context->power_stats_requested = 0;
+    context->boot_profile_requested = 0;
+    context->memory_report_requested = 0;
+    context->motion_edges = 0;
+    context->time_sync_active = 0;
+    context->time_pong_pending = 0;
+    // The client opts in to the sample stream with CMD_STREAM_MODE
+    telemetry_encoder_init(&telemetry_encoder, TELEMETRY_MODE_OFF);
     context->connection_handle = att_event_connected_get_handle(packet);
     break;
 
   case ATT_EVENT_MTU_EXCHANGE_COMPLETE:
     // Handle MTU exchange complete event
+    trace_record(TRACE_RECORD_MTU, packet + 4, 2);
     mtu = att_event_mtu_exchange_complete_get_MTU(packet) - 3;
     context = connection_for_conn_handle(att_event_mtu_exchange_complete_get_handle(packet));
     if (!context)
       break;
     // Set the test data length based on the MTU
-    context->test_data_len = btstack_min(mtu - 3, sizeof(context->test_data));
+    context->test_data_len = btstack_min(mtu, NOTIFY_BUFFER_SIZE);
+    context->max_payload_len = context->test_data_len;
     // Print a debug message
     printf("%c: ATT MTU = %u => use test data of len %u\n", context->name, mtu, context->test_data_len);
     break;
 
   case ATT_EVENT_DISCONNECTED:
     // Handle disconnection event
+    trace_record(TRACE_RECORD_DISCONNECTED, NULL, 0);
+    ney_tack_service_disconnected(att_event_disconnected_get_handle(packet));
+    ota_disconnected(att_event_disconnected_get_handle(packet));
     context = connection_for_conn_handle(att_event_disconnected_get_handle(packet));
     if (!context)
       break;
     // Free the connection by setting the connection handle to HCI_CON_HANDLE_INVALID
     printf("%c: Disconnect\n", context->name);
+    if (context->log_download_active || context->trace_download_active)
+    {
+      context->log_download_active = 0;
+      context->trace_download_active = 0;
+      power_release(POWER_DEMAND_BLE);
+    }
     context->le_notification_enabled = 0;
     context->connection_handle = HCI_CON_HANDLE_INVALID;
     break;
@@ -481,7 +853,6 @@ static void hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
   UNUSED(size);
 
   uint16_t conn_interval;
-  hci_con_handle_t con_handle;
 
   // Check if the packet is an HCI event packet
   if (packet_type != HCI_EVENT_PACKET)
@@ -496,6 +867,9 @@ static void hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
     {
       // Print a message to the console to prompt the user to connect
       printf("To start the streaming, please run nRF Toolbox -> UART to connect.\n");
+      boot_mark(BOOT_PHASE_ADVERTISING);
+      boot_profile_print();
+      memory_budget_print();
     }
     break;
   case HCI_EVENT_LE_META:
@@ -504,21 +878,28 @@ static void hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *p
     {
     case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
       // Handle LE connection complete event
-      // Get the connection handle and connection interval from the event packet
-      con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+      if (hci_subevent_le_connection_complete_get_status(packet))
+      {
+        // Directed advertising timed out, see reconnect.h
+        break;
+      }
+      // Get the connection interval from the event packet
+      boot_mark(BOOT_PHASE_CONNECTED);
       conn_interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
+      trace_record(TRACE_RECORD_CONNECTED, packet + 14, 2);
       // Print the connection interval and latency to the console
       printf("LE Connection - Connection Interval: %u.%02u ms\n", conn_interval * 125 / 100, 25 * (conn_interval & 3));
       printf("LE Connection - Connection Latency: %u\n", hci_subevent_le_connection_complete_get_conn_latency(packet));
 
-      // Request a connection interval of 500 ms
-      printf("LE Connection - Request 500 ms connection interval\n");
-      gap_request_connection_parameter_update(con_handle, 400, 400, 0, 0x0048);
+      // Request a connection interval of 500 ms once the phone has had the
+      // time to look around
+      btstack_run_loop_remove_timer(&conn_idle_timer);
+      btstack_run_loop_set_timer(&conn_idle_timer, CONN_IDLE_DELAY_MS);
+      btstack_run_loop_add_timer(&conn_idle_timer);
       break;
     case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
       // Handle LE connection update complete event
-      // Get the connection handle and connection interval from the event packet
-      con_handle = hci_subevent_le_connection_update_complete_get_connection_handle(packet);
+      // Get the connection interval from the event packet
       conn_interval = hci_subevent_le_connection_update_complete_get_conn_interval(packet);
       // Print the updated connection interval and latency to the console
       printf("LE Connection - Connection Param update - connection interval %u.%02u ms, latency %u\n", conn_interval * 125 / 100,
@@ -561,16 +942,50 @@ static void nordic_can_send(void *some_context)
   // context->counter++;
   // if (context->counter > 'Z')
   //   context->counter = 'A';
-  // memset(context->test_data, context->counter, context->test_data_len);
-
-  serialize_state(STATE, serialized_state, &serialized_state_len);
+  // memset(notify_buffer, context->counter, context->test_data_len);
 
-  // Send the serialized data
-  memcpy(context->test_data, serialized_state, serialized_state_len);
-  context->test_data_len = serialized_state_len;
+  if (context->time_pong_pending)
+  {
+    // Goes first, its latency is part of the sync error
+    time_pong_send(context);
+  }
+  else if (context->motion_edges > 0)
+  {
+    // Small and rare, not worth holding up behind a download
+    motion_send(context);
+  }
+  else if (context->log_download_active)
+  {
+    // A log download takes over the stream until it is done
+    log_download_send(context);
+  }
+  else if (context->trace_download_active)
+  {
+    trace_download_send(context);
+  }
+  else if (context->power_stats_requested)
+  {
+    power_stats_send(context);
+  }
+  else if (context->boot_profile_requested)
+  {
+    boot_profile_send(context);
+  }
+  else if (context->memory_report_requested)
+  {
+    memory_report_send(context);
+  }
+  else if (telemetry_ready() && telemetry_send(context) > 0)
+  {
+    // Sample frame is in the test data
+  }
+  else
+  {
+    serialize_state(&STATE, notify_buffer, &context->test_data_len);
+  }
 
   // Send the test data
-  nordic_spp_service_server_send(context->connection_handle, (uint8_t *)context->test_data, context->test_data_len);
+  nordic_spp_service_server_send(context->connection_handle, notify_buffer, context->test_data_len);
 
   // Track the sent data
   test_track_sent(context, context->test_data_len);
@@ -614,18 +1029,20 @@ static void test_track_sent(nordic_spp_le_streamer_connection_t *context, int by
   context->test_data_sent = 0;
 }
 
-void serialize_state(State state, uint8_t *serialized_state, int *serialized_state_len)
+void serialize_state(const State *state, uint8_t *serialized_state, int *serialized_state_len)
 {
   // Serialize the struct to a byte array
-  uint8_t active = state.active;
-  uint8_t flash_index = state.flash_index;
+  uint8_t active = state->active;
+  uint8_t flash_index = state->flash_index;
   uint16_t pattern[16];
   for (int i = 0; i < 16; i++)
   {
-    pattern[i] = __builtin_bswap16(state.pattern[i]);
+    pattern[i] = __builtin_bswap16(state->pattern[i]);
   }
-  uint8_t pattern_length = state.pattern_length;
+  uint8_t pattern_length = state->pattern_length;
   int offset = 0;
+  serialized_state[offset] = FRAME_TYPE_STATE;
+  offset += 1;
   memcpy(serialized_state + offset, &active, sizeof(active));
   offset += sizeof(active);
   memcpy(serialized_state + offset, &flash_index, sizeof(active));
@@ -634,29 +1051,331 @@ void serialize_state(State state, uint8_t *serialized_state, int *serialized_sta
   offset += sizeof(pattern_length);
   memcpy(serialized_state + offset, pattern, sizeof(pattern));
   offset += sizeof(pattern);
+  memcpy(serialized_state + offset, state->envelope, sizeof(state->envelope));
+  offset += sizeof(state->envelope);
 
   *serialized_state_len = offset;
 }
 
-static void state_check_handler(btstack_timer_source_t *ts)
+// Replaces the pattern, see CMD_SET_PATTERN
+static void set_pattern(const uint8_t *data, uint16_t size)
+{
+  if (size < 1 || data[0] > sizeof(STATE.pattern) / sizeof(STATE.pattern[0]) || size < 1 + 3 * data[0])
+  {
+    return;
+  }
+
+  STATE.pattern_length = data[0];
+  for (int i = 0; i < STATE.pattern_length; i++)
+  {
+    STATE.pattern[i] = little_endian_read_16(data, 1 + 3 * i);
+    STATE.envelope[i] = data[3 + 3 * i] < LED_NUM_ENVELOPES ? data[3 + 3 * i] : LED_ENVELOPE_STEP;
+  }
+  STATE.flash_index = 0;
+
+  state_save();
+  state_publish();
+}
+
+// Applies the state persisted before the last power cycle, if any
+static void state_restore()
+{
+  const btstack_tlv_t *tlv_impl;
+  void *tlv_context;
+  State stored;
+
+  btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+  if (!tlv_impl)
+  {
+    return;
+  }
+
+  if (tlv_impl->get_tag(tlv_context, STATE_TLV_TAG, (uint8_t *)&stored, sizeof(stored)) != sizeof(stored) ||
+      stored.pattern_length > sizeof(stored.pattern) / sizeof(stored.pattern[0]))
+  {
+    return;
+  }
+
+  STATE = stored;
+  STATE.flash_index = 0;
+}
+
+static void state_save()
+{
+  const btstack_tlv_t *tlv_impl;
+  void *tlv_context;
+
+  btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+  if (!tlv_impl)
+  {
+    return;
+  }
+
+  tlv_impl->store_tag(tlv_context, STATE_TLV_TAG, (uint8_t *)&STATE, sizeof(STATE));
+}
+
+// Updates the state characteristic, which has the 'S' frame without its type
+static void state_publish()
+{
+  int len;
+
+  serialize_state(&STATE, notify_buffer, &len);
+  ney_tack_service_set_value(NEY_TACK_CHARACTERISTIC_STATE, notify_buffer + 1, len - 1);
+}
+
+static void config_restore()
+{
+  const btstack_tlv_t *tlv_impl;
+  void *tlv_context;
+  Config stored;
+
+  btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+  if (!tlv_impl ||
+      tlv_impl->get_tag(tlv_context, CONFIG_TLV_TAG, (uint8_t *)&stored, sizeof(stored)) != sizeof(stored) ||
+      stored.sensor_period_ms < CONFIG_SENSOR_PERIOD_MIN_MS || stored.sensor_period_ms > CONFIG_SENSOR_PERIOD_MAX_MS)
+  {
+    return;
+  }
+
+  CONFIG = stored;
+  config_apply();
+}
+
+static void config_apply()
+{
+  light_sensor.period_us = CONFIG.sensor_period_ms * 1000;
+#if SECOND_LIGHT_SENSOR
+  light_sensor_2.period_us = CONFIG.sensor_period_ms * 1000;
+#endif
+}
+
+static void config_publish()
+{
+  uint8_t value[CONFIG_LEN];
+
+  value[0] = CONFIG_VERSION;
+  little_endian_store_16(value, 1, CONFIG.sensor_period_ms);
+  ney_tack_service_set_value(NEY_TACK_CHARACTERISTIC_CONFIG, value, sizeof(value));
+}
+
+// Write to the config characteristic. Applied right away and persisted.
+static int config_written(const uint8_t *data, uint16_t len)
+{
+  if (len != CONFIG_LEN)
+  {
+    return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+  }
+
+  uint16_t sensor_period_ms = little_endian_read_16(data, 1);
+  if (data[0] != CONFIG_VERSION ||
+      sensor_period_ms < CONFIG_SENSOR_PERIOD_MIN_MS || sensor_period_ms > CONFIG_SENSOR_PERIOD_MAX_MS)
+  {
+    return ATT_ERROR_VALUE_NOT_ALLOWED;
+  }
+
+  CONFIG.sensor_period_ms = sensor_period_ms;
+  config_apply();
+  config_publish();
+
+  const btstack_tlv_t *tlv_impl;
+  void *tlv_context;
+  btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+  if (tlv_impl)
+  {
+    tlv_impl->store_tag(tlv_context, CONFIG_TLV_TAG, (uint8_t *)&CONFIG, sizeof(CONFIG));
+  }
+
+  return 0;
+}
+
+// A firmware update started or ended. Full clock so the flash keeps up, and
+// the short connection interval for throughput while it runs.
+static void ota_active_changed(hci_con_handle_t con_handle, int active)
+{
+  nordic_spp_le_streamer_connection_t *context = connection_for_conn_handle(con_handle);
+
+  if (active)
+  {
+    power_request(POWER_DEMAND_OTA);
+    gap_request_connection_parameter_update(con_handle,
+                                            LOG_DOWNLOAD_CONN_INTERVAL_MIN, LOG_DOWNLOAD_CONN_INTERVAL_MAX, 0, 0x0048);
+    return;
+  }
+
+  power_release(POWER_DEMAND_OTA);
+  if (context && !context->log_download_active && !context->trace_download_active)
+  {
+    gap_request_connection_parameter_update(con_handle, IDLE_CONN_INTERVAL, IDLE_CONN_INTERVAL, 0, 0x0048);
+  }
+}
+
+static void conn_idle_handler(btstack_timer_source_t *ts)
 {
   UNUSED(ts);
 
+  nordic_spp_le_streamer_connection_t *context = &nordic_spp_le_streamer_connection;
+
+  // Whatever asked for the fast interval goes back to the idle one when done
+  if (context->connection_handle == HCI_CON_HANDLE_INVALID || context->log_download_active ||
+      context->trace_download_active || context->time_sync_active || ota_active())
+  {
+    return;
+  }
+
+  printf("LE Connection - Request 500 ms connection interval\n");
+  gap_request_connection_parameter_update(context->connection_handle, IDLE_CONN_INTERVAL, IDLE_CONN_INTERVAL, 0,
+                                          0x0048);
+}
+
+// A buffer is ready to be programmed or an image to be applied
+static void ota_work_pending()
+{
+  task_schedule(&ota_task, time_us_64());
+}
+
+// Updates the metrics characteristic: full_ms u32, reduced_ms u32,
+// sleep_ms u32, boot_to_advertising_ms u16, i2c_timeouts u16,
+// sensor_deadline_misses u16, sync_error_us i32, reconnect_ms u16,
+// reconnect_ready_ms u16
+static void metrics_publish()
+{
+  uint8_t value[26];
+
+  power_stats_update();
+
+  little_endian_store_32(value, 0, (uint32_t)(power_stats.state_us[POWER_STATE_FULL] / 1000));
+  little_endian_store_32(value, 4, (uint32_t)(power_stats.state_us[POWER_STATE_REDUCED] / 1000));
+  little_endian_store_32(value, 8, (uint32_t)(power_stats.state_us[POWER_STATE_SLEEP] / 1000));
+  little_endian_store_16(value, 12, btstack_min(boot_phase_ms(BOOT_PHASE_ADVERTISING), 0xFFFF));
+  little_endian_store_16(value, 14, btstack_min(i2c_stats.timeouts, 0xFFFF));
+  little_endian_store_16(value, 16, btstack_min(light_sensor.deadline_misses, 0xFFFF));
+  little_endian_store_32(value, 18, (uint32_t)sync_clock.last_error_us);
+  little_endian_store_16(value, 22, btstack_min(reconnect_stats.connect_ms, 0xFFFF));
+  little_endian_store_16(value, 24, btstack_min(reconnect_stats.ready_ms, 0xFFFF));
+  ney_tack_service_set_value(NEY_TACK_CHARACTERISTIC_METRICS, value, sizeof(value));
+}
+
+// Called from the GPIO interrupt for the wake GPIOs, see power_set_gpio_handler()
+static void gpio_event(uint gpio, uint32_t events)
+{
+  if (gpio == LTR303_INT_PIN)
+  {
+    task_signal_from_irq(&sensor_task);
+  }
+  else if (gpio == PIR_PIN)
+  {
+    pir_gpio_event(events);
+    task_signal_from_irq(&pir_task);
+  }
+}
+
+// Runs the i2c transactions that are due. A falling LTR303 INT signals the
+// task, the measurement is read right away instead of at the next poll.
+static uint64_t sensor_task_run(uint64_t now_us, int signalled)
+{
+  if (signalled)
+  {
+    i2c_scheduler_data_ready(&light_sensor, now_us);
+  }
+
+  i2c_scheduler_run(now_us);
+  if (light_sensor.initialized)
+  {
+    boot_mark(BOOT_PHASE_SENSOR_READY);
+  }
+
+  return i2c_scheduler_next_us();
+}
+
+// Takes the PIR edges the interrupt queued: the LED follows motion, the
+// edges go into the trace and out as motion frames with their own time.
+// Runs again when bounces have settled.
+static uint64_t pir_task_run(uint64_t now_us, int signalled)
+{
+  UNUSED(signalled);
+
+  nordic_spp_le_streamer_connection_t *context = &nordic_spp_le_streamer_connection;
+  uint64_t check_us = pir_check(now_us);
+  PirEdge edge;
+
+  while (pir_pop(&edge))
+  {
+    trace_record_at(TRACE_RECORD_PIR, (uint32_t)edge.time_us, &edge.level, 1);
+    led_set(edge.level);
+
+    if (context->le_notification_enabled)
+    {
+      context->motion_level = edge.level;
+      context->motion_time_us = (uint32_t)edge.time_us;
+      if (context->motion_edges < 0xFF)
+      {
+        context->motion_edges++;
+      }
+    }
+  }
+
+  return check_us == PIR_SETTLED ? TASK_IDLE : check_us;
+}
+
+// A page of firmware update flash work, again right away while there is more
+static uint64_t ota_task_run(uint64_t now_us, int signalled)
+{
+  UNUSED(signalled);
+
+  ota_poll();
+
+  return ota_busy() ? now_us : TASK_IDLE;
+}
+
+static uint64_t state_check_task_run(uint64_t now_us, int signalled)
+{
+  UNUSED(signalled);
+
   if (STATE.active == 1)
   {
     start_flasher();
   }
 
-  // re-register timer
-  btstack_run_loop_set_timer(&state_check_timer, STATE_CHECK_INTERVAL_MS);
-  btstack_run_loop_add_timer(&state_check_timer);
+  return now_us + STATE_CHECK_INTERVAL_MS * 1000;
 }
 
-static void flasher_handler(btstack_timer_source_t *ts)
+static uint64_t metrics_task_run(uint64_t now_us, int signalled)
 {
-  UNUSED(ts);
+  UNUSED(signalled);
+
+  metrics_publish();
+
+  return now_us + METRICS_INTERVAL_MS * 1000;
+}
+
+static uint64_t report_task_run(uint64_t now_us, int signalled)
+{
+  UNUSED(signalled);
+
+  power_stats_print();
+  memory_budget_print();
+  task_scheduler_print();
+  pir_stats_print();
+  reconnect_stats_print();
+
+  return now_us + POWER_REPORT_INTERVAL_MS * 1000;
+}
+
+static uint64_t flasher_task_run(uint64_t now_us, int signalled)
+{
+  UNUSED(signalled);
 
-  if (flasher_state == FLASHER_STATE_OFF)
+  uint32_t remaining_ms = 0;
+  int sync_index = sync_clock.synced ? flash_sync_index(&remaining_ms) : -1;
+
+  if (sync_index >= 0)
+  {
+    // The shared time base decides where in the pattern we are, so every step
+    // lines up with the other units no matter when we started
+    STATE.flash_index = sync_index;
+    flasher_state = FLASHER_STATE_ON;
+  }
+  else if (flasher_state == FLASHER_STATE_OFF)
   {
     // don't advance flash index if flash was on
     flasher_state = FLASHER_STATE_ON;
@@ -664,23 +1383,30 @@ static void flasher_handler(btstack_timer_source_t *ts)
   else
   {
     // advance flash index if flash was on
-    STATE.flash_index = (STATE.flash_index + 1) % STATE.pattern_length;
+    STATE.flash_index = STATE.pattern_length > 0 ? (STATE.flash_index + 1) % STATE.pattern_length : 0;
   }
 
-  int duration = flash_tick();
+  int duration = STATE.pattern_length > 0 ? STATE.pattern[STATE.flash_index] : -1;
+  if (sync_index >= 0 && duration >= 0)
+  {
+    duration = remaining_ms;
+  }
 
   if (duration < 0 || STATE.active == 0)
   {
     flasher_state = FLASHER_STATE_OFF;
     led_set(0);
     STATE.flash_index = 0;
+    power_release(POWER_DEMAND_PATTERN);
+    state_publish();
 
-    return;
+    return TASK_IDLE;
   }
 
-  // re-register timer
-  btstack_run_loop_set_timer(&flasher_timer, duration);
-  btstack_run_loop_add_timer(&flasher_timer);
+  flash_tick(duration);
+  state_publish();
+
+  return now_us + (uint64_t)duration * 1000;
 }
 
 static void start_flasher()
@@ -690,18 +1416,52 @@ static void start_flasher()
     return;
   }
 
-  btstack_run_loop_set_timer(&flasher_timer, 0);
-  btstack_run_loop_add_timer(&flasher_timer);
+  // Pattern timing needs the full clock
+  power_request(POWER_DEMAND_PATTERN);
+
+  task_schedule(&flasher_task, time_us_64());
 }
 
-static int flash_tick()
+// Finds the pattern step the shared time is in. Patterns start whenever the
+// shared time is a multiple of the pattern length. Returns -1 for an empty
+// pattern.
+static int flash_sync_index(uint32_t *remaining_ms)
 {
-  if (STATE.pattern_length == 0)
+  uint32_t period_ms = 0;
+
+  for (int i = 0; i < STATE.pattern_length; i++)
+  {
+    period_ms += STATE.pattern[i];
+  }
+  if (period_ms == 0)
   {
     return -1;
   }
 
-  if (STATE.flash_index % 2 == 0)
+  uint32_t position_ms = (uint32_t)(sync_clock_shared_ms() % period_ms);
+  for (int i = 0; i < STATE.pattern_length; i++)
+  {
+    if (position_ms < STATE.pattern[i])
+    {
+      *remaining_ms = STATE.pattern[i] - position_ms;
+      return i;
+    }
+    position_ms -= STATE.pattern[i];
+  }
+
+  return -1;
+}
+
+// Drives the LED for the current step, which lasts duration_ms from now
+static void flash_tick(uint32_t duration_ms)
+{
+  uint8_t envelope = STATE.envelope[STATE.flash_index];
+
+  if (envelope != LED_ENVELOPE_STEP)
+  {
+    led_envelope(envelope, duration_ms);
+  }
+  else if (STATE.flash_index % 2 == 0)
   {
     led_set(1);
   }
@@ -709,8 +1469,380 @@ static int flash_tick()
   {
     led_set(0);
   }
+}
+static void handle_command(nordic_spp_le_streamer_connection_t *context, uint8_t *packet, uint16_t size)
+{
+  if (size < 1)
+  {
+    return;
+  }
+
+  switch (packet[0])
+  {
+  case CMD_TOGGLE_ACTIVE:
+    STATE.active = !STATE.active;
+    state_save();
+    state_publish();
+    break;
+
+  case CMD_LOG_DOWNLOAD:
+    log_download_start(context, size >= 5 ? little_endian_read_32(packet, 1) : 0);
+    break;
+
+  case CMD_TRACE_DOWNLOAD:
+    trace_download_start(context, size >= 5 ? little_endian_read_32(packet, 1) : 0);
+    break;
+
+  case CMD_STREAM_MODE:
+    if (size < 2 || packet[1] > TELEMETRY_MODE_COMPRESSED)
+    {
+      break;
+    }
+    telemetry_latency_ms =
+        size >= 4 ? btstack_min(little_endian_read_16(packet, 2), TELEMETRY_LATENCY_LIMIT_MS) : TELEMETRY_MAX_LATENCY_MS;
+    printf("%c: Sample stream mode %u, latency %" PRIu32 " ms\n", context->name, packet[1], telemetry_latency_ms);
+    telemetry_encoder_init(&telemetry_encoder, packet[1]);
+    telemetry_size_frame();
+    break;
+
+  case CMD_POWER_STATS:
+    context->power_stats_requested = 1;
+    break;
+
+  case CMD_BOOT_PROFILE:
+    context->boot_profile_requested = 1;
+    break;
+
+#if MEMORY_BUDGET
+  case CMD_MEMORY_REPORT:
+    context->memory_report_requested = 1;
+    break;
+#endif
+
+  case CMD_SET_PATTERN:
+    set_pattern(packet + 1, size - 1);
+    break;
+
+  case CMD_TIME_PING:
+    if (size >= 5)
+    {
+      time_ping_received(context, little_endian_read_32(packet, 1));
+    }
+    break;
+
+  case CMD_TIME_SET:
+    if (size >= 9)
+    {
+      time_set_received(context, little_endian_read_32(packet, 1), little_endian_read_32(packet, 5));
+    }
+    break;
+
+  default:
+    printf("Unknown command 0x%02x\n", packet[0]);
+    break;
+  }
+}
+
+static void log_download_start(nordic_spp_le_streamer_connection_t *context, uint32_t offset)
+{
+  // Make the samples collected so far part of the download
+  sample_log_flush();
+
+  printf("%c: Log download from %" PRIu32 " to %" PRIu32 "\n", context->name,
+         btstack_max(offset, sample_log_start_offset()), sample_log_end_offset());
+
+  if (!context->log_download_active && !context->trace_download_active)
+  {
+    power_request(POWER_DEMAND_BLE);
+  }
+  context->log_download_offset = offset;
+  context->log_download_active = 1;
 
-  int duration = STATE.pattern[STATE.flash_index];
+  // Ask for a short connection interval so we get several packets per interval
+  gap_request_connection_parameter_update(context->connection_handle,
+                                          LOG_DOWNLOAD_CONN_INTERVAL_MIN, LOG_DOWNLOAD_CONN_INTERVAL_MAX, 0, 0x0048);
+}
 
-  return duration;
-}
\ No newline at end of file
+// Fills the test data with the next chunk of the log, using the full MTU
+static void log_download_send(nordic_spp_le_streamer_connection_t *context)
+{
+  uint8_t *frame = notify_buffer;
+  int header_len = 5;
+
+  int n = sample_log_read(&context->log_download_offset, frame + header_len, context->max_payload_len - header_len);
+
+  frame[0] = FRAME_TYPE_LOG;
+  little_endian_store_32(frame, 1, context->log_download_offset);
+  context->test_data_len = header_len + n;
+
+  context->log_download_offset += n;
+
+  if (n == 0)
+  {
+    // Empty frame marks the end of the log, back to the slow interval
+    printf("%c: Log download done\n", context->name);
+    context->log_download_active = 0;
+    if (!context->trace_download_active && !ota_active())
+    {
+      power_release(POWER_DEMAND_BLE);
+      gap_request_connection_parameter_update(context->connection_handle,
+                                              IDLE_CONN_INTERVAL, IDLE_CONN_INTERVAL, 0, 0x0048);
+    }
+  }
+}
+
+static void trace_download_start(nordic_spp_le_streamer_connection_t *context, uint32_t offset)
+{
+  printf("%c: Trace download from %" PRIu32 " to %" PRIu32 ", %" PRIu32 " records dropped\n", context->name,
+         btstack_max(offset, trace_start_offset()), trace_end_offset(), trace.dropped);
+
+  if (!context->log_download_active && !context->trace_download_active)
+  {
+    power_request(POWER_DEMAND_BLE);
+  }
+  context->trace_download_offset = offset;
+  context->trace_download_active = 1;
+
+  gap_request_connection_parameter_update(context->connection_handle,
+                                          LOG_DOWNLOAD_CONN_INTERVAL_MIN, LOG_DOWNLOAD_CONN_INTERVAL_MAX, 0, 0x0048);
+}
+
+// Fills the test data with the next whole trace records that fit the MTU.
+// Records keep coming in meanwhile, the download ends once it has caught up.
+static void trace_download_send(nordic_spp_le_streamer_connection_t *context)
+{
+  uint8_t *frame = notify_buffer;
+  int header_len = 5;
+
+  int n = trace_read(&context->trace_download_offset, frame + header_len, context->max_payload_len - header_len);
+
+  frame[0] = FRAME_TYPE_TRACE;
+  little_endian_store_32(frame, 1, context->trace_download_offset);
+  context->test_data_len = header_len + n;
+
+  context->trace_download_offset += n;
+
+  if (n == 0)
+  {
+    printf("%c: Trace download done\n", context->name);
+    context->trace_download_active = 0;
+    if (!context->log_download_active && !ota_active())
+    {
+      power_release(POWER_DEMAND_BLE);
+      gap_request_connection_parameter_update(context->connection_handle,
+                                              IDLE_CONN_INTERVAL, IDLE_CONN_INTERVAL, 0, 0x0048);
+    }
+  }
+}
+
+// Fills the test data with the time spent in each power state so far
+static void power_stats_send(nordic_spp_le_streamer_connection_t *context)
+{
+  uint8_t *frame = notify_buffer;
+
+  power_stats_update();
+
+  frame[0] = FRAME_TYPE_POWER_STATS;
+  little_endian_store_32(frame, 1, (uint32_t)(power_stats.state_us[POWER_STATE_FULL] / 1000));
+  little_endian_store_32(frame, 5, (uint32_t)(power_stats.state_us[POWER_STATE_REDUCED] / 1000));
+  little_endian_store_32(frame, 9, (uint32_t)(power_stats.state_us[POWER_STATE_SLEEP] / 1000));
+  little_endian_store_32(frame, 13, power_stats.gpio_wakeups);
+  context->test_data_len = 17;
+
+  context->power_stats_requested = 0;
+}
+
+static void time_ping_received(nordic_spp_le_streamer_connection_t *context, uint32_t phone_ms)
+{
+  // Take the time first thing, everything until the pong goes out adds to
+  // the round trip
+  context->time_ping_local_us = (uint32_t)time_us_64();
+  context->time_ping_phone_ms = phone_ms;
+  context->time_pong_pending = 1;
+
+  if (!context->time_sync_active)
+  {
+    // Short connection interval for short round trips
+    context->time_sync_active = 1;
+    gap_request_connection_parameter_update(context->connection_handle,
+                                            LOG_DOWNLOAD_CONN_INTERVAL_MIN, LOG_DOWNLOAD_CONN_INTERVAL_MAX, 0, 0x0048);
+  }
+}
+
+static void time_set_received(nordic_spp_le_streamer_connection_t *context, uint32_t local_us, uint32_t shared_ms)
+{
+  uint64_t local_us_full = sync_clock_local_from_u32(local_us);
+
+  sync_clock_update(local_us_full, sync_clock_shared_from_u32_ms(local_us_full, shared_ms));
+
+  if (context->time_sync_active)
+  {
+    context->time_sync_active = 0;
+    if (!context->log_download_active && !context->trace_download_active && !ota_active())
+    {
+      gap_request_connection_parameter_update(context->connection_handle,
+                                              IDLE_CONN_INTERVAL, IDLE_CONN_INTERVAL, 0, 0x0048);
+    }
+  }
+}
+
+static void time_pong_send(nordic_spp_le_streamer_connection_t *context)
+{
+  uint8_t *frame = notify_buffer;
+
+  frame[0] = FRAME_TYPE_TIME_PONG;
+  little_endian_store_32(frame, 1, context->time_ping_phone_ms);
+  little_endian_store_32(frame, 5, context->time_ping_local_us);
+  context->test_data_len = 9;
+
+  context->time_pong_pending = 0;
+}
+
+// Fills the test data with the boot phase timestamps
+static void boot_profile_send(nordic_spp_le_streamer_connection_t *context)
+{
+  uint8_t *frame = notify_buffer;
+
+  frame[0] = FRAME_TYPE_BOOT_PROFILE;
+  for (int i = 0; i < BOOT_NUM_PHASES; i++)
+  {
+    uint32_t ms = boot_phase_ms(i);
+    little_endian_store_16(frame, 1 + 2 * i, ms > 0xFFFF ? 0xFFFF : ms);
+  }
+  context->test_data_len = 1 + 2 * BOOT_NUM_PHASES;
+
+  context->boot_profile_requested = 0;
+}
+
+// Fills the test data with the latest PIR edge
+static void motion_send(nordic_spp_le_streamer_connection_t *context)
+{
+  uint8_t *frame = notify_buffer;
+
+  frame[0] = FRAME_TYPE_MOTION;
+  frame[1] = context->motion_level;
+  little_endian_store_32(frame, 2, context->motion_time_us);
+  frame[6] = context->motion_edges;
+  little_endian_store_16(frame, 7, pir_window_count(time_us_64()));
+  context->test_data_len = 9;
+
+  context->motion_edges = 0;
+}
+
+// Fills the test data with the memory budget, as many subsystems as fit
+static void memory_report_send(nordic_spp_le_streamer_connection_t *context)
+{
+  uint8_t *frame = notify_buffer;
+  int len = 17;
+
+  frame[0] = FRAME_TYPE_MEMORY;
+  little_endian_store_16(frame, 1, memory_budget_stack_size());
+  little_endian_store_16(frame, 3, memory_budget_stack_peak());
+  little_endian_store_32(frame, 5, memory_budget_static_bytes());
+  little_endian_store_32(frame, 9, memory_budget_heap_bytes());
+  little_endian_store_32(frame, 13, memory_budget_free_bytes());
+  for (int i = 0; i < MEMORY_NUM_SUBSYSTEMS && len + 4 <= context->max_payload_len; i++)
+  {
+    little_endian_store_32(frame, len, memory_budget.subsystem_bytes[i]);
+    len += 4;
+  }
+  context->test_data_len = len;
+
+  context->memory_report_requested = 0;
+}
+
+// Static RAM per subsystem, for the memory budget report
+static void memory_budget_account()
+{
+  memory_budget_set(MEMORY_SUBSYSTEM_SPP, sizeof(nordic_spp_le_streamer_connection) + sizeof(notify_buffer));
+  memory_budget_set(MEMORY_SUBSYSTEM_TELEMETRY, sizeof(telemetry_queue) + sizeof(telemetry_queue_ms) +
+                                                   sizeof(telemetry_encoder) + sizeof(telemetry_sizer));
+  memory_budget_set(MEMORY_SUBSYSTEM_SAMPLE_LOG, sizeof(sample_log));
+  memory_budget_set(MEMORY_SUBSYSTEM_TRACE, sizeof(trace));
+  memory_budget_set(MEMORY_SUBSYSTEM_OTA, sizeof(ota));
+  memory_budget_set(MEMORY_SUBSYSTEM_GATT, sizeof(ney_tack_service));
+#if SECOND_LIGHT_SENSOR
+  memory_budget_set(MEMORY_SUBSYSTEM_SENSORS, sizeof(light_sensor) + sizeof(sensor_bus) + sizeof(light_sensor_2) +
+                                                  sizeof(sensor_bus_2) + sizeof(i2c_stats) + sizeof(pir));
+#else
+  memory_budget_set(MEMORY_SUBSYSTEM_SENSORS,
+                    sizeof(light_sensor) + sizeof(sensor_bus) + sizeof(i2c_stats) + sizeof(pir));
+#endif
+  memory_budget_set(MEMORY_SUBSYSTEM_LED, sizeof(led_pwm));
+  memory_budget_set(MEMORY_SUBSYSTEM_POWER, sizeof(power) + sizeof(power_stats));
+}
+
+static void telemetry_queue_push(const Sample *sample)
+{
+  if (telemetry_encoder.mode == TELEMETRY_MODE_OFF)
+  {
+    telemetry_queue_count = 0;
+    return;
+  }
+
+  int tail = (telemetry_queue_head + telemetry_queue_count) % TELEMETRY_QUEUE_SIZE;
+  telemetry_queue[tail] = *sample;
+  telemetry_queue_ms[tail] = btstack_run_loop_get_time_ms();
+
+  if (telemetry_queue_count < TELEMETRY_QUEUE_SIZE)
+  {
+    telemetry_queue_count++;
+  }
+  else
+  {
+    // Queue full, drop the oldest sample
+    telemetry_queue_head = (telemetry_queue_head + 1) % TELEMETRY_QUEUE_SIZE;
+    telemetry_frame_full = 1;
+  }
+
+  if (!telemetry_frame_full && !telemetry_frame_put(&telemetry_sizer, sample))
+  {
+    telemetry_frame_full = 1;
+  }
+}
+
+// Sizes the next frame from the queued samples, in step with
+// telemetry_encoder. telemetry_queue_push() keeps it up to date.
+static void telemetry_size_frame()
+{
+  telemetry_sizer = telemetry_encoder;
+  telemetry_frame_begin(&telemetry_sizer, NULL, nordic_spp_le_streamer_connection.max_payload_len);
+  telemetry_frame_full = 0;
+
+  for (int i = 0; i < telemetry_queue_count && !telemetry_frame_full; i++)
+  {
+    telemetry_frame_full = !telemetry_frame_put(&telemetry_sizer,
+                                                &telemetry_queue[(telemetry_queue_head + i) % TELEMETRY_QUEUE_SIZE]);
+  }
+}
+
+// Samples are batched until they fill a frame or the oldest one has waited
+// long enough
+static int telemetry_ready()
+{
+  if (telemetry_encoder.mode == TELEMETRY_MODE_OFF || telemetry_queue_count == 0)
+  {
+    return 0;
+  }
+
+  return telemetry_frame_full ||
+         btstack_run_loop_get_time_ms() - telemetry_queue_ms[telemetry_queue_head] >= telemetry_latency_ms;
+}
+
+// Fills the test data with as many queued samples as fit in one notification.
+// Returns the frame length, 0 if not even one sample fits the MTU.
+static int telemetry_send(nordic_spp_le_streamer_connection_t *context)
+{
+  telemetry_frame_begin(&telemetry_encoder, notify_buffer, context->max_payload_len);
+
+  while (telemetry_queue_count > 0 && telemetry_frame_put(&telemetry_encoder, &telemetry_queue[telemetry_queue_head]))
+  {
+    telemetry_queue_head = (telemetry_queue_head + 1) % TELEMETRY_QUEUE_SIZE;
+    telemetry_queue_count--;
+  }
+
+  context->test_data_len = telemetry_frame_end(&telemetry_encoder);
+  telemetry_size_frame();
+
+  return context->test_data_len;
+}
@@ -0,0 +1,258 @@
+// *****************************************************************************
+// Ney Tack GATT service
+//
+// Besides the multiplexed Nordic SPP stream the device offers its own primary
+// service (see mygatt.gatt) with one characteristic per kind of data:
+//
+//   State    READ | NOTIFY   active, flash index, pattern, envelopes
+//   Sensor   NOTIFY          latest light/motion sample
+//   Config   READ | WRITE    settings, see NeyTackConfig in ney_tack.c
+//   Metrics  READ | NOTIFY   power, boot and link statistics
+//
+// Clients subscribe only to what they need. Every characteristic keeps its
+// latest value in RAM: the application updates it whenever the data changes,
+// reads are answered from that cache right away and notifications always
+// carry the newest value (updates between two notifications are coalesced).
+//
+// Modelled on the BTstack service servers (nordic_spp_service_server.c):
+// handles are looked up by UUID, the service registers its own ATT handler.
+// *****************************************************************************
+#ifndef NEY_TACK_SERVICE_H
+#define NEY_TACK_SERVICE_H
+
+#include <string.h>
+#include "btstack.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define NEY_TACK_VALUE_MAX_LEN 64
+
+#define NEY_TACK_CHARACTERISTIC_STATE 0
+#define NEY_TACK_CHARACTERISTIC_SENSOR 1
+#define NEY_TACK_CHARACTERISTIC_CONFIG 2
+#define NEY_TACK_CHARACTERISTIC_METRICS 3
+#define NEY_TACK_NUM_CHARACTERISTICS 4
+
+typedef struct
+{
+  uint16_t value_handle;
+  uint16_t ccc_handle; // 0 if the characteristic can't notify
+  uint16_t ccc;
+  uint8_t value[NEY_TACK_VALUE_MAX_LEN];
+  uint16_t value_len;
+  int notify_pending;
+  btstack_context_callback_registration_t notify_request;
+} NeyTackCharacteristic;
+
+typedef struct
+{
+  att_service_handler_t handler;
+  hci_con_handle_t con_handle;
+  NeyTackCharacteristic characteristics[NEY_TACK_NUM_CHARACTERISTICS];
+  // Called for writes to the config characteristic. Returns 0 to accept the
+  // value, an ATT error code otherwise.
+  int (*config_written)(const uint8_t *data, uint16_t len);
+} NeyTackService;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+// 4e540001-6e65-7920-7461-636b00000000 and up, big-endian
+static const uint8_t ney_tack_service_uuid128[] = {0x4e, 0x54, 0x00, 0x01, 0x6e, 0x65, 0x79, 0x20,
+                                                   0x74, 0x61, 0x63, 0x6b, 0x00, 0x00, 0x00, 0x00};
+
+static NeyTackService ney_tack_service;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void ney_tack_service_init(int (*config_written)(const uint8_t *data, uint16_t len));
+void ney_tack_service_set_value(int characteristic, const uint8_t *data, uint16_t len);
+int ney_tack_service_subscribed(int characteristic);
+void ney_tack_service_disconnected(hci_con_handle_t con_handle);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+static NeyTackCharacteristic *ney_tack_characteristic_for_handle(uint16_t handle, int *is_ccc)
+{
+  for (int i = 0; i < NEY_TACK_NUM_CHARACTERISTICS; i++)
+  {
+    NeyTackCharacteristic *characteristic = &ney_tack_service.characteristics[i];
+    if (characteristic->value_handle == handle)
+    {
+      *is_ccc = 0;
+      return characteristic;
+    }
+    if (characteristic->ccc_handle && characteristic->ccc_handle == handle)
+    {
+      *is_ccc = 1;
+      return characteristic;
+    }
+  }
+  return NULL;
+}
+
+static uint16_t ney_tack_service_read_callback(hci_con_handle_t con_handle, uint16_t attribute_handle,
+                                               uint16_t offset, uint8_t *buffer, uint16_t buffer_size)
+{
+  UNUSED(con_handle);
+
+  int is_ccc;
+  NeyTackCharacteristic *characteristic = ney_tack_characteristic_for_handle(attribute_handle, &is_ccc);
+  if (!characteristic)
+  {
+    return 0;
+  }
+
+  if (is_ccc)
+  {
+    uint8_t ccc[2];
+    little_endian_store_16(ccc, 0, characteristic->ccc);
+    return att_read_callback_handle_blob(ccc, sizeof(ccc), offset, buffer, buffer_size);
+  }
+
+  return att_read_callback_handle_blob(characteristic->value, characteristic->value_len, offset, buffer, buffer_size);
+}
+
+static int ney_tack_service_write_callback(hci_con_handle_t con_handle, uint16_t attribute_handle,
+                                           uint16_t transaction_mode, uint16_t offset, uint8_t *buffer,
+                                           uint16_t buffer_size)
+{
+  if (transaction_mode != ATT_TRANSACTION_MODE_NONE || offset != 0)
+  {
+    return ATT_ERROR_REQUEST_NOT_SUPPORTED;
+  }
+
+  int is_ccc;
+  NeyTackCharacteristic *characteristic = ney_tack_characteristic_for_handle(attribute_handle, &is_ccc);
+  if (!characteristic)
+  {
+    return 0;
+  }
+
+  if (is_ccc)
+  {
+    if (buffer_size < 2)
+    {
+      return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+    }
+    ney_tack_service.con_handle = con_handle;
+    characteristic->ccc = little_endian_read_16(buffer, 0);
+    return 0;
+  }
+
+  if (characteristic == &ney_tack_service.characteristics[NEY_TACK_CHARACTERISTIC_CONFIG] &&
+      ney_tack_service.config_written)
+  {
+    return ney_tack_service.config_written(buffer, buffer_size);
+  }
+
+  return 0;
+}
+
+static void ney_tack_service_can_send_now(void *context)
+{
+  NeyTackCharacteristic *characteristic = (NeyTackCharacteristic *)context;
+
+  characteristic->notify_pending = 0;
+  if (ney_tack_service.con_handle == HCI_CON_HANDLE_INVALID ||
+      !(characteristic->ccc & GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION))
+  {
+    return;
+  }
+
+  uint16_t len = btstack_min(characteristic->value_len, att_server_get_mtu(ney_tack_service.con_handle) - 3);
+  att_server_notify(ney_tack_service.con_handle, characteristic->value_handle, characteristic->value, len);
+}
+
+static void ney_tack_service_lookup(NeyTackCharacteristic *characteristic, uint8_t uuid_last_byte,
+                                    uint16_t start_handle, uint16_t end_handle)
+{
+  uint8_t uuid128[16];
+
+  memcpy(uuid128, ney_tack_service_uuid128, sizeof(uuid128));
+  uuid128[3] = uuid_last_byte;
+
+  characteristic->value_handle =
+      gatt_server_get_value_handle_for_characteristic_with_uuid128(start_handle, end_handle, uuid128);
+  characteristic->ccc_handle =
+      gatt_server_get_client_configuration_handle_for_characteristic_with_uuid128(start_handle, end_handle, uuid128);
+  characteristic->notify_request.callback = &ney_tack_service_can_send_now;
+  characteristic->notify_request.context = characteristic;
+}
+
+void ney_tack_service_init(int (*config_written)(const uint8_t *data, uint16_t len))
+{
+  uint16_t start_handle = 0;
+  uint16_t end_handle = 0xffff;
+
+  if (!gatt_server_get_handle_range_for_service_with_uuid128(ney_tack_service_uuid128, &start_handle, &end_handle))
+  {
+    printf("Ney Tack service missing from the ATT DB\n");
+    return;
+  }
+
+  // Characteristic UUIDs follow the service UUID: 0x02 state, 0x03 sensor, ...
+  for (int i = 0; i < NEY_TACK_NUM_CHARACTERISTICS; i++)
+  {
+    ney_tack_service_lookup(&ney_tack_service.characteristics[i], 0x02 + i, start_handle, end_handle);
+  }
+
+  ney_tack_service.con_handle = HCI_CON_HANDLE_INVALID;
+  ney_tack_service.config_written = config_written;
+
+  ney_tack_service.handler.start_handle = start_handle;
+  ney_tack_service.handler.end_handle = end_handle;
+  ney_tack_service.handler.read_callback = &ney_tack_service_read_callback;
+  ney_tack_service.handler.write_callback = &ney_tack_service_write_callback;
+  att_server_register_service_handler(&ney_tack_service.handler);
+}
+
+// Updates the cached value and notifies subscribed clients
+void ney_tack_service_set_value(int characteristic_index, const uint8_t *data, uint16_t len)
+{
+  NeyTackCharacteristic *characteristic = &ney_tack_service.characteristics[characteristic_index];
+
+  characteristic->value_len = btstack_min(len, sizeof(characteristic->value));
+  memcpy(characteristic->value, data, characteristic->value_len);
+
+  if (!ney_tack_service_subscribed(characteristic_index) || characteristic->notify_pending)
+  {
+    return;
+  }
+
+  characteristic->notify_pending = 1;
+  att_server_request_to_send_notification(&characteristic->notify_request, ney_tack_service.con_handle);
+}
+
+// Lets the application skip building values nobody listens to
+int ney_tack_service_subscribed(int characteristic_index)
+{
+  return ney_tack_service.con_handle != HCI_CON_HANDLE_INVALID &&
+         (ney_tack_service.characteristics[characteristic_index].ccc &
+          GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION);
+}
+
+// Forgets the subscriptions of a closed connection
+void ney_tack_service_disconnected(hci_con_handle_t con_handle)
+{
+  if (con_handle != ney_tack_service.con_handle)
+  {
+    return;
+  }
+
+  ney_tack_service.con_handle = HCI_CON_HANDLE_INVALID;
+  for (int i = 0; i < NEY_TACK_NUM_CHARACTERISTICS; i++)
+  {
+    ney_tack_service.characteristics[i].ccc = 0;
+    ney_tack_service.characteristics[i].notify_pending = 0;
+  }
+}
+
+#endif
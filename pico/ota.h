@@ -0,0 +1,633 @@
+// *****************************************************************************
+// Over-the-air firmware update
+//
+// A GATT service (see mygatt.gatt) that takes a new firmware image over BLE:
+//
+//   Control  WRITE | NOTIFY           commands in, status notifications out
+//   Data     WRITE_WITHOUT_RESPONSE   offset u32, image bytes
+//
+// The phone sends OTA_CMD_BEGIN with the image size and CRC-32, then streams
+// the image through the data characteristic at the full MTU. Received data
+// fills one of two sector sized RAM buffers; a full buffer is programmed into
+// the staging slot (see flash_layout.h) a page at a time from ota_poll() while
+// the other one fills. The slot is erased a sector per call, ahead of the
+// page being programmed, and while there is nothing to program up to
+// OTA_ERASE_AHEAD past the programmed data. Every flash operation stalls the
+// core with interrupts off; a sector erase takes about 45 ms (400 ms worst
+// case by the datasheet), inside the 720 ms supervision timeout the
+// application asks for. A 64 kB block erase would take 150 ms and up to 2 s.
+//
+// Each buffer handed to the programmer is acknowledged with an
+// OTA_STATUS_RECEIVING notification carrying the bytes received so far, which
+// is also where the now empty buffer starts. The phone keeps at most
+// OTA_WINDOW_SIZE bytes beyond that in flight, so it never runs ahead of the
+// flash. Data at the wrong offset (or, should the phone not keep to the
+// window, with both buffers busy) is dropped and answered with
+// OTA_STATUS_RESYNC, and the phone continues from the offset in it.
+//
+// Once the whole image is in flash its CRC is checked (OTA_STATUS_VERIFIED or
+// OTA_STATUS_ERROR_CRC, both with the total time). OTA_CMD_APPLY then copies
+// the staging slot over the running image from RAM and reboots. There is no
+// bootloader: if power fails during the copy, the unit has to be flashed
+// over USB (BOOTSEL) again.
+//
+// The characteristics require an encrypted link and OTA_CMD_BEGIN checks
+// for one as well, so nobody in range can replace the firmware without
+// pairing first.
+// *****************************************************************************
+#ifndef OTA_H
+#define OTA_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "btstack.h"
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/structs/watchdog.h"
+#include "hardware/sync.h"
+#include "flash_layout.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+// Control point commands
+#define OTA_CMD_BEGIN 'B' // 'B' size u32, crc32 u32
+#define OTA_CMD_APPLY 'A' // 'A', only after OTA_STATUS_VERIFIED
+#define OTA_CMD_ABORT 'X' // 'X'
+
+// Status notifications: status u8, received u32, elapsed_ms u32 (since
+// OTA_CMD_BEGIN)
+#define OTA_STATUS_IDLE 0
+#define OTA_STATUS_RECEIVING 1
+#define OTA_STATUS_RESYNC 2 // continue from received
+#define OTA_STATUS_VERIFYING 3
+#define OTA_STATUS_VERIFIED 4
+#define OTA_STATUS_ERROR_SIZE 5 // doesn't fit the staging slot
+#define OTA_STATUS_ERROR_CRC 6
+#define OTA_STATUS_ERROR_STATE 7 // command not valid right now
+#define OTA_STATUS_LEN 9
+
+#define OTA_DATA_HEADER_LEN 4
+
+#define OTA_BUFFER_SIZE FLASH_SECTOR_SIZE
+#define OTA_WINDOW_SIZE OTA_BUFFER_SIZE
+#define OTA_ERASE_AHEAD (4u * FLASH_SECTOR_SIZE)
+
+// Flash read per ota_poll() while verifying
+#define OTA_VERIFY_CHUNK_SIZE (4u * 1024)
+
+#define OTA_NO_BUFFER -1
+
+typedef struct
+{
+  att_service_handler_t handler;
+  hci_con_handle_t con_handle;
+  uint16_t control_value_handle;
+  uint16_t control_ccc_handle;
+  uint16_t data_value_handle;
+  uint16_t control_ccc;
+  // Called when an update starts and when it ends, successful or not, so the
+  // application can ask for a short connection interval and the full clock
+  void (*active_changed)(hci_con_handle_t con_handle, int active);
+  // Called when ota_poll() has new flash work, so it can be run soon
+  void (*work_pending)();
+
+  int status;
+  uint32_t image_size;
+  uint32_t image_crc;
+  uint64_t start_us;
+  uint32_t elapsed_ms; // frozen once the image is verified
+
+  uint32_t received;   // image bytes accepted, in order
+  uint32_t programmed; // image bytes in flash
+  uint32_t erased;     // staging bytes erased, a multiple of FLASH_SECTOR_SIZE
+  uint32_t verified;
+  uint32_t crc;
+  int apply_pending;
+
+  uint8_t buffers[2][OTA_BUFFER_SIZE] __attribute__((aligned(4)));
+  int fill_buffer;
+  uint32_t fill_len;
+  int program_buffer; // OTA_NO_BUFFER while nothing waits to be programmed
+  uint32_t program_len;
+  uint32_t program_pos;
+
+  int notify_pending;
+  btstack_context_callback_registration_t notify_request;
+} Ota;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+// 4e540010-6e65-7920-7461-636b00000000 and up, big-endian
+static const uint8_t ota_service_uuid128[] = {0x4e, 0x54, 0x00, 0x10, 0x6e, 0x65, 0x79, 0x20,
+                                              0x74, 0x61, 0x63, 0x6b, 0x00, 0x00, 0x00, 0x00};
+
+static Ota ota;
+
+// End of the running image in flash, from the linker script
+extern char __flash_binary_end;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void ota_init(void (*active_changed)(hci_con_handle_t con_handle, int active), void (*work_pending)());
+void ota_poll();
+int ota_active();
+int ota_busy();
+void ota_disconnected(hci_con_handle_t con_handle);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// CRC-32 (IEEE 802.3, as zlib), a nibble at a time
+static uint32_t ota_crc32_update(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+  static const uint32_t table[16] = {
+      0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+      0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+  };
+
+  crc = ~crc;
+  for (uint32_t i = 0; i < len; i++)
+  {
+    crc = (crc >> 4) ^ table[(crc ^ data[i]) & 0x0f];
+    crc = (crc >> 4) ^ table[(crc ^ (data[i] >> 4)) & 0x0f];
+  }
+  return ~crc;
+}
+
+static inline uint32_t ota_running_image_size()
+{
+  return (uint32_t)((uintptr_t)&__flash_binary_end - XIP_BASE);
+}
+
+static void ota_can_send_now(void *context)
+{
+  UNUSED(context);
+
+  uint8_t status[OTA_STATUS_LEN];
+
+  ota.notify_pending = 0;
+  if (ota.con_handle == HCI_CON_HANDLE_INVALID ||
+      !(ota.control_ccc & GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION))
+  {
+    return;
+  }
+
+  // Always the newest status, a burst of updates goes out as one
+  status[0] = ota.status;
+  little_endian_store_32(status, 1, ota.received);
+  little_endian_store_32(status, 5, ota.elapsed_ms);
+  att_server_notify(ota.con_handle, ota.control_value_handle, status, sizeof(status));
+}
+
+static void ota_set_status(int status)
+{
+  ota.status = status;
+  if (status != OTA_STATUS_VERIFIED)
+  {
+    ota.elapsed_ms = (uint32_t)((time_us_64() - ota.start_us) / 1000);
+  }
+
+  if (ota.con_handle == HCI_CON_HANDLE_INVALID || ota.notify_pending)
+  {
+    return;
+  }
+  ota.notify_pending = 1;
+  att_server_request_to_send_notification(&ota.notify_request, ota.con_handle);
+}
+
+static void ota_wake()
+{
+  if (ota.work_pending)
+  {
+    ota.work_pending();
+  }
+}
+
+static void ota_end()
+{
+  hci_con_handle_t con_handle = ota.con_handle;
+
+  ota.fill_buffer = 0;
+  ota.fill_len = 0;
+  ota.program_buffer = OTA_NO_BUFFER;
+  if (ota.active_changed)
+  {
+    ota.active_changed(con_handle, 0);
+  }
+}
+
+static int ota_begin(const uint8_t *data, uint16_t len)
+{
+  if (len < 9)
+  {
+    return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+  }
+
+  // The ATT database enforces this too, in case the flags get lost
+  if (gap_encryption_key_size(ota.con_handle) == 0)
+  {
+    printf("OTA: refused, link not encrypted\n");
+    return ATT_ERROR_INSUFFICIENT_ENCRYPTION;
+  }
+
+  int was_active = ota_active();
+
+  ota.image_size = little_endian_read_32(data, 1);
+  ota.image_crc = little_endian_read_32(data, 5);
+  ota.start_us = time_us_64();
+  ota.received = 0;
+  ota.programmed = 0;
+  ota.erased = 0;
+  ota.verified = 0;
+  ota.crc = 0;
+  ota.fill_buffer = 0;
+  ota.fill_len = 0;
+  ota.program_buffer = OTA_NO_BUFFER;
+
+  // The staging slot must neither overlap the running image nor the log
+  if (ota.image_size == 0 || ota.image_size > OTA_SLOT_SIZE || ota_running_image_size() > OTA_STAGING_FLASH_OFFSET)
+  {
+    printf("OTA: image of %" PRIu32 " bytes doesn't fit\n", ota.image_size);
+    ota_set_status(OTA_STATUS_ERROR_SIZE);
+    if (was_active)
+    {
+      ota_end();
+    }
+    return 0;
+  }
+
+  printf("OTA: receiving %" PRIu32 " bytes\n", ota.image_size);
+  ota_set_status(OTA_STATUS_RECEIVING);
+  if (!was_active && ota.active_changed)
+  {
+    ota.active_changed(ota.con_handle, 1);
+  }
+  ota_wake();
+  return 0;
+}
+
+static int ota_control_written(const uint8_t *data, uint16_t len)
+{
+  if (len < 1)
+  {
+    return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+  }
+
+  switch (data[0])
+  {
+  case OTA_CMD_BEGIN:
+    return ota_begin(data, len);
+
+  case OTA_CMD_ABORT:
+    if (ota_active())
+    {
+      printf("OTA: aborted\n");
+      ota_set_status(OTA_STATUS_IDLE);
+      ota_end();
+    }
+    return 0;
+
+  case OTA_CMD_APPLY:
+    if (ota.status != OTA_STATUS_VERIFIED)
+    {
+      ota_set_status(OTA_STATUS_ERROR_STATE);
+      return 0;
+    }
+    // Answer the write first, the copy starts from ota_poll()
+    ota.apply_pending = 1;
+    ota_wake();
+    return 0;
+
+  default:
+    return ATT_ERROR_REQUEST_NOT_SUPPORTED;
+  }
+}
+
+static void ota_resync()
+{
+  // Once is enough, whatever else is in flight is dropped as well
+  if (ota.status != OTA_STATUS_RESYNC)
+  {
+    ota_set_status(OTA_STATUS_RESYNC);
+  }
+}
+
+// Hands the filled buffer to ota_poll() and acknowledges it
+static void ota_hand_off()
+{
+  ota.program_buffer = ota.fill_buffer;
+  ota.program_len = ota.fill_len;
+  ota.program_pos = 0;
+  ota.fill_buffer ^= 1;
+  ota.fill_len = 0;
+  ota_set_status(OTA_STATUS_RECEIVING);
+  ota_wake();
+}
+
+static void ota_data_written(const uint8_t *data, uint16_t len)
+{
+  if ((ota.status != OTA_STATUS_RECEIVING && ota.status != OTA_STATUS_RESYNC) || len < OTA_DATA_HEADER_LEN)
+  {
+    return;
+  }
+
+  uint32_t offset = little_endian_read_32(data, 0);
+  data += OTA_DATA_HEADER_LEN;
+  len -= OTA_DATA_HEADER_LEN;
+
+  if (offset != ota.received)
+  {
+    // Packets sent before the phone saw our last resync, or lost ones
+    ota_resync();
+    return;
+  }
+
+  uint32_t left = ota.image_size - ota.received;
+  if (len > left)
+  {
+    len = left;
+  }
+
+  while (len > 0)
+  {
+    if (ota.fill_len == OTA_BUFFER_SIZE)
+    {
+      // Both buffers busy, the phone is running ahead of the flash
+      ota_resync();
+      return;
+    }
+
+    uint32_t n = btstack_min(len, OTA_BUFFER_SIZE - ota.fill_len);
+    memcpy(ota.buffers[ota.fill_buffer] + ota.fill_len, data, n);
+    ota.fill_len += n;
+    ota.received += n;
+    data += n;
+    len -= n;
+
+    int last = ota.received == ota.image_size;
+    if ((ota.fill_len == OTA_BUFFER_SIZE || last) && ota.program_buffer == OTA_NO_BUFFER)
+    {
+      ota_hand_off();
+    }
+  }
+}
+
+static uint16_t ota_read_callback(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t offset,
+                                  uint8_t *buffer, uint16_t buffer_size)
+{
+  UNUSED(con_handle);
+
+  if (attribute_handle == ota.control_ccc_handle)
+  {
+    uint8_t ccc[2];
+    little_endian_store_16(ccc, 0, ota.control_ccc);
+    return att_read_callback_handle_blob(ccc, sizeof(ccc), offset, buffer, buffer_size);
+  }
+  return 0;
+}
+
+static int ota_write_callback(hci_con_handle_t con_handle, uint16_t attribute_handle, uint16_t transaction_mode,
+                              uint16_t offset, uint8_t *buffer, uint16_t buffer_size)
+{
+  if (transaction_mode != ATT_TRANSACTION_MODE_NONE || offset != 0)
+  {
+    return ATT_ERROR_REQUEST_NOT_SUPPORTED;
+  }
+
+  if (attribute_handle == ota.data_value_handle)
+  {
+    ota_data_written(buffer, buffer_size);
+    return 0;
+  }
+
+  ota.con_handle = con_handle;
+
+  if (attribute_handle == ota.control_ccc_handle)
+  {
+    if (buffer_size < 2)
+    {
+      return ATT_ERROR_INVALID_ATTRIBUTE_VALUE_LENGTH;
+    }
+    ota.control_ccc = little_endian_read_16(buffer, 0);
+    return 0;
+  }
+
+  if (attribute_handle == ota.control_value_handle)
+  {
+    return ota_control_written(buffer, buffer_size);
+  }
+
+  return 0;
+}
+
+// Copies the staging slot over the running image and resets. Runs from RAM
+// with interrupts off and must not call anything in flash, which is being
+// overwritten: flash_range_erase() and flash_range_program() live in RAM.
+static void __not_in_flash_func(ota_copy_and_reboot)(uint32_t size)
+{
+  uint32_t *buffer = (uint32_t *)ota.buffers[0];
+
+  save_and_disable_interrupts();
+
+  for (uint32_t offset = 0; offset < size; offset += FLASH_SECTOR_SIZE)
+  {
+    // volatile keeps the compiler from turning this into a memcpy() call
+    const volatile uint32_t *from = (const volatile uint32_t *)(XIP_BASE + OTA_STAGING_FLASH_OFFSET + offset);
+    for (uint32_t i = 0; i < FLASH_SECTOR_SIZE / 4; i++)
+    {
+      buffer[i] = from[i];
+    }
+
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+    flash_range_program(offset, (const uint8_t *)buffer, FLASH_SECTOR_SIZE);
+  }
+
+  // watchdog_reboot() is in flash, trigger the reset directly
+  watchdog_hw->ctrl = WATCHDOG_CTRL_TRIGGER_BITS;
+  while (1)
+  {
+  }
+}
+
+void ota_init(void (*active_changed)(hci_con_handle_t con_handle, int active), void (*work_pending)())
+{
+  uint16_t start_handle = 0;
+  uint16_t end_handle = 0xffff;
+  uint8_t uuid128[16];
+
+  ota.con_handle = HCI_CON_HANDLE_INVALID;
+  ota.active_changed = active_changed;
+  ota.work_pending = work_pending;
+  ota.status = OTA_STATUS_IDLE;
+  ota.program_buffer = OTA_NO_BUFFER;
+  ota.notify_request.callback = &ota_can_send_now;
+
+  if (!gatt_server_get_handle_range_for_service_with_uuid128(ota_service_uuid128, &start_handle, &end_handle))
+  {
+    printf("OTA service missing from the ATT DB\n");
+    return;
+  }
+
+  memcpy(uuid128, ota_service_uuid128, sizeof(uuid128));
+  uuid128[3] = 0x11;
+  ota.control_value_handle =
+      gatt_server_get_value_handle_for_characteristic_with_uuid128(start_handle, end_handle, uuid128);
+  ota.control_ccc_handle =
+      gatt_server_get_client_configuration_handle_for_characteristic_with_uuid128(start_handle, end_handle, uuid128);
+  uuid128[3] = 0x12;
+  ota.data_value_handle = gatt_server_get_value_handle_for_characteristic_with_uuid128(start_handle, end_handle, uuid128);
+
+  ota.handler.start_handle = start_handle;
+  ota.handler.end_handle = end_handle;
+  ota.handler.read_callback = &ota_read_callback;
+  ota.handler.write_callback = &ota_write_callback;
+  att_server_register_service_handler(&ota.handler);
+}
+
+static void ota_erase_sector()
+{
+  uint32_t ints = save_and_disable_interrupts();
+  flash_range_erase(OTA_STAGING_FLASH_OFFSET + ota.erased, FLASH_SECTOR_SIZE);
+  restore_interrupts(ints);
+  ota.erased += FLASH_SECTOR_SIZE;
+}
+
+// Sectors the image will need soon are still to be erased
+static int ota_erase_due()
+{
+  return (ota.status == OTA_STATUS_RECEIVING || ota.status == OTA_STATUS_RESYNC) &&
+         ota.erased < btstack_min(ota.programmed + OTA_ERASE_AHEAD, ota.image_size);
+}
+
+// Does one step of flash work: program a page, erase a sector or check the
+// CRC of a chunk. Call again right away while ota_busy().
+void ota_poll()
+{
+  if (ota.apply_pending)
+  {
+    printf("OTA: installing %" PRIu32 " bytes, rebooting\n", ota.image_size);
+    ota_copy_and_reboot(ota.image_size);
+  }
+
+  if (ota.program_buffer != OTA_NO_BUFFER)
+  {
+    uint32_t flash_offset = ota.programmed;
+
+    if (flash_offset >= ota.erased)
+    {
+      ota_erase_sector();
+      return;
+    }
+
+    // The last page of the image may be short. Programming it whole is
+    // fine, the bytes past the image are never looked at
+    uint32_t n = btstack_min(FLASH_PAGE_SIZE, ota.program_len - ota.program_pos);
+    uint32_t ints = save_and_disable_interrupts();
+    flash_range_program(OTA_STAGING_FLASH_OFFSET + flash_offset, ota.buffers[ota.program_buffer] + ota.program_pos,
+                        FLASH_PAGE_SIZE);
+    restore_interrupts(ints);
+
+    ota.program_pos += n;
+    ota.programmed += n;
+    if (ota.program_pos < ota.program_len)
+    {
+      return;
+    }
+
+    // Buffer done, take the other one if it has filled up meanwhile
+    ota.program_buffer = OTA_NO_BUFFER;
+    if (ota.fill_len == OTA_BUFFER_SIZE || (ota.fill_len > 0 && ota.received == ota.image_size))
+    {
+      ota_hand_off();
+      return;
+    }
+
+    if (ota.programmed == ota.image_size)
+    {
+      ota_set_status(OTA_STATUS_VERIFYING);
+    }
+    return;
+  }
+
+  if (ota_erase_due())
+  {
+    // Nothing to program yet, get the next sectors ready meanwhile
+    ota_erase_sector();
+    return;
+  }
+
+  if (ota.status == OTA_STATUS_VERIFYING)
+  {
+    uint32_t n = btstack_min(OTA_VERIFY_CHUNK_SIZE, ota.image_size - ota.verified);
+    const uint8_t *staged = (const uint8_t *)(XIP_BASE + OTA_STAGING_FLASH_OFFSET + ota.verified);
+    ota.crc = ota_crc32_update(ota.crc, staged, n);
+    ota.verified += n;
+    if (ota.verified < ota.image_size)
+    {
+      return;
+    }
+
+    uint32_t elapsed_ms = (uint32_t)((time_us_64() - ota.start_us) / 1000);
+    if (ota.crc != ota.image_crc)
+    {
+      printf("OTA: CRC %08" PRIx32 ", expected %08" PRIx32 "\n", ota.crc, ota.image_crc);
+      ota_set_status(OTA_STATUS_ERROR_CRC);
+      ota_end();
+      return;
+    }
+
+    printf("OTA: %" PRIu32 " bytes verified in %" PRIu32 " ms, %" PRIu32 " B/s\n", ota.image_size, elapsed_ms,
+           elapsed_ms ? (uint32_t)((uint64_t)ota.image_size * 1000 / elapsed_ms) : 0);
+    ota.elapsed_ms = elapsed_ms;
+    ota_set_status(OTA_STATUS_VERIFIED);
+    ota_end();
+  }
+}
+
+// An update is being received or checked
+int ota_active()
+{
+  return ota.status == OTA_STATUS_RECEIVING || ota.status == OTA_STATUS_RESYNC || ota.status == OTA_STATUS_VERIFYING;
+}
+
+// ota_poll() has flash work to do, don't sleep
+int ota_busy()
+{
+  return ota.program_buffer != OTA_NO_BUFFER || ota_erase_due() || ota.status == OTA_STATUS_VERIFYING ||
+         ota.apply_pending;
+}
+
+// An update can't continue on another connection
+void ota_disconnected(hci_con_handle_t con_handle)
+{
+  if (con_handle != ota.con_handle)
+  {
+    return;
+  }
+
+  ota.con_handle = HCI_CON_HANDLE_INVALID;
+  ota.control_ccc = 0;
+  ota.notify_pending = 0;
+  if (ota_active())
+  {
+    printf("OTA: connection lost after %" PRIu32 " bytes\n", ota.received);
+    ota.status = OTA_STATUS_IDLE;
+    ota_end();
+  }
+  // A verified image is dropped too, APPLY has to come on the connection
+  // that sent it
+  if (!ota.apply_pending)
+  {
+    ota.status = OTA_STATUS_IDLE;
+  }
+}
+
+#endif
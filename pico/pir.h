@@ -0,0 +1,268 @@
+// *****************************************************************************
+// PIR edge capture
+//
+// The PIR output is not sampled: every edge raises a GPIO interrupt, which
+// timestamps it and puts it in a queue that the application drains with
+// pir_pop(). The queue has a single writer (the interrupt) and a single
+// reader (the application), so it needs no locking. Short pulses between two
+// light samples are seen this way, and the time of an edge is exact to the
+// interrupt latency.
+//
+// An edge closer than debounce_us to the last one that was queued is dropped
+// as a bounce. Once the pin has been quiet for debounce_us, pir_check()
+// queues its level if the bounces left it different from the last edge.
+//
+// Rising edges are counted per PIR_WINDOW_MS window, a measure of how busy
+// the area in front of the sensor is.
+// *****************************************************************************
+#ifndef PIR_H
+#define PIR_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+// Edges waiting for pir_pop(), a power of two
+#ifndef PIR_QUEUE_SIZE
+#define PIR_QUEUE_SIZE 32
+#endif
+
+#ifndef PIR_DEBOUNCE_US
+#define PIR_DEBOUNCE_US 20000
+#endif
+
+#ifndef PIR_WINDOW_MS
+#define PIR_WINDOW_MS 60000
+#endif
+
+// pir_check() returns this when the pin has settled
+#define PIR_SETTLED UINT64_MAX
+
+typedef struct
+{
+  uint64_t time_us;
+  uint8_t level;
+} PirEdge;
+
+typedef struct
+{
+  uint pin;
+  uint32_t debounce_us;
+
+  // Written by the interrupt (or with interrupts disabled)
+  PirEdge queue[PIR_QUEUE_SIZE];
+  volatile uint32_t head;
+  uint8_t queued_level;     // of the last edge queued
+  uint64_t queued_us;       // when that edge came
+  uint64_t last_irq_us;     // last interrupt, queued or not
+  volatile int unsettled;   // an edge was dropped since the last pir_check()
+  volatile uint32_t bounces;
+  volatile uint32_t overflows;
+
+  // Written by the reader
+  volatile uint32_t tail;
+  uint8_t level; // of the last edge popped
+  int motion;    // rising edge popped since pir_take_motion()
+  uint32_t edges;
+  uint64_t window_start_us;
+  uint16_t window_count;      // rising edges in the current window
+  uint16_t last_window_count; // and in the one before
+} Pir;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static Pir pir;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void pir_init(uint pin, uint32_t debounce_us);
+void pir_gpio_event(uint32_t events);
+int pir_pop(PirEdge *edge);
+uint64_t pir_check(uint64_t now_us);
+int pir_take_motion();
+uint16_t pir_window_count(uint64_t now_us);
+void pir_stats_print();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// Writer side, from the interrupt or with interrupts disabled
+static void pir_push(uint64_t time_us, uint8_t level)
+{
+  uint32_t head = pir.head;
+
+  if (head - pir.tail == PIR_QUEUE_SIZE)
+  {
+    // The reader is behind, pir_check() catches up with the pin later
+    pir.overflows++;
+    pir.unsettled = 1;
+    return;
+  }
+
+  pir.queue[head % PIR_QUEUE_SIZE].time_us = time_us;
+  pir.queue[head % PIR_QUEUE_SIZE].level = level;
+  __compiler_memory_barrier();
+  pir.head = head + 1;
+
+  pir.queued_level = level;
+  pir.queued_us = time_us;
+}
+
+static void pir_window_roll(uint64_t now_us)
+{
+  const uint64_t window_us = PIR_WINDOW_MS * 1000ull;
+
+  if (now_us < pir.window_start_us + window_us)
+  {
+    return;
+  }
+
+  // More than one window over means the one before now saw nothing
+  pir.last_window_count = now_us < pir.window_start_us + 2 * window_us ? pir.window_count : 0;
+  pir.window_start_us += (now_us - pir.window_start_us) / window_us * window_us;
+  pir.window_count = 0;
+}
+
+// Configures the pin, the caller enables its interrupts for both edges
+void pir_init(uint pin, uint32_t debounce_us)
+{
+  gpio_init(pin);
+  gpio_pull_down(pin);
+  gpio_set_dir(pin, GPIO_IN);
+
+  uint64_t now_us = time_us_64();
+
+  pir.pin = pin;
+  pir.debounce_us = debounce_us;
+  pir.queued_level = gpio_get(pin);
+  pir.queued_us = now_us;
+  pir.last_irq_us = now_us;
+  pir.level = pir.queued_level;
+  pir.window_start_us = now_us;
+}
+
+// Call from the GPIO interrupt with the events of the PIR pin
+void pir_gpio_event(uint32_t events)
+{
+  uint64_t now_us = time_us_64();
+  uint8_t level;
+
+  if ((events & (GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL)) == GPIO_IRQ_EDGE_RISE)
+  {
+    level = 1;
+  }
+  else if ((events & (GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL)) == GPIO_IRQ_EDGE_FALL)
+  {
+    level = 0;
+  }
+  else
+  {
+    // Both since the interrupt was last served, only the pin knows the order
+    level = gpio_get(pir.pin);
+  }
+
+  pir.last_irq_us = now_us;
+
+  if (level == pir.queued_level || now_us - pir.queued_us < pir.debounce_us)
+  {
+    pir.bounces++;
+    pir.unsettled = 1;
+    return;
+  }
+
+  pir_push(now_us, level);
+}
+
+// Takes the oldest edge off the queue. Returns 0 if there is none.
+int pir_pop(PirEdge *edge)
+{
+  uint32_t tail = pir.tail;
+
+  if (tail == pir.head)
+  {
+    return 0;
+  }
+
+  __compiler_memory_barrier();
+  *edge = pir.queue[tail % PIR_QUEUE_SIZE];
+  __compiler_memory_barrier();
+  pir.tail = tail + 1;
+
+  pir.level = edge->level;
+  pir.edges++;
+  if (edge->level)
+  {
+    pir.motion = 1;
+    pir_window_roll(edge->time_us);
+    pir.window_count++;
+  }
+  return 1;
+}
+
+// Queues the pin level if edges were dropped and it has been quiet for the
+// debounce time since. Returns when to check again, PIR_SETTLED if there is
+// nothing to wait for.
+uint64_t pir_check(uint64_t now_us)
+{
+  if (!pir.unsettled)
+  {
+    return PIR_SETTLED;
+  }
+
+  uint32_t ints = save_and_disable_interrupts();
+  uint64_t settle_us = pir.last_irq_us + pir.debounce_us;
+
+  if (now_us < settle_us)
+  {
+    restore_interrupts(ints);
+    return settle_us;
+  }
+
+  pir.unsettled = 0;
+  uint8_t level = gpio_get(pir.pin);
+  if (level != pir.queued_level)
+  {
+    // The pin has kept this level since the last interrupt
+    pir_push(pir.last_irq_us, level);
+  }
+  restore_interrupts(ints);
+
+  return pir.unsettled ? now_us + pir.debounce_us : PIR_SETTLED;
+}
+
+// Motion since the last call: the PIR is high or was high in between
+int pir_take_motion()
+{
+  int motion = pir.level || pir.motion;
+
+  pir.motion = 0;
+  return motion;
+}
+
+// Rising edges in the current window
+uint16_t pir_window_count(uint64_t now_us)
+{
+  pir_window_roll(now_us);
+  return pir.window_count;
+}
+
+void pir_stats_print()
+{
+  pir_window_roll(time_us_64());
+
+  printf("PIR: %" PRIu32 " edges, %" PRIu32 " bounces, %" PRIu32 " overflows, %u in the last window\n", pir.edges,
+         pir.bounces, pir.overflows, pir.last_window_count);
+}
+
+#endif
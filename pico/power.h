@@ -0,0 +1,257 @@
+// *****************************************************************************
+// Power manager
+//
+// Most of the time the firmware only waits: for the next sensor sample, for a
+// BLE event or for the next pattern step. The power manager runs the system
+// clock at POWER_CLOCK_REDUCED_KHZ while nothing needs speed and switches to
+// POWER_CLOCK_FULL_KHZ while something has asked for it (BLE bursts like a
+// log download, pattern playback). In between events the core sleeps in WFE
+// and wakes on the next deadline, on a GPIO edge (PIR, light sensor INT) or
+// when the async context (CYW43, BTstack) has work or a timeout due.
+//
+// Time spent in each state is accumulated so battery life can be estimated.
+// *****************************************************************************
+#ifndef POWER_H
+#define POWER_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "pico/stdlib.h"
+#include "pico/async_context.h"
+#include "hardware/clocks.h"
+#include "hardware/gpio.h"
+#include "hardware/uart.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#ifndef POWER_CLOCK_FULL_KHZ
+#define POWER_CLOCK_FULL_KHZ 125000
+#endif
+
+#ifndef POWER_CLOCK_REDUCED_KHZ
+#define POWER_CLOCK_REDUCED_KHZ 48000
+#endif
+
+#define POWER_STATE_FULL 0
+#define POWER_STATE_REDUCED 1
+#define POWER_STATE_SLEEP 2
+#define POWER_NUM_STATES 3
+
+// Reasons to run at full speed, combined as a bit mask
+#define POWER_DEMAND_BLE (1u << 0)
+#define POWER_DEMAND_PATTERN (1u << 1)
+#define POWER_DEMAND_OTA (1u << 2)
+
+#define POWER_NO_WAKE_GPIO 0xFF
+
+typedef struct
+{
+  int state;
+  int awake_state; // FULL or REDUCED, where we return to after sleeping
+  uint32_t demand;
+  uint64_t state_since_us;
+  volatile int wake_event;
+  volatile uint8_t wake_gpio;
+  void (*clock_changed)(); // re-applies clock dependent settings (i2c baudrate, ...)
+  void (*gpio_event)(uint gpio, uint32_t events); // called from the GPIO interrupt
+  async_context_t *context;
+  async_when_pending_worker_t wake_worker; // wakes the context on a GPIO edge
+} PowerManager;
+
+typedef struct
+{
+  uint64_t state_us[POWER_NUM_STATES];
+  uint32_t sleeps;
+  uint32_t gpio_wakeups;
+  uint32_t clock_switches;
+} PowerStats;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static PowerManager power;
+PowerStats power_stats;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void power_init(void (*clock_changed)(), async_context_t *context);
+void power_add_wake_gpio(uint gpio, uint32_t events);
+void power_set_gpio_handler(void (*gpio_event)(uint gpio, uint32_t events));
+void power_request(uint32_t demand);
+void power_release(uint32_t demand);
+uint8_t power_sleep_until_us(uint64_t wake_us);
+void power_stats_update();
+void power_stats_print();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+static void power_enter_state(int state)
+{
+  uint64_t now_us = time_us_64();
+
+  power_stats.state_us[power.state] += now_us - power.state_since_us;
+  power.state_since_us = now_us;
+  power.state = state;
+}
+
+static void power_set_clock(int state)
+{
+  if (state == power.awake_state)
+  {
+    return;
+  }
+
+  set_sys_clock_khz(state == POWER_STATE_FULL ? POWER_CLOCK_FULL_KHZ : POWER_CLOCK_REDUCED_KHZ, true);
+
+  // clk_peri follows clk_sys, so the UART needs its divider recalculated
+  uart_set_baudrate(uart_default, PICO_DEFAULT_UART_BAUD_RATE);
+
+  if (power.clock_changed)
+  {
+    power.clock_changed();
+  }
+
+  power.awake_state = state;
+  power_stats.clock_switches++;
+  power_enter_state(state);
+}
+
+static void power_gpio_callback(uint gpio, uint32_t events)
+{
+  power.wake_gpio = gpio;
+  power.wake_event = 1;
+
+  if (power.gpio_event)
+  {
+    power.gpio_event(gpio, events);
+  }
+
+  if (power.context)
+  {
+    async_context_set_work_pending(power.context, &power.wake_worker);
+  }
+}
+
+static void power_wake_worker(async_context_t *context, async_when_pending_worker_t *worker)
+{
+  (void)context;
+  (void)worker;
+
+  // Nothing to do, power_sleep_until_us() returning is the point
+}
+
+// Boot runs at full speed, power_init() drops to the reduced clock unless
+// something asked for more in the meantime (power_request() works before
+// power_init()). clock_changed is called after every clock switch. If context
+// is set, sleeping also ends when it has work to do.
+void power_init(void (*clock_changed)(), async_context_t *context)
+{
+  power.state = POWER_STATE_FULL;
+  power.awake_state = POWER_STATE_FULL;
+  power.state_since_us = time_us_64();
+  power.wake_gpio = POWER_NO_WAKE_GPIO;
+  power.clock_changed = clock_changed;
+  power.context = context;
+
+  if (context)
+  {
+    power.wake_worker.do_work = &power_wake_worker;
+    async_context_add_when_pending_worker(context, &power.wake_worker);
+  }
+
+  if (power.demand == 0)
+  {
+    power_set_clock(POWER_STATE_REDUCED);
+  }
+}
+
+// Wakes the core from power_sleep_until_us() on the given GPIO events
+void power_add_wake_gpio(uint gpio, uint32_t events)
+{
+  gpio_set_irq_enabled_with_callback(gpio, events, true, &power_gpio_callback);
+}
+
+// The SDK has one GPIO callback per core and it is ours, this passes the
+// events of the wake GPIOs on. gpio_event runs in the interrupt.
+void power_set_gpio_handler(void (*gpio_event)(uint gpio, uint32_t events))
+{
+  power.gpio_event = gpio_event;
+}
+
+void power_request(uint32_t demand)
+{
+  power.demand |= demand;
+  power_set_clock(POWER_STATE_FULL);
+}
+
+void power_release(uint32_t demand)
+{
+  power.demand &= ~demand;
+  if (power.demand == 0)
+  {
+    power_set_clock(POWER_STATE_REDUCED);
+  }
+}
+
+// Sleeps until wake_us, until a wake GPIO fires or until the async context
+// has work. Returns the GPIO that woke us, POWER_NO_WAKE_GPIO otherwise.
+uint8_t power_sleep_until_us(uint64_t wake_us)
+{
+  absolute_time_t until = from_us_since_boot(wake_us);
+
+  power_enter_state(POWER_STATE_SLEEP);
+  power_stats.sleeps++;
+
+  if (power.context)
+  {
+    if (!power.wake_event)
+    {
+      async_context_wait_for_work_until(power.context, until);
+    }
+  }
+  else
+  {
+    while (!power.wake_event && !best_effort_wfe_or_timeout(until))
+    {
+      // Woken by some other interrupt, go back to sleep
+    }
+  }
+
+  uint8_t gpio = POWER_NO_WAKE_GPIO;
+  if (power.wake_event)
+  {
+    gpio = power.wake_gpio;
+    power.wake_event = 0;
+    power_stats.gpio_wakeups++;
+  }
+
+  power_enter_state(power.awake_state);
+
+  return gpio;
+}
+
+// Adds the time spent in the current state so far to the totals
+void power_stats_update()
+{
+  power_enter_state(power.state);
+}
+
+void power_stats_print()
+{
+  power_stats_update();
+
+  printf("Power: full %" PRIu32 " ms, reduced %" PRIu32 " ms, sleep %" PRIu32 " ms, %" PRIu32 " sleeps, %" PRIu32 " gpio wakeups, %" PRIu32 " clock switches\n",
+         (uint32_t)(power_stats.state_us[POWER_STATE_FULL] / 1000),
+         (uint32_t)(power_stats.state_us[POWER_STATE_REDUCED] / 1000),
+         (uint32_t)(power_stats.state_us[POWER_STATE_SLEEP] / 1000),
+         power_stats.sleeps, power_stats.gpio_wakeups, power_stats.clock_switches);
+}
+
+#endif
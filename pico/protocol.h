@@ -0,0 +1,98 @@
+// *****************************************************************************
+// SPP protocol
+//
+// Every notification sent on the Nordic SPP RX characteristic starts with a
+// frame type byte, every write to the TX characteristic with a command byte.
+// Multi-byte fields are little-endian unless stated otherwise.
+// *****************************************************************************
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// *****************************************************************************
+// Frames (device -> app)
+// *****************************************************************************
+
+// 'S' active u8, flash_index u8, pattern_length u8, pattern u16[16] (big-endian),
+// envelope u8[16] (LED_ENVELOPE_* per step, see led_pwm.h)
+#define FRAME_TYPE_STATE 'S'
+
+// 'L' offset u32, log bytes. A frame without log bytes ends the download.
+#define FRAME_TYPE_LOG 'L'
+
+// Live sample stream, see telemetry.h
+#define FRAME_TYPE_SAMPLES_RAW 'R'
+#define FRAME_TYPE_SAMPLES 'T'
+
+// 'P' full_ms u32, reduced_ms u32, sleep_ms u32, gpio_wakeups u32. Time spent
+// in each power state since boot, sent once per CMD_POWER_STATS.
+#define FRAME_TYPE_POWER_STATS 'P'
+
+// 'B' ms u16[9]. When each boot phase was reached, see boot_profile.h for the
+// order. 0 if not reached yet, 0xFFFF if later than that.
+#define FRAME_TYPE_BOOT_PROFILE 'B'
+
+// 'Y' phone_ms u32, local_us u32. Answers CMD_TIME_PING: the phone's time
+// from the ping and the low 32 bits of our clock when the ping arrived.
+#define FRAME_TYPE_TIME_PONG 'Y'
+
+// 'X' offset u32, trace records (see trace.h). A frame without records ends
+// the download.
+#define FRAME_TYPE_TRACE 'X'
+
+// 'A' stack_size u16, stack_peak u16, static_bytes u32, heap_bytes u32,
+// free_bytes u32, subsystem_bytes u32[9] (MEMORY_SUBSYSTEM_* order, see
+// memory_budget.h). Subsystems that don't fit the MTU are left out. Only
+// built with MEMORY_BUDGET.
+#define FRAME_TYPE_MEMORY 'A'
+
+// 'M' level u8, time_us u32, edges u8, window_count u16. The latest PIR edge,
+// with the low 32 bits of our clock when it happened (as in
+// FRAME_TYPE_TIME_PONG), how many edges came since the last motion frame
+// (more than 1 if they came faster than frames go out) and the rising edges
+// in the current PIR_WINDOW_MS window. Sent while notifications are enabled.
+#define FRAME_TYPE_MOTION 'M'
+
+// *****************************************************************************
+// Commands (app -> device)
+// *****************************************************************************
+
+// Toggles STATE.active
+#define CMD_TOGGLE_ACTIVE 42
+
+// 'W' length u8, length x (duration_ms u16, envelope u8). Replaces the
+// pattern, which is kept across power cycles.
+#define CMD_SET_PATTERN 'W'
+
+// 'D' offset u32 (optional). Streams the sample log from offset on, pass the
+// offset after the last received byte to resume an interrupted download.
+#define CMD_LOG_DOWNLOAD 'D'
+
+// 'M' mode u8, latency_ms u16 (optional). Selects the live sample stream
+// encoding, one of the TELEMETRY_MODE_* values, and how long a sample may wait
+// for a fuller frame (1000 ms if left out, 60000 at most). Also forces a
+// keyframe.
+#define CMD_STREAM_MODE 'M'
+
+// 'P'. Requests one FRAME_TYPE_POWER_STATS frame.
+#define CMD_POWER_STATS 'P'
+
+// 'B'. Requests one FRAME_TYPE_BOOT_PROFILE frame.
+#define CMD_BOOT_PROFILE 'B'
+
+// 'Y' phone_ms u32. Time sync ping, answered with FRAME_TYPE_TIME_PONG. See
+// sync_clock.h.
+#define CMD_TIME_PING 'Y'
+
+// 'O' local_us u32, shared_ms u32. The shared time was shared_ms when our
+// clock read local_us (as sent in a FRAME_TYPE_TIME_PONG). Aligns pattern
+// playback across units synced from the same phone.
+#define CMD_TIME_SET 'O'
+
+// 'X' offset u32 (optional). Streams the trace capture from offset on, see
+// trace.h. Like CMD_LOG_DOWNLOAD it can be resumed.
+#define CMD_TRACE_DOWNLOAD 'X'
+
+// 'A'. Requests one FRAME_TYPE_MEMORY frame, ignored without MEMORY_BUDGET.
+#define CMD_MEMORY_REPORT 'A'
+
+#endif
@@ -0,0 +1,390 @@
+// *****************************************************************************
+// Fast reconnect
+//
+// Phones bond with us (Just Works, we have neither display nor keys) and
+// BTstack keeps the bond in its LE device DB in the TLV flash bank. A bonded
+// phone only has to encrypt the link when it comes back, and since the GATT
+// service carries a Database Hash it can keep its copy of our services
+// instead of discovering them again.
+//
+// After a bonded phone disconnects we advertise directed at it with a high
+// duty cycle, which the controller ends after 1.28 s at the latest. Then
+// undirected every RECONNECT_FAST_ADV_INTERVAL for RECONNECT_FAST_ADV_MS,
+// then at the normal interval. After boot there is no telling whether the
+// phone is still around, and directed advertising would keep every other
+// phone out, so boot starts with the fast undirected advertising.
+//
+// Phones connect from a private address they change every 15 minutes or so.
+// Directed advertising goes to the identity address the phone gave us when
+// bonding, the controller turns that into its current private address.
+//
+// BTstack looks up every connecting phone in its device DB. We only ask for
+// pairing when it isn't found, a bonded phone encrypts with its keys.
+//
+// Every reconnect is timed from the disconnect to the connection, to the
+// encrypted link and to the SPP subscription, when the phone is ready.
+// *****************************************************************************
+#ifndef RECONNECT_H
+#define RECONNECT_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "btstack.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define RECONNECT_ADV_DIRECTED 0
+#define RECONNECT_ADV_FAST 1
+#define RECONNECT_ADV_NORMAL 2
+
+// Units of 0.625 ms, 30 ms
+#ifndef RECONNECT_FAST_ADV_INTERVAL
+#define RECONNECT_FAST_ADV_INTERVAL 48
+#endif
+
+#ifndef RECONNECT_FAST_ADV_MS
+#define RECONNECT_FAST_ADV_MS 30000
+#endif
+
+// The controller stops high duty cycle directed advertising after 1.28 s.
+// It reports that as a failed connection, this is in case it doesn't.
+#define RECONNECT_DIRECTED_ADV_MS 1300
+
+// Advertising types for gap_advertisements_set_params()
+#define RECONNECT_ADV_TYPE_IND 0x00
+#define RECONNECT_ADV_TYPE_DIRECT_IND_HIGH 0x01
+
+// BTstack TLV tag the last bonded phone's address is persisted under
+#define RECONNECT_TLV_TAG (('N' << 24) | ('T' << 16) | ('P' << 8) | 'R')
+
+typedef struct
+{
+  uint8_t addr_type;
+  bd_addr_t addr;
+} ReconnectPeer;
+
+typedef struct
+{
+  uint16_t adv_interval; // the normal one
+  int adv_mode;
+  btstack_timer_source_t adv_timer;
+  btstack_packet_callback_registration_t hci_event_callback_registration;
+  btstack_packet_callback_registration_t sm_event_callback_registration;
+
+  int have_peer;
+  ReconnectPeer peer; // last bonded phone
+
+  hci_con_handle_t con_handle;
+  int con_identified; // con_peer is known, a bonded phone
+  ReconnectPeer con_peer;
+  int con_directed; // connected while advertising directed
+  uint32_t lost_ms; // disconnected (or booted) at
+  uint32_t connected_ms;
+} Reconnect;
+
+typedef struct
+{
+  uint32_t reconnects;
+  uint32_t directed;   // of them, while advertising directed
+  uint32_t connect_ms; // last one, from the disconnect
+  uint32_t encrypt_ms; // from the connection
+  uint32_t ready_ms;   // from the connection
+} ReconnectStats;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static Reconnect reconnect;
+ReconnectStats reconnect_stats;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void reconnect_init(uint16_t adv_interval);
+void reconnect_ready(hci_con_handle_t con_handle);
+void reconnect_stats_print();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+static void reconnect_advertise(int mode)
+{
+  bd_addr_t null_addr = {0};
+  uint32_t timeout_ms = 0;
+
+  btstack_run_loop_remove_timer(&reconnect.adv_timer);
+  reconnect.adv_mode = mode;
+
+  switch (mode)
+  {
+  case RECONNECT_ADV_DIRECTED:
+    // The interval doesn't apply to high duty cycle advertising
+    gap_advertisements_set_params(RECONNECT_FAST_ADV_INTERVAL, RECONNECT_FAST_ADV_INTERVAL,
+                                  RECONNECT_ADV_TYPE_DIRECT_IND_HIGH, reconnect.peer.addr_type, reconnect.peer.addr,
+                                  0x07, 0x00);
+    timeout_ms = RECONNECT_DIRECTED_ADV_MS;
+    break;
+  case RECONNECT_ADV_FAST:
+    gap_advertisements_set_params(RECONNECT_FAST_ADV_INTERVAL, RECONNECT_FAST_ADV_INTERVAL, RECONNECT_ADV_TYPE_IND, 0,
+                                  null_addr, 0x07, 0x00);
+    timeout_ms = RECONNECT_FAST_ADV_MS;
+    break;
+  default:
+    gap_advertisements_set_params(reconnect.adv_interval, reconnect.adv_interval, RECONNECT_ADV_TYPE_IND, 0,
+                                  null_addr, 0x07, 0x00);
+    return;
+  }
+
+  btstack_run_loop_set_timer(&reconnect.adv_timer, timeout_ms);
+  btstack_run_loop_add_timer(&reconnect.adv_timer);
+}
+
+static void reconnect_adv_timeout(btstack_timer_source_t *ts)
+{
+  UNUSED(ts);
+
+  reconnect_advertise(reconnect.adv_mode == RECONNECT_ADV_DIRECTED ? RECONNECT_ADV_FAST : RECONNECT_ADV_NORMAL);
+}
+
+static void reconnect_peer_store(const ReconnectPeer *peer)
+{
+  const btstack_tlv_t *tlv_impl;
+  void *tlv_context;
+
+  if (reconnect.have_peer && reconnect.peer.addr_type == peer->addr_type &&
+      bd_addr_cmp(reconnect.peer.addr, peer->addr) == 0)
+  {
+    // Same phone, spare the flash
+    return;
+  }
+
+  reconnect.peer = *peer;
+  reconnect.have_peer = 1;
+
+  btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+  if (tlv_impl)
+  {
+    tlv_impl->store_tag(tlv_context, RECONNECT_TLV_TAG, (uint8_t *)&reconnect.peer, sizeof(reconnect.peer));
+  }
+}
+
+static void reconnect_peer_restore()
+{
+  const btstack_tlv_t *tlv_impl;
+  void *tlv_context;
+
+  btstack_tlv_get_instance(&tlv_impl, &tlv_context);
+  if (tlv_impl && tlv_impl->get_tag(tlv_context, RECONNECT_TLV_TAG, (uint8_t *)&reconnect.peer,
+                                    sizeof(reconnect.peer)) == sizeof(reconnect.peer))
+  {
+    reconnect.have_peer = 1;
+  }
+}
+
+static void reconnect_connected(const uint8_t *packet)
+{
+  uint32_t now_ms = btstack_run_loop_get_time_ms();
+
+  if (hci_subevent_le_connection_complete_get_status(packet))
+  {
+    // Directed advertising timed out
+    if (reconnect.adv_mode == RECONNECT_ADV_DIRECTED)
+    {
+      reconnect_advertise(RECONNECT_ADV_FAST);
+    }
+    return;
+  }
+
+  btstack_run_loop_remove_timer(&reconnect.adv_timer);
+
+  reconnect.con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+  reconnect.con_identified = 0;
+  reconnect.con_directed = reconnect.adv_mode == RECONNECT_ADV_DIRECTED;
+  reconnect.connected_ms = now_ms;
+
+  reconnect_stats.reconnects++;
+  reconnect_stats.directed += reconnect.con_directed;
+  reconnect_stats.connect_ms = now_ms - reconnect.lost_ms;
+  reconnect_stats.encrypt_ms = 0;
+  reconnect_stats.ready_ms = 0;
+}
+
+// The connection address belongs to a bonded phone. It normally encrypts
+// right away, if it hasn't the request makes it.
+static void reconnect_identity_resolved(const uint8_t *packet)
+{
+  if (sm_event_identity_resolving_succeeded_get_handle(packet) != reconnect.con_handle)
+  {
+    return;
+  }
+
+  reconnect.con_peer.addr_type = sm_event_identity_resolving_succeeded_get_identity_addr_type(packet);
+  sm_event_identity_resolving_succeeded_get_identity_address(packet, reconnect.con_peer.addr);
+  reconnect.con_identified = 1;
+
+  if (gap_encryption_key_size(reconnect.con_handle) == 0)
+  {
+    sm_request_pairing(reconnect.con_handle);
+  }
+}
+
+// A new phone bonded and gave us its identity address
+static void reconnect_identity_created(const uint8_t *packet)
+{
+  if (sm_event_identity_created_get_handle(packet) != reconnect.con_handle)
+  {
+    return;
+  }
+
+  reconnect.con_peer.addr_type = sm_event_identity_created_get_identity_addr_type(packet);
+  sm_event_identity_created_get_identity_address(packet, reconnect.con_peer.addr);
+  reconnect.con_identified = 1;
+  reconnect_peer_store(&reconnect.con_peer);
+}
+
+static void reconnect_encrypted(const uint8_t *packet)
+{
+  if (hci_event_encryption_change_get_connection_handle(packet) != reconnect.con_handle ||
+      hci_event_encryption_change_get_status(packet) || !hci_event_encryption_change_get_encryption_enabled(packet))
+  {
+    return;
+  }
+
+  reconnect_stats.encrypt_ms = btstack_run_loop_get_time_ms() - reconnect.connected_ms;
+
+  // A new phone is stored once bonding gave us its identity address. It may
+  // also pair without bonding, then there is nothing to come back to.
+  if (reconnect.con_identified)
+  {
+    reconnect_peer_store(&reconnect.con_peer);
+  }
+}
+
+static void reconnect_disconnected(const uint8_t *packet)
+{
+  if (hci_event_disconnection_complete_get_connection_handle(packet) != reconnect.con_handle)
+  {
+    return;
+  }
+
+  reconnect.con_handle = HCI_CON_HANDLE_INVALID;
+  reconnect.lost_ms = btstack_run_loop_get_time_ms();
+
+  // BTstack resumes advertising on its own, with these parameters
+  reconnect_advertise(reconnect.have_peer ? RECONNECT_ADV_DIRECTED : RECONNECT_ADV_FAST);
+}
+
+static void reconnect_hci_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+  UNUSED(channel);
+  UNUSED(size);
+
+  if (packet_type != HCI_EVENT_PACKET)
+  {
+    return;
+  }
+
+  switch (hci_event_packet_get_type(packet))
+  {
+  case HCI_EVENT_LE_META:
+    if (hci_event_le_meta_get_subevent_code(packet) == HCI_SUBEVENT_LE_CONNECTION_COMPLETE)
+    {
+      reconnect_connected(packet);
+    }
+    break;
+  case HCI_EVENT_ENCRYPTION_CHANGE:
+    reconnect_encrypted(packet);
+    break;
+  case HCI_EVENT_DISCONNECTION_COMPLETE:
+    reconnect_disconnected(packet);
+    break;
+  default:
+    break;
+  }
+}
+
+static void reconnect_sm_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packet, uint16_t size)
+{
+  UNUSED(channel);
+  UNUSED(size);
+
+  if (packet_type != HCI_EVENT_PACKET)
+  {
+    return;
+  }
+
+  switch (hci_event_packet_get_type(packet))
+  {
+  case SM_EVENT_JUST_WORKS_REQUEST:
+    // Nothing to show or compare on our side
+    sm_just_works_confirm(sm_event_just_works_request_get_handle(packet));
+    break;
+  case SM_EVENT_IDENTITY_RESOLVING_SUCCEEDED:
+    reconnect_identity_resolved(packet);
+    break;
+  case SM_EVENT_IDENTITY_RESOLVING_FAILED:
+    // Not bonded with us, pair and bond
+    if (sm_event_identity_resolving_failed_get_handle(packet) == reconnect.con_handle)
+    {
+      sm_request_pairing(reconnect.con_handle);
+    }
+    break;
+  case SM_EVENT_IDENTITY_CREATED:
+    reconnect_identity_created(packet);
+    break;
+  case SM_EVENT_PAIRING_COMPLETE:
+    printf("Pairing complete, status %u\n", sm_event_pairing_complete_get_status(packet));
+    break;
+  default:
+    break;
+  }
+}
+
+// Call after sm_init() and after the advertising parameters are set, with
+// the advertising interval to settle at. Boot counts as a disconnect, but
+// for the timing only.
+void reconnect_init(uint16_t adv_interval)
+{
+  sm_set_io_capabilities(IO_CAPABILITY_NO_INPUT_NO_OUTPUT);
+  sm_set_authentication_requirements(SM_AUTHREQ_SECURE_CONNECTION | SM_AUTHREQ_BONDING);
+
+  reconnect.adv_interval = adv_interval;
+  reconnect.con_handle = HCI_CON_HANDLE_INVALID;
+  reconnect.adv_timer.process = &reconnect_adv_timeout;
+  reconnect.hci_event_callback_registration.callback = &reconnect_hci_packet_handler;
+  hci_add_event_handler(&reconnect.hci_event_callback_registration);
+  reconnect.sm_event_callback_registration.callback = &reconnect_sm_packet_handler;
+  sm_add_event_handler(&reconnect.sm_event_callback_registration);
+
+  reconnect_peer_restore();
+  reconnect.lost_ms = btstack_run_loop_get_time_ms();
+  reconnect_advertise(RECONNECT_ADV_FAST);
+}
+
+// The phone subscribed to the SPP stream, it has found its way around our
+// services
+void reconnect_ready(hci_con_handle_t con_handle)
+{
+  if (con_handle != reconnect.con_handle || reconnect_stats.ready_ms)
+  {
+    return;
+  }
+
+  reconnect_stats.ready_ms = btstack_run_loop_get_time_ms() - reconnect.connected_ms;
+  reconnect_stats_print();
+}
+
+void reconnect_stats_print()
+{
+  printf("Reconnect: %s, connected after %" PRIu32 " ms, encrypted %" PRIu32 " ms and ready %" PRIu32
+         " ms after that (%" PRIu32 " of %" PRIu32 " directed)\n",
+         reconnect.con_directed ? "directed" : "undirected", reconnect_stats.connect_ms, reconnect_stats.encrypt_ms,
+         reconnect_stats.ready_ms, reconnect_stats.directed, reconnect_stats.reconnects);
+}
+
+#endif
@@ -0,0 +1,226 @@
+// *****************************************************************************
+// Sample codec
+//
+// Compact encoding of light/PIR samples. Light readings change slowly and PIR is
+// a single bit, so instead of storing the full 16-bit channel values for every
+// sample we store the difference to the previous sample as zig-zag varints and
+// collapse runs of identical samples into a single repeat token.
+//
+// Token layout, told apart by the two lowest bits of the first byte:
+//   x1  varint, repeat the previous sample (token >> 1) times
+//   10  single byte, small sample: bit 2 is the PIR level, bits 3-5 the zig-zag
+//       ch0 delta (-4..3) and bits 6-7 the zig-zag ch1 delta (-2..1)
+//   00  varint, full sample: bit 2 is the PIR level, (token >> 3) the zig-zag
+//       ch0 delta. The zig-zag ch1 delta follows as a varint.
+//
+// A still scene is mostly runs, sensor noise mostly costs one byte per sample.
+// *****************************************************************************
+#ifndef SAMPLE_CODEC_H
+#define SAMPLE_CODEC_H
+
+#include <stdint.h>
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define VARINT_MAX_BYTES 5
+
+#define SAMPLE_TOKEN_RUN 0x01
+#define SAMPLE_TOKEN_SMALL 0x02
+#define SAMPLE_TOKEN_FULL 0x00
+
+// Worst case for one sample_encoder_put(): a pending run flush, the sample token
+// and the ch1 delta, plus room for the final sample_encoder_flush().
+#define SAMPLE_ENCODER_PUT_RESERVE (VARINT_MAX_BYTES * 4)
+
+typedef struct
+{
+  uint16_t ch0; // visible + IR
+  uint16_t ch1; // IR only
+  uint8_t pir;  // motion pin level
+} Sample;
+
+typedef struct
+{
+  Sample prev;
+  uint32_t run; // number of repeats of prev not yet written
+} SampleEncoder;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+static inline uint32_t zigzag_encode(int32_t value);
+static inline int32_t zigzag_decode(uint32_t value);
+int varint_put(uint8_t *buf, int len, uint32_t value);
+int varint_get(const uint8_t *buf, int len, uint32_t *value);
+
+void sample_encoder_reset(SampleEncoder *enc, const Sample *first);
+int sample_encoder_put(SampleEncoder *enc, const Sample *sample, uint8_t *buf, int len);
+int sample_encoder_flush(SampleEncoder *enc, uint8_t *buf, int len);
+int sample_decode(const uint8_t *buf, int len, Sample *prev, uint32_t *repeat);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+static inline uint32_t zigzag_encode(int32_t value)
+{
+  return ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+}
+
+static inline int32_t zigzag_decode(uint32_t value)
+{
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Writes value as a little-endian base-128 varint.
+// Returns the number of bytes written, or 0 if it doesn't fit in len bytes.
+int varint_put(uint8_t *buf, int len, uint32_t value)
+{
+  int n = 0;
+
+  do
+  {
+    if (n >= len)
+    {
+      return 0;
+    }
+
+    uint8_t byte = value & 0x7F;
+    value >>= 7;
+    if (value)
+    {
+      byte |= 0x80;
+    }
+    buf[n++] = byte;
+  } while (value);
+
+  return n;
+}
+
+// Returns the number of bytes consumed, or 0 if buf holds no complete varint.
+int varint_get(const uint8_t *buf, int len, uint32_t *value)
+{
+  uint32_t result = 0;
+
+  for (int n = 0; n < len && n < VARINT_MAX_BYTES; n++)
+  {
+    result |= (uint32_t)(buf[n] & 0x7F) << (7 * n);
+    if (!(buf[n] & 0x80))
+    {
+      *value = result;
+      return n + 1;
+    }
+  }
+
+  return 0;
+}
+
+void sample_encoder_reset(SampleEncoder *enc, const Sample *first)
+{
+  enc->prev = *first;
+  enc->run = 0;
+}
+
+// Appends a sample to buf. Returns the number of bytes written (0 when the
+// sample only extended a run), or -1 when len is smaller than
+// SAMPLE_ENCODER_PUT_RESERVE and the caller should flush and start a new block.
+int sample_encoder_put(SampleEncoder *enc, const Sample *sample, uint8_t *buf, int len)
+{
+  if (len < SAMPLE_ENCODER_PUT_RESERVE)
+  {
+    return -1;
+  }
+
+  if (sample->ch0 == enc->prev.ch0 && sample->ch1 == enc->prev.ch1 && sample->pir == enc->prev.pir)
+  {
+    enc->run++;
+    return 0;
+  }
+
+  int n = sample_encoder_flush(enc, buf, len);
+
+  uint32_t z0 = zigzag_encode((int32_t)sample->ch0 - (int32_t)enc->prev.ch0);
+  uint32_t z1 = zigzag_encode((int32_t)sample->ch1 - (int32_t)enc->prev.ch1);
+  uint32_t pir = sample->pir ? 1u : 0u;
+
+  if (z0 < 8 && z1 < 4)
+  {
+    buf[n++] = (uint8_t)((z1 << 6) | (z0 << 3) | (pir << 2) | SAMPLE_TOKEN_SMALL);
+  }
+  else
+  {
+    n += varint_put(buf + n, len - n, (z0 << 3) | (pir << 2) | SAMPLE_TOKEN_FULL);
+    n += varint_put(buf + n, len - n, z1);
+  }
+
+  enc->prev = *sample;
+
+  return n;
+}
+
+// Writes out a pending repeat run. Returns the number of bytes written.
+int sample_encoder_flush(SampleEncoder *enc, uint8_t *buf, int len)
+{
+  if (enc->run == 0)
+  {
+    return 0;
+  }
+
+  int n = varint_put(buf, len, (enc->run << 1) | SAMPLE_TOKEN_RUN);
+  enc->run = 0;
+
+  return n;
+}
+
+// Decodes one token from buf. On a sample token prev is updated to the new
+// sample and *repeat is set to 1; on a run token prev is left alone and *repeat
+// holds the run length. Returns the number of bytes consumed, 0 on truncation.
+int sample_decode(const uint8_t *buf, int len, Sample *prev, uint32_t *repeat)
+{
+  uint32_t token;
+  uint32_t z1;
+
+  if (len < 1)
+  {
+    return 0;
+  }
+
+  if ((buf[0] & 0x03) == SAMPLE_TOKEN_SMALL)
+  {
+    prev->ch0 = (uint16_t)(prev->ch0 + zigzag_decode((buf[0] >> 3) & 0x07));
+    prev->ch1 = (uint16_t)(prev->ch1 + zigzag_decode(buf[0] >> 6));
+    prev->pir = (buf[0] >> 2) & 1;
+    *repeat = 1;
+    return 1;
+  }
+
+  int n = varint_get(buf, len, &token);
+  if (n == 0)
+  {
+    return 0;
+  }
+
+  if (token & SAMPLE_TOKEN_RUN)
+  {
+    *repeat = token >> 1;
+    return n;
+  }
+
+  int m = varint_get(buf + n, len - n, &z1);
+  if (m == 0)
+  {
+    return 0;
+  }
+
+  prev->ch0 = (uint16_t)(prev->ch0 + zigzag_decode(token >> 3));
+  prev->ch1 = (uint16_t)(prev->ch1 + zigzag_decode(z1));
+  prev->pir = (token >> 2) & 1;
+  *repeat = 1;
+
+  return n + m;
+}
+
+#endif
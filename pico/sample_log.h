@@ -0,0 +1,325 @@
+// *****************************************************************************
+// Sample log
+//
+// Flash-backed ring log of light/PIR samples, so that data produced while no
+// phone is connected can be downloaded later.
+//
+// The log area (see flash_layout.h) is split into 256 byte flash pages. Samples
+// are compressed with the sample codec into a page buffer in RAM and the page is
+// programmed once it is full. Every page starts with a SampleLogPageHeader
+// holding the absolute first sample, so pages can be decoded on their own.
+//
+// Pages are numbered with an ever increasing sequence number and page `seq` is
+// always stored at page index `seq % SAMPLE_LOG_NUM_PAGES`. When the writer
+// enters a new sector the sector is erased, which drops the oldest pages.
+//
+// Readers address the log with a byte offset `seq * SAMPLE_LOG_PAGE_SIZE + n`,
+// which stays valid across wrap-around so an interrupted download can resume.
+// *****************************************************************************
+#ifndef SAMPLE_LOG_H
+#define SAMPLE_LOG_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "hardware/flash.h"
+#include "hardware/sync.h"
+#include "flash_layout.h"
+#include "sample_codec.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define SAMPLE_LOG_PAGE_SIZE FLASH_PAGE_SIZE
+#define SAMPLE_LOG_NUM_PAGES (SAMPLE_LOG_FLASH_SIZE / SAMPLE_LOG_PAGE_SIZE)
+#define SAMPLE_LOG_PAGES_PER_SECTOR (FLASH_SECTOR_SIZE / SAMPLE_LOG_PAGE_SIZE)
+
+#define SAMPLE_LOG_PAGE_MAGIC 0x544E // "NT"
+#define SAMPLE_LOG_SEQ_INVALID 0xFFFFFFFF
+
+// Nominal time between two logged samples. Stored in every page header so the
+// reader can reconstruct sample times from the page start time.
+#ifndef SAMPLE_LOG_INTERVAL_MS
+#define SAMPLE_LOG_INTERVAL_MS 250
+#endif
+
+// Close a page after this many samples even if it isn't full, so a power cut
+// loses at most a few minutes of data.
+#ifndef SAMPLE_LOG_MAX_PAGE_SAMPLES
+#define SAMPLE_LOG_MAX_PAGE_SAMPLES 1200
+#endif
+
+typedef struct __attribute__((packed))
+{
+  uint16_t magic;         // SAMPLE_LOG_PAGE_MAGIC
+  uint16_t boot;          // boot counter, time_ms restarts at every boot
+  uint32_t seq;           // page sequence number
+  uint32_t time_ms;       // uptime of the first sample
+  uint16_t interval_ms;   // nominal time between samples
+  uint16_t payload_len;   // bytes of encoded samples following the header
+  uint32_t sample_count;  // number of samples in the page, including the first
+  uint16_t ch0;           // first sample, absolute
+  uint16_t ch1;           //
+  uint8_t pir;            //
+  uint8_t reserved;       //
+} SampleLogPageHeader;
+
+#define SAMPLE_LOG_PAYLOAD_SIZE (SAMPLE_LOG_PAGE_SIZE - sizeof(SampleLogPageHeader))
+
+typedef struct
+{
+  uint32_t head_seq; // sequence number of the page being filled
+  uint16_t boot;
+  int page_open;
+  int payload_len;
+  SampleEncoder encoder;
+  uint8_t page[SAMPLE_LOG_PAGE_SIZE] __attribute__((aligned(4)));
+} SampleLog;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static SampleLog sample_log;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void sample_log_init();
+void sample_log_append(const Sample *sample, uint32_t time_ms);
+void sample_log_flush();
+uint32_t sample_log_start_offset();
+uint32_t sample_log_end_offset();
+int sample_log_read(uint32_t *offset, uint8_t *buf, int len);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+static inline const SampleLogPageHeader *sample_log_flash_page(uint32_t seq)
+{
+  uint32_t index = seq % SAMPLE_LOG_NUM_PAGES;
+  return (const SampleLogPageHeader *)(XIP_BASE + SAMPLE_LOG_FLASH_OFFSET + index * SAMPLE_LOG_PAGE_SIZE);
+}
+
+static inline uint32_t sample_log_flash_offset(uint32_t seq)
+{
+  return SAMPLE_LOG_FLASH_OFFSET + (seq % SAMPLE_LOG_NUM_PAGES) * SAMPLE_LOG_PAGE_SIZE;
+}
+
+static int sample_log_page_is_valid(uint32_t index, const SampleLogPageHeader *header)
+{
+  return header->magic == SAMPLE_LOG_PAGE_MAGIC &&
+         header->seq != SAMPLE_LOG_SEQ_INVALID &&
+         header->seq % SAMPLE_LOG_NUM_PAGES == index &&
+         header->payload_len <= SAMPLE_LOG_PAYLOAD_SIZE;
+}
+
+// Scans the log area for the newest page and continues after it.
+void sample_log_init()
+{
+  uint32_t newest_seq = SAMPLE_LOG_SEQ_INVALID;
+  uint16_t newest_boot = 0;
+
+  for (uint32_t index = 0; index < SAMPLE_LOG_NUM_PAGES; index++)
+  {
+    const SampleLogPageHeader *header = sample_log_flash_page(index);
+
+    if (!sample_log_page_is_valid(index, header))
+    {
+      continue;
+    }
+
+    if (newest_seq == SAMPLE_LOG_SEQ_INVALID || header->seq > newest_seq)
+    {
+      newest_seq = header->seq;
+      newest_boot = header->boot;
+    }
+  }
+
+  memset(&sample_log, 0, sizeof(sample_log));
+
+  if (newest_seq == SAMPLE_LOG_SEQ_INVALID)
+  {
+    sample_log.head_seq = 0;
+    sample_log.boot = 0;
+  }
+  else
+  {
+    sample_log.head_seq = newest_seq + 1;
+    sample_log.boot = newest_boot + 1;
+  }
+
+  // The rest of the sector we continue in should still be erased. If it isn't
+  // (power cut while programming) skip ahead to the next sector.
+  if (sample_log.head_seq % SAMPLE_LOG_PAGES_PER_SECTOR != 0)
+  {
+    const uint8_t *page = (const uint8_t *)sample_log_flash_page(sample_log.head_seq);
+    for (uint32_t i = 0; i < SAMPLE_LOG_PAGE_SIZE; i++)
+    {
+      if (page[i] != 0xFF)
+      {
+        sample_log.head_seq += SAMPLE_LOG_PAGES_PER_SECTOR - sample_log.head_seq % SAMPLE_LOG_PAGES_PER_SECTOR;
+        break;
+      }
+    }
+  }
+
+  printf("Sample log: %u pages, head at page %" PRIu32 ", boot %u\n",
+         (unsigned)SAMPLE_LOG_NUM_PAGES, sample_log.head_seq, sample_log.boot);
+}
+
+static void sample_log_program_page()
+{
+  SampleLogPageHeader *header = (SampleLogPageHeader *)sample_log.page;
+  uint32_t flash_offset = sample_log_flash_offset(sample_log.head_seq);
+
+  header->payload_len = sample_log.payload_len;
+
+  // Flash operations stall XIP, so nothing may run from flash meanwhile
+  uint32_t ints = save_and_disable_interrupts();
+  if (sample_log.head_seq % SAMPLE_LOG_PAGES_PER_SECTOR == 0)
+  {
+    flash_range_erase(flash_offset, FLASH_SECTOR_SIZE);
+  }
+  flash_range_program(flash_offset, sample_log.page, SAMPLE_LOG_PAGE_SIZE);
+  restore_interrupts(ints);
+
+  sample_log.head_seq++;
+  sample_log.page_open = 0;
+}
+
+static void sample_log_open_page(const Sample *sample, uint32_t time_ms)
+{
+  SampleLogPageHeader *header = (SampleLogPageHeader *)sample_log.page;
+
+  memset(sample_log.page, 0xFF, sizeof(sample_log.page));
+
+  header->magic = SAMPLE_LOG_PAGE_MAGIC;
+  header->boot = sample_log.boot;
+  header->seq = sample_log.head_seq;
+  header->time_ms = time_ms;
+  header->interval_ms = SAMPLE_LOG_INTERVAL_MS;
+  header->payload_len = 0;
+  header->sample_count = 1;
+  header->ch0 = sample->ch0;
+  header->ch1 = sample->ch1;
+  header->pir = sample->pir;
+  header->reserved = 0;
+
+  sample_encoder_reset(&sample_log.encoder, sample);
+  sample_log.payload_len = 0;
+  sample_log.page_open = 1;
+}
+
+void sample_log_append(const Sample *sample, uint32_t time_ms)
+{
+  if (!sample_log.page_open)
+  {
+    sample_log_open_page(sample, time_ms);
+    return;
+  }
+
+  SampleLogPageHeader *header = (SampleLogPageHeader *)sample_log.page;
+  uint8_t *payload = sample_log.page + sizeof(SampleLogPageHeader);
+
+  int n = -1;
+  if (header->sample_count < SAMPLE_LOG_MAX_PAGE_SAMPLES)
+  {
+    n = sample_encoder_put(&sample_log.encoder, sample,
+                           payload + sample_log.payload_len,
+                           SAMPLE_LOG_PAYLOAD_SIZE - sample_log.payload_len);
+  }
+
+  if (n < 0)
+  {
+    // Page full, the sample starts the next one
+    sample_log_flush();
+    sample_log_open_page(sample, time_ms);
+    return;
+  }
+
+  sample_log.payload_len += n;
+  header->sample_count++;
+}
+
+// Programs the page being filled, even if it isn't full yet.
+void sample_log_flush()
+{
+  if (!sample_log.page_open)
+  {
+    return;
+  }
+
+  uint8_t *payload = sample_log.page + sizeof(SampleLogPageHeader);
+
+  sample_log.payload_len += sample_encoder_flush(&sample_log.encoder,
+                                                 payload + sample_log.payload_len,
+                                                 SAMPLE_LOG_PAYLOAD_SIZE - sample_log.payload_len);
+
+  sample_log_program_page();
+}
+
+// Offset of the oldest byte still in flash. Entering a sector erases it, so
+// only whole sectors behind the head are kept.
+uint32_t sample_log_start_offset()
+{
+  uint32_t sector_end = (sample_log.head_seq + SAMPLE_LOG_PAGES_PER_SECTOR - 1) / SAMPLE_LOG_PAGES_PER_SECTOR * SAMPLE_LOG_PAGES_PER_SECTOR;
+
+  if (sector_end < SAMPLE_LOG_NUM_PAGES)
+  {
+    return 0;
+  }
+
+  return (sector_end - SAMPLE_LOG_NUM_PAGES) * SAMPLE_LOG_PAGE_SIZE;
+}
+
+// Offset right after the newest programmed page.
+uint32_t sample_log_end_offset()
+{
+  return sample_log.head_seq * SAMPLE_LOG_PAGE_SIZE;
+}
+
+// Copies up to len bytes of the log starting at *offset into buf. If *offset
+// points at data that has already been overwritten it is moved forward to the
+// oldest data still available. Returns the number of bytes copied, 0 at the end.
+int sample_log_read(uint32_t *offset, uint8_t *buf, int len)
+{
+  uint32_t start = sample_log_start_offset();
+  uint32_t end = sample_log_end_offset();
+
+  if (*offset < start)
+  {
+    *offset = start;
+  }
+
+  int copied = 0;
+  uint32_t position = *offset;
+
+  while (copied < len && position < end)
+  {
+    uint32_t seq = position / SAMPLE_LOG_PAGE_SIZE;
+    uint32_t in_page = position % SAMPLE_LOG_PAGE_SIZE;
+    int n = SAMPLE_LOG_PAGE_SIZE - in_page;
+    if (n > len - copied)
+    {
+      n = len - copied;
+    }
+    if ((uint32_t)n > end - position)
+    {
+      n = end - position;
+    }
+
+    memcpy(buf + copied, (const uint8_t *)sample_log_flash_page(seq) + in_page, n);
+
+    copied += n;
+    position += n;
+  }
+
+  return copied;
+}
+
+#endif
@@ -0,0 +1,146 @@
+// *****************************************************************************
+// Sensor drivers
+//
+// Every sensor part implements a SensorDriver: a table of functions the bus
+// scheduler (i2c_scheduler.h) calls to bring the part up and to sample it. A
+// SensorDevice is one physical sensor: a driver, the bus it sits on, its
+// address and how often it should be sampled.
+//
+// Sampling is split into small transactions so the scheduler can interleave
+// devices sharing a bus: start() checks whether a measurement is ready,
+// read() fetches the raw bytes and decode() turns them into values without
+// touching the bus.
+// *****************************************************************************
+#ifndef SENSOR_DRIVER_H
+#define SENSOR_DRIVER_H
+
+#include <stdint.h>
+#include "pico/stdlib.h"
+#include "my_i2c.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define SENSOR_MAX_RAW_LEN 8
+#define SENSOR_MAX_VALUES 4
+
+// How often a failed register read/write is repeated before the device's bus
+// is marked for recovery
+#define SENSOR_I2C_RETRIES 2
+
+// Hard upper bound on a single register access: (retries + 1) attempts of a
+// write and a read transfer
+#define SENSOR_REG_ACCESS_WORST_CASE_US ((SENSOR_I2C_RETRIES + 1) * 2 * I2C_TIMEOUT_US)
+
+typedef struct SensorDevice SensorDevice;
+
+typedef struct
+{
+  uint64_t time_us; // when the measurement was read
+  uint8_t num_values;
+  int32_t values[SENSOR_MAX_VALUES];
+} SensorReading;
+
+typedef struct
+{
+  const char *name;
+  uint8_t raw_len; // bytes read() produces
+  // Probes and configures the part. Returns 0 on success.
+  int (*init)(SensorDevice *dev);
+  // Finishes bringing the part up init_delay_us after init(), for parts that
+  // need time after a reset. NULL if init() does it all. Returns 0 on success.
+  int (*setup)(SensorDevice *dev);
+  uint32_t init_delay_us;
+  // Returns 1 if a measurement is ready, 0 if not yet, -1 on error.
+  int (*start)(SensorDevice *dev);
+  // Reads raw_len bytes. Returns 0 on success, 1 if the measurement turned out
+  // to be invalid, -1 on error.
+  int (*read)(SensorDevice *dev, uint8_t *raw);
+  // Converts raw bytes to values. Must not touch the bus.
+  void (*decode)(SensorDevice *dev, const uint8_t *raw, SensorReading *reading);
+} SensorDriver;
+
+struct SensorDevice
+{
+  const char *name;
+  const SensorDriver *driver;
+  I2cBus *bus;
+  uint8_t addr;
+  uint32_t period_us; // how often to sample
+  uint8_t priority;   // breaks deadline ties, lower goes first
+  // Poll interval while no measurement is ready, 0 for the default. Devices
+  // with a data ready interrupt can poll rarely, see i2c_scheduler_data_ready().
+  uint32_t not_ready_retry_us;
+  void (*on_reading)(SensorDevice *dev, const SensorReading *reading);
+
+  // Scheduler state
+  int state;
+  int initialized;
+  int init_failures;    // in a row, see SENSOR_INIT_RECOVER_FAILURES
+  uint64_t release_us;  // when the current sample became due
+  uint64_t next_us;     // when to run the next transaction
+  uint64_t deadline_us; // when the current sample has to be done
+  uint8_t raw[SENSOR_MAX_RAW_LEN];
+
+  // Statistics
+  uint32_t readings;
+  uint32_t failures;
+  uint32_t deadline_misses;
+  uint32_t max_latency_us; // release to reading
+};
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+int sensor_reg_read(SensorDevice *dev, uint8_t reg, uint8_t *buf, uint8_t nbytes);
+int sensor_reg_write(SensorDevice *dev, uint8_t reg, uint8_t *buf, uint8_t nbytes);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// Register read with retries. Returns 0 on success. If all attempts fail the
+// bus is marked for recovery, which the scheduler does before its next
+// transaction on that bus.
+int sensor_reg_read(SensorDevice *dev, uint8_t reg, uint8_t *buf, uint8_t nbytes)
+{
+  for (int attempt = 0; attempt <= SENSOR_I2C_RETRIES; attempt++)
+  {
+    if (attempt > 0)
+    {
+      i2c_stats.retries++;
+    }
+
+    if (reg_read(dev->bus->i2c, dev->addr, reg, buf, nbytes) == nbytes)
+    {
+      return 0;
+    }
+  }
+
+  dev->bus->needs_recovery = 1;
+  return -1;
+}
+
+// Register write with retries, see sensor_reg_read()
+int sensor_reg_write(SensorDevice *dev, uint8_t reg, uint8_t *buf, uint8_t nbytes)
+{
+  for (int attempt = 0; attempt <= SENSOR_I2C_RETRIES; attempt++)
+  {
+    if (attempt > 0)
+    {
+      i2c_stats.retries++;
+    }
+
+    if (reg_write(dev->bus->i2c, dev->addr, reg, buf, nbytes) == nbytes)
+    {
+      return 0;
+    }
+  }
+
+  dev->bus->needs_recovery = 1;
+  return -1;
+}
+
+#endif
@@ -0,0 +1,147 @@
+// *****************************************************************************
+// Shared time base
+//
+// Units playing the same pattern side by side drift apart when each one runs
+// its flasher on its own crystal. A phone distributes its clock instead: it
+// pings the unit (CMD_TIME_PING), picks the exchange with the shortest round
+// trip and tells the unit what the shared time was at one of its local
+// timestamps (CMD_TIME_SET). Every unit synced from the same phone then has
+// the same idea of the shared time, and the pattern phase is derived from it.
+//
+// Between syncs the local clock is corrected for its measured drift: every
+// new sync point is compared to what the previous one predicted, and the
+// difference over the elapsed time adjusts the drift estimate.
+// *****************************************************************************
+#ifndef SYNC_CLOCK_H
+#define SYNC_CLOCK_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "pico/stdlib.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+// Sync points closer together than this are too noisy to measure drift
+#define SYNC_MIN_DRIFT_SPAN_US (10 * 1000 * 1000)
+
+// Crystals are specified to a few 10 ppm, anything beyond is a bad sync point
+#define SYNC_MAX_DRIFT_PPB 200000
+
+typedef struct
+{
+  int synced;
+  uint64_t ref_local_us; // local time of the last sync point
+  int64_t ref_shared_us; // shared time at ref_local_us
+  int32_t drift_ppb;     // how much faster the shared clock runs
+
+  // Statistics
+  uint32_t updates;
+  int32_t last_error_us; // shared time at the last sync point minus the prediction
+  uint32_t max_error_us;
+} SyncClock;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static SyncClock sync_clock;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+int64_t sync_clock_shared_us(uint64_t local_us);
+uint64_t sync_clock_shared_ms();
+void sync_clock_update(uint64_t local_us, int64_t shared_us);
+uint64_t sync_clock_local_from_u32(uint32_t local_us_low);
+int64_t sync_clock_shared_from_u32_ms(uint64_t local_us, uint32_t shared_ms_low);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// Shared time at the given local time, corrected for drift
+int64_t sync_clock_shared_us(uint64_t local_us)
+{
+  int64_t elapsed_us = (int64_t)(local_us - sync_clock.ref_local_us);
+
+  return sync_clock.ref_shared_us + elapsed_us + elapsed_us * sync_clock.drift_ppb / 1000000000;
+}
+
+// Shared time now, in full: cut to 32 bits it would wrap every 49.7 days and
+// throw anything taken modulo of it out of phase
+uint64_t sync_clock_shared_ms()
+{
+  return (uint64_t)(sync_clock_shared_us(time_us_64()) / 1000);
+}
+
+// Adds a sync point: the shared time was shared_us when the local clock read
+// local_us
+void sync_clock_update(uint64_t local_us, int64_t shared_us)
+{
+  if (sync_clock.synced)
+  {
+    int64_t error_us = shared_us - sync_clock_shared_us(local_us);
+    int64_t span_us = (int64_t)(local_us - sync_clock.ref_local_us);
+
+    sync_clock.last_error_us = (int32_t)error_us;
+    if ((uint32_t)llabs(error_us) > sync_clock.max_error_us)
+    {
+      sync_clock.max_error_us = (uint32_t)llabs(error_us);
+    }
+
+    if (span_us >= SYNC_MIN_DRIFT_SPAN_US)
+    {
+      // Only go half the way, a single sync point can be off by a connection
+      // event or so
+      int64_t drift_ppb = sync_clock.drift_ppb + error_us * 1000000000 / span_us / 2;
+      if (drift_ppb > SYNC_MAX_DRIFT_PPB)
+      {
+        drift_ppb = SYNC_MAX_DRIFT_PPB;
+      }
+      if (drift_ppb < -SYNC_MAX_DRIFT_PPB)
+      {
+        drift_ppb = -SYNC_MAX_DRIFT_PPB;
+      }
+      sync_clock.drift_ppb = (int32_t)drift_ppb;
+    }
+  }
+
+  sync_clock.ref_local_us = local_us;
+  sync_clock.ref_shared_us = shared_us;
+  sync_clock.synced = 1;
+  sync_clock.updates++;
+
+  printf("Sync: error %" PRId32 " us, max %" PRIu32 " us, drift %" PRId32 " ppb, %" PRIu32 " updates\n",
+         sync_clock.last_error_us, sync_clock.max_error_us, sync_clock.drift_ppb, sync_clock.updates);
+}
+
+// Local timestamps go over the air as their low 32 bits, this restores the
+// full time closest to now
+uint64_t sync_clock_local_from_u32(uint32_t local_us_low)
+{
+  uint64_t now_us = time_us_64();
+  int32_t diff = (int32_t)(local_us_low - (uint32_t)now_us);
+
+  return now_us + diff;
+}
+
+// The phone sends the shared time as 32 bit milliseconds, which wrap every 49
+// days. Unwraps them against our own idea of the shared time.
+int64_t sync_clock_shared_from_u32_ms(uint64_t local_us, uint32_t shared_ms_low)
+{
+  if (!sync_clock.synced)
+  {
+    return (int64_t)shared_ms_low * 1000;
+  }
+
+  int64_t predicted_ms = sync_clock_shared_us(local_us) / 1000;
+  int32_t diff = (int32_t)(shared_ms_low - (uint32_t)predicted_ms);
+
+  return (predicted_ms + diff) * 1000;
+}
+
+#endif
@@ -0,0 +1,244 @@
+// *****************************************************************************
+// Task scheduler
+//
+// Runs the firmware's own work (sensors, PIR, LED pattern, reports, flash)
+// as cooperative tasks on the BTstack run loop, so everything shares the core
+// with BTstack and nothing busy-waits. A task is due at the time its last run
+// returned, or as soon as an interrupt signals it with task_signal_from_irq().
+//
+// The scheduler owns one run loop timer, armed for the earliest due task, and
+// one data source that interrupts poll. Either runs the due task with the
+// highest priority, a single one: if more are due the timer is armed for
+// right away, so BTstack gets its turn between tasks.
+//
+// Every run is timed against the task's budget. Runs that take longer are
+// reported as overruns; together with how late tasks started this shows who
+// holds up whom.
+// *****************************************************************************
+#ifndef TASK_SCHEDULER_H
+#define TASK_SCHEDULER_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include "btstack.h"
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+// run() returns this when the task only has to run once signalled
+#define TASK_IDLE UINT64_MAX
+
+typedef struct Task
+{
+  const char *name;
+  int priority;       // higher goes first when several tasks are due
+  uint32_t budget_us; // a longer run is an overrun
+  // Does the work. signalled is set if an interrupt asked for the run. Returns
+  // when to run next, TASK_IDLE for not until signalled.
+  uint64_t (*run)(uint64_t now_us, int signalled);
+
+  uint64_t next_us;
+  volatile int signalled;
+  struct Task *next; // by priority, highest first
+
+  uint32_t runs;
+  uint32_t overruns;
+  uint32_t max_run_us;
+  uint32_t max_late_us; // from due until started, for timed runs
+} Task;
+
+typedef struct
+{
+  Task *tasks;
+  btstack_timer_source_t timer;
+  btstack_data_source_t data_source;
+  uint32_t overruns;
+} TaskScheduler;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static TaskScheduler task_scheduler;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void task_scheduler_init();
+void task_add(Task *task, uint64_t first_us);
+void task_schedule(Task *task, uint64_t when_us);
+void task_signal_from_irq(Task *task);
+uint64_t task_scheduler_next_us();
+void task_scheduler_print();
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+static inline int task_due(const Task *task, uint64_t now_us)
+{
+  return task->signalled || task->next_us <= now_us;
+}
+
+// When the earliest task is due, 0 if one is signalled
+static uint64_t task_scheduler_earliest_us()
+{
+  uint64_t next_us = TASK_IDLE;
+
+  for (Task *task = task_scheduler.tasks; task; task = task->next)
+  {
+    if (task->signalled)
+    {
+      return 0;
+    }
+    if (task->next_us < next_us)
+    {
+      next_us = task->next_us;
+    }
+  }
+  return next_us;
+}
+
+// Arms the timer for the earliest due task. Run loop timers count whole
+// milliseconds, it fires on the first millisecond at or after that.
+static void task_scheduler_arm()
+{
+  uint64_t next_us = task_scheduler_earliest_us();
+
+  btstack_run_loop_remove_timer(&task_scheduler.timer);
+  if (next_us == TASK_IDLE)
+  {
+    return;
+  }
+
+  uint32_t now_ms = btstack_run_loop_get_time_ms();
+  uint32_t due_ms = (uint32_t)((next_us + 999) / 1000);
+  btstack_run_loop_set_timer(&task_scheduler.timer, (int32_t)(due_ms - now_ms) > 0 ? due_ms - now_ms : 0);
+  btstack_run_loop_add_timer(&task_scheduler.timer);
+}
+
+static void task_run(Task *task, uint64_t now_us)
+{
+  // Taken and cleared together, a signal between the two would be lost
+  uint32_t ints = save_and_disable_interrupts();
+  int signalled = task->signalled;
+  task->signalled = 0;
+  restore_interrupts(ints);
+
+  if (!signalled && now_us - task->next_us > task->max_late_us)
+  {
+    task->max_late_us = (uint32_t)(now_us - task->next_us);
+  }
+
+  task->next_us = task->run(now_us, signalled);
+
+  uint32_t run_us = (uint32_t)(time_us_64() - now_us);
+  task->runs++;
+  if (run_us > task->max_run_us)
+  {
+    task->max_run_us = run_us;
+  }
+  if (run_us > task->budget_us)
+  {
+    task->overruns++;
+    task_scheduler.overruns++;
+    printf("Task %s overran: %" PRIu32 " us, budget %" PRIu32 " us\n", task->name, run_us, task->budget_us);
+  }
+}
+
+static void task_scheduler_dispatch()
+{
+  uint64_t now_us = time_us_64();
+
+  for (Task *task = task_scheduler.tasks; task; task = task->next)
+  {
+    if (task_due(task, now_us))
+    {
+      task_run(task, now_us);
+      break;
+    }
+  }
+
+  task_scheduler_arm();
+}
+
+static void task_scheduler_timer_handler(btstack_timer_source_t *ts)
+{
+  UNUSED(ts);
+
+  task_scheduler_dispatch();
+}
+
+static void task_scheduler_data_source_handler(btstack_data_source_t *ds, btstack_data_source_callback_type_t type)
+{
+  UNUSED(ds);
+  UNUSED(type);
+
+  task_scheduler_dispatch();
+}
+
+void task_scheduler_init()
+{
+  task_scheduler.timer.process = &task_scheduler_timer_handler;
+
+  btstack_run_loop_set_data_source_handler(&task_scheduler.data_source, &task_scheduler_data_source_handler);
+  btstack_run_loop_enable_data_source_callbacks(&task_scheduler.data_source, DATA_SOURCE_CALLBACK_POLL);
+  btstack_run_loop_add_data_source(&task_scheduler.data_source);
+}
+
+// Adds a task, due at first_us (TASK_IDLE to wait for a signal)
+void task_add(Task *task, uint64_t first_us)
+{
+  Task **it = &task_scheduler.tasks;
+  while (*it && (*it)->priority >= task->priority)
+  {
+    it = &(*it)->next;
+  }
+  task->next = *it;
+  *it = task;
+
+  task->next_us = first_us;
+  task->signalled = 0;
+  task_scheduler_arm();
+}
+
+// Moves a task's next run, from the run loop (not from interrupts)
+void task_schedule(Task *task, uint64_t when_us)
+{
+  task->next_us = when_us;
+  task_scheduler_arm();
+}
+
+// Makes a task due right away. Safe to call from interrupt handlers.
+void task_signal_from_irq(Task *task)
+{
+  task->signalled = 1;
+  btstack_run_loop_poll_data_sources_from_irq();
+}
+
+// When the scheduler runs next, TASK_IDLE if no task is due. That is the
+// millisecond its timer fires at, sleeping until the task's own due time
+// would only wake up early.
+uint64_t task_scheduler_next_us()
+{
+  uint64_t next_us = task_scheduler_earliest_us();
+
+  return next_us == TASK_IDLE ? TASK_IDLE : (next_us + 999) / 1000 * 1000;
+}
+
+void task_scheduler_print()
+{
+  printf("Tasks: %" PRIu32 " overruns\n", task_scheduler.overruns);
+  for (Task *task = task_scheduler.tasks; task; task = task->next)
+  {
+    printf("  %-8s %8" PRIu32 " runs, max %6" PRIu32 " us (budget %6" PRIu32 "), %" PRIu32 " overruns, max %" PRIu32
+           " us late\n",
+           task->name, task->runs, task->max_run_us, task->budget_us, task->overruns, task->max_late_us);
+  }
+}
+
+#endif
@@ -0,0 +1,306 @@
+// *****************************************************************************
+// Telemetry stream
+//
+// Packs light/PIR samples into notification frames for the live sample stream.
+//
+// Raw frames ('R') carry every sample as ch0 u16, ch1 u16, pir u8.
+//
+// Compressed frames ('T') carry the samples as sample codec tokens (see
+// sample_codec.h), the same encoding as the sample log: zig-zag varint deltas
+// of ch0/ch1 with the PIR level, runs of identical samples as one token. A
+// still scene or a steady PIR level costs next to nothing.
+//
+// Deltas continue from the last sample of the previous frame, and a frame
+// ends with any pending run so it decodes on its own. Every
+// TELEMETRY_KEYFRAME_INTERVAL frames a keyframe carries the first sample
+// absolute, so a receiver that joins late or misses a frame (sequence number
+// gap) can resync.
+//
+// Frame layout:
+//   'R' seq u8, count u8, count * (ch0 u16, ch1 u16, pir u8)
+//   'T' seq u8, flags u8, count u8, [keyframe: ch0 u16, ch1 u16, pir u8],
+//       tokens
+// *****************************************************************************
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+#include <string.h>
+#include "sample_codec.h"
+#include "protocol.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+#define TELEMETRY_MODE_OFF 0
+#define TELEMETRY_MODE_RAW 1
+#define TELEMETRY_MODE_COMPRESSED 2
+
+#ifndef TELEMETRY_KEYFRAME_INTERVAL
+#define TELEMETRY_KEYFRAME_INTERVAL 8
+#endif
+
+#define TELEMETRY_MAX_FRAME_LEN 256
+#define TELEMETRY_MAX_SAMPLES_PER_FRAME 255
+
+#define TELEMETRY_FLAG_KEYFRAME 0x01
+
+#define TELEMETRY_RAW_HEADER_LEN 3
+#define TELEMETRY_RAW_SAMPLE_LEN 5
+#define TELEMETRY_HEADER_LEN 4
+#define TELEMETRY_KEYFRAME_HEADER_LEN 9
+
+// Worst case growth of a compressed frame per sample: a run flush and a full
+// token (2 + 3 + 3 bytes) plus the final run flush in telemetry_frame_end()
+// (2 bytes). Runs never exceed TELEMETRY_MAX_SAMPLES_PER_FRAME so their
+// varints are at most 2 bytes. Tighter than SAMPLE_ENCODER_PUT_RESERVE, which
+// doesn't know that and would leave no room in a 23 byte MTU.
+#define TELEMETRY_PUT_RESERVE 10
+
+typedef struct
+{
+  int mode;
+  uint8_t seq;
+  int frames_since_key;
+  int force_key;
+  SampleEncoder codec; // its prev carries over from frame to frame
+
+  // frame being built
+  uint8_t *buf;
+  int len;
+  int key;
+  int count;
+  int used; // bytes of buf taken, compressed frames
+} TelemetryEncoder;
+
+typedef struct
+{
+  int synced;
+  uint8_t next_seq;
+  Sample prev;
+} TelemetryDecoder;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void telemetry_encoder_init(TelemetryEncoder *enc, int mode);
+void telemetry_frame_begin(TelemetryEncoder *enc, uint8_t *buf, int len);
+int telemetry_frame_put(TelemetryEncoder *enc, const Sample *sample);
+int telemetry_frame_end(TelemetryEncoder *enc);
+int telemetry_frame_decode(TelemetryDecoder *dec, const uint8_t *buf, int len, Sample *samples, int max_samples);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+// Changing the mode always starts over with a keyframe
+void telemetry_encoder_init(TelemetryEncoder *enc, int mode)
+{
+  memset(enc, 0, sizeof(*enc));
+  enc->mode = mode;
+  enc->force_key = 1;
+}
+
+// Starts a frame in buf, which can hold up to len bytes. With buf NULL
+// telemetry_frame_put() only tells how many samples would fit.
+void telemetry_frame_begin(TelemetryEncoder *enc, uint8_t *buf, int len)
+{
+  enc->buf = buf;
+  enc->len = len < TELEMETRY_MAX_FRAME_LEN ? len : TELEMETRY_MAX_FRAME_LEN;
+  enc->count = 0;
+  enc->key = enc->force_key || enc->frames_since_key >= TELEMETRY_KEYFRAME_INTERVAL;
+  enc->used = enc->key ? TELEMETRY_KEYFRAME_HEADER_LEN : TELEMETRY_HEADER_LEN;
+}
+
+// Adds a sample to the frame. Returns 1 if it was added, 0 if the frame is full.
+int telemetry_frame_put(TelemetryEncoder *enc, const Sample *sample)
+{
+  if (enc->count >= TELEMETRY_MAX_SAMPLES_PER_FRAME)
+  {
+    return 0;
+  }
+
+  if (enc->mode == TELEMETRY_MODE_RAW)
+  {
+    int offset = TELEMETRY_RAW_HEADER_LEN + enc->count * TELEMETRY_RAW_SAMPLE_LEN;
+    if (offset + TELEMETRY_RAW_SAMPLE_LEN > enc->len)
+    {
+      return 0;
+    }
+
+    if (enc->buf)
+    {
+      enc->buf[offset + 0] = sample->ch0 & 0xFF;
+      enc->buf[offset + 1] = sample->ch0 >> 8;
+      enc->buf[offset + 2] = sample->ch1 & 0xFF;
+      enc->buf[offset + 3] = sample->ch1 >> 8;
+      enc->buf[offset + 4] = sample->pir;
+    }
+    enc->count++;
+    return 1;
+  }
+
+  if (enc->count == 0 && enc->key)
+  {
+    // The header holds it, the tokens continue from it
+    if (enc->used > enc->len)
+    {
+      return 0;
+    }
+    if (enc->buf)
+    {
+      enc->buf[4] = sample->ch0 & 0xFF;
+      enc->buf[5] = sample->ch0 >> 8;
+      enc->buf[6] = sample->ch1 & 0xFF;
+      enc->buf[7] = sample->ch1 >> 8;
+      enc->buf[8] = sample->pir;
+    }
+    sample_encoder_reset(&enc->codec, sample);
+    enc->count++;
+    return 1;
+  }
+
+  if (enc->used + TELEMETRY_PUT_RESERVE > enc->len)
+  {
+    return 0;
+  }
+
+  uint8_t token[SAMPLE_ENCODER_PUT_RESERVE];
+  int n = sample_encoder_put(&enc->codec, sample, token, sizeof(token));
+
+  if (enc->buf)
+  {
+    memcpy(enc->buf + enc->used, token, n);
+  }
+  enc->used += n;
+  enc->count++;
+  return 1;
+}
+
+// Finishes the frame. Returns its length, 0 if no sample was added.
+int telemetry_frame_end(TelemetryEncoder *enc)
+{
+  if (enc->count == 0)
+  {
+    return 0;
+  }
+
+  int n;
+
+  if (enc->mode == TELEMETRY_MODE_RAW)
+  {
+    enc->buf[0] = FRAME_TYPE_SAMPLES_RAW;
+    enc->buf[1] = enc->seq;
+    enc->buf[2] = enc->count;
+    n = TELEMETRY_RAW_HEADER_LEN + enc->count * TELEMETRY_RAW_SAMPLE_LEN;
+  }
+  else
+  {
+    n = enc->used + sample_encoder_flush(&enc->codec, enc->buf + enc->used, enc->len - enc->used);
+
+    enc->buf[0] = FRAME_TYPE_SAMPLES;
+    enc->buf[1] = enc->seq;
+    enc->buf[2] = enc->key ? TELEMETRY_FLAG_KEYFRAME : 0;
+    enc->buf[3] = enc->count;
+
+    if (enc->key)
+    {
+      enc->frames_since_key = 0;
+      enc->force_key = 0;
+    }
+    enc->frames_since_key++;
+  }
+
+  enc->seq++;
+
+  return n;
+}
+
+// Decodes a raw or compressed frame into samples. Returns the number of
+// samples, or -1 if the frame is malformed or we have to wait for a keyframe.
+int telemetry_frame_decode(TelemetryDecoder *dec, const uint8_t *buf, int len, Sample *samples, int max_samples)
+{
+  if (len < TELEMETRY_RAW_HEADER_LEN)
+  {
+    return -1;
+  }
+
+  if (buf[0] == FRAME_TYPE_SAMPLES_RAW)
+  {
+    int count = buf[2];
+    if (count > max_samples || TELEMETRY_RAW_HEADER_LEN + count * TELEMETRY_RAW_SAMPLE_LEN > len)
+    {
+      return -1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      const uint8_t *raw = buf + TELEMETRY_RAW_HEADER_LEN + i * TELEMETRY_RAW_SAMPLE_LEN;
+      samples[i].ch0 = raw[0] | (raw[1] << 8);
+      samples[i].ch1 = raw[2] | (raw[3] << 8);
+      samples[i].pir = raw[4];
+    }
+    return count;
+  }
+
+  if (buf[0] != FRAME_TYPE_SAMPLES || len < TELEMETRY_HEADER_LEN)
+  {
+    return -1;
+  }
+
+  uint8_t seq = buf[1];
+  uint8_t flags = buf[2];
+  int count = buf[3];
+  int offset = TELEMETRY_HEADER_LEN;
+  int decoded = 0;
+
+  if (count > max_samples)
+  {
+    return -1;
+  }
+
+  if (flags & TELEMETRY_FLAG_KEYFRAME)
+  {
+    if (len < TELEMETRY_KEYFRAME_HEADER_LEN || count == 0)
+    {
+      return -1;
+    }
+    dec->prev.ch0 = buf[4] | (buf[5] << 8);
+    dec->prev.ch1 = buf[6] | (buf[7] << 8);
+    dec->prev.pir = buf[8];
+    samples[decoded++] = dec->prev;
+    offset = TELEMETRY_KEYFRAME_HEADER_LEN;
+    dec->synced = 1;
+  }
+  else if (!dec->synced || seq != dec->next_seq)
+  {
+    dec->synced = 0;
+    return -1;
+  }
+
+  while (decoded < count)
+  {
+    uint32_t repeat;
+    int n = sample_decode(buf + offset, len - offset, &dec->prev, &repeat);
+
+    if (n == 0 || repeat > (uint32_t)(count - decoded))
+    {
+      dec->synced = 0;
+      return -1;
+    }
+    offset += n;
+
+    for (uint32_t i = 0; i < repeat; i++)
+    {
+      samples[decoded++] = dec->prev;
+    }
+  }
+
+  dec->next_seq = seq + 1;
+
+  return count;
+}
+
+#endif
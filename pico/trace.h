@@ -0,0 +1,200 @@
+// *****************************************************************************
+// Trace capture
+//
+// Records everything the firmware reacts to (light sensor readings, PIR edges,
+// BLE connection events and SPP commands) with the time it happened, so a
+// field issue can be replayed on the bench: download the trace with
+// CMD_TRACE_DOWNLOAD and feed it to the host build (host/replay.c).
+//
+// Records are appended to a RAM ring, the oldest ones are dropped when it is
+// full. Each record is
+//
+//   type u8, len u8, time_us u32 (low 32 bits of time_us_64()), len bytes
+//
+// and a trace file is just the records back to back. Like the sample log the
+// ring is addressed with an ever increasing byte offset, so a download can be
+// resumed and always starts at a record boundary.
+// *****************************************************************************
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "pico/stdlib.h"
+
+// *****************************************************************************
+// Definitions
+// *****************************************************************************
+
+// Set to 0 to leave the ring out of the build
+#ifndef TRACE_CAPTURE
+#define TRACE_CAPTURE 1
+#endif
+
+// ~7 minutes of 250 ms light readings without BLE traffic
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE (16 * 1024)
+#endif
+
+#define TRACE_HEADER_LEN 6
+#define TRACE_MAX_PAYLOAD_LEN 255
+
+// Bumped whenever a record layout changes
+#define TRACE_VERSION 1
+
+#define TRACE_RECORD_BOOT 'B'         // version u8, written at boot
+#define TRACE_RECORD_LIGHT 'L'        // ch0 u16, ch1 u16
+#define TRACE_RECORD_PIR 'M'          // level u8
+#define TRACE_RECORD_CONNECTED 'C'    // conn_interval u16 (units of 1.25 ms)
+#define TRACE_RECORD_MTU 'U'          // mtu u16
+#define TRACE_RECORD_SUBSCRIBED 'N'   // SPP notifications enabled
+#define TRACE_RECORD_DISCONNECTED 'D' //
+#define TRACE_RECORD_SPP 'W'          // SPP packet as received
+
+typedef struct
+{
+  uint32_t start; // offset of the oldest record
+  uint32_t end;   // offset right after the newest record
+  uint32_t dropped;
+#if TRACE_CAPTURE
+  uint8_t buffer[TRACE_BUFFER_SIZE];
+#endif
+} Trace;
+
+// *****************************************************************************
+// Global variables
+// *****************************************************************************
+
+static Trace trace;
+
+// *****************************************************************************
+// Function declarations
+// *****************************************************************************
+
+void trace_init();
+void trace_record(uint8_t type, const uint8_t *data, int len);
+void trace_record_at(uint8_t type, uint32_t time_us, const uint8_t *data, int len);
+uint32_t trace_start_offset();
+uint32_t trace_end_offset();
+int trace_read(uint32_t *offset, uint8_t *buf, int len);
+
+// *****************************************************************************
+// Function definitions
+// *****************************************************************************
+
+#if TRACE_CAPTURE
+static inline uint8_t trace_byte(uint32_t offset)
+{
+  return trace.buffer[offset % TRACE_BUFFER_SIZE];
+}
+
+static void trace_put(const uint8_t *data, int len)
+{
+  for (int i = 0; i < len; i++)
+  {
+    trace.buffer[trace.end % TRACE_BUFFER_SIZE] = data[i];
+    trace.end++;
+  }
+}
+#endif
+
+void trace_init()
+{
+  uint8_t version = TRACE_VERSION;
+
+  trace.start = 0;
+  trace.end = 0;
+  trace.dropped = 0;
+
+  trace_record(TRACE_RECORD_BOOT, &version, 1);
+}
+
+void trace_record(uint8_t type, const uint8_t *data, int len)
+{
+  trace_record_at(type, (uint32_t)time_us_64(), data, len);
+}
+
+// For inputs that were sampled a while before they are recorded. Payloads
+// longer than TRACE_MAX_PAYLOAD_LEN are cut.
+void trace_record_at(uint8_t type, uint32_t time_us, const uint8_t *data, int len)
+{
+#if TRACE_CAPTURE
+  if (len > TRACE_MAX_PAYLOAD_LEN)
+  {
+    len = TRACE_MAX_PAYLOAD_LEN;
+  }
+
+  // Drop whole records from the front until the new one fits
+  while (trace.end + TRACE_HEADER_LEN + len - trace.start > TRACE_BUFFER_SIZE)
+  {
+    trace.start += TRACE_HEADER_LEN + trace_byte(trace.start + 1);
+    trace.dropped++;
+  }
+
+  uint8_t header[TRACE_HEADER_LEN] = {
+      type,
+      (uint8_t)len,
+      (uint8_t)time_us,
+      (uint8_t)(time_us >> 8),
+      (uint8_t)(time_us >> 16),
+      (uint8_t)(time_us >> 24),
+  };
+  trace_put(header, sizeof(header));
+  trace_put(data, len);
+#else
+  (void)type;
+  (void)time_us;
+  (void)data;
+  (void)len;
+#endif
+}
+
+uint32_t trace_start_offset()
+{
+  return trace.start;
+}
+
+uint32_t trace_end_offset()
+{
+  return trace.end;
+}
+
+// Copies as many whole records as fit in len bytes, starting at *offset. If
+// *offset points at records that have already been dropped it is moved
+// forward to the oldest record. Returns the number of bytes copied, 0 at the
+// end.
+int trace_read(uint32_t *offset, uint8_t *buf, int len)
+{
+  int copied = 0;
+
+#if TRACE_CAPTURE
+  if (*offset < trace.start || *offset > trace.end)
+  {
+    *offset = trace.start;
+  }
+
+  uint32_t position = *offset;
+
+  while (position < trace.end)
+  {
+    int record_len = TRACE_HEADER_LEN + trace_byte(position + 1);
+    if (copied + record_len > len)
+    {
+      break;
+    }
+    for (int i = 0; i < record_len; i++)
+    {
+      buf[copied++] = trace_byte(position + i);
+    }
+    position += record_len;
+  }
+#else
+  (void)offset;
+  (void)buf;
+  (void)len;
+#endif
+
+  return copied;
+}
+
+#endif